@@ -0,0 +1,469 @@
+// bench_kdtree - Builds FlatKDTrees (or the pointer-based KDTree) over
+//                reproducible synthetic data sets, and reports the
+//                build time, the memory taken per point, the latency
+//                distribution of single queries and the throughput of
+//                batched queries for each number of threads, so that
+//                changes to the tree can be compared on equal terms.
+//                Built with KDTREE_STATS defined, it also reports the
+//                nodes visited and distances computed per query.
+//
+
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "kdtree.h"
+
+using namespace std;
+
+typedef double DATA_TYPE;
+
+// The number of clusters of the clustered data sets, and their spread
+// relative to the unit cube they are centered in
+#define CLUSTER_COUNT 32
+#define CLUSTER_SPREAD 0.02
+
+// The data sets the benchmark generates: points uniformly distributed
+// over the unit cube, normally distributed around CLUSTER_COUNT random
+// centers, or uniformly distributed over a box whose sides halve from
+// one axis to the next
+enum Distribution { UNIFORM, CLUSTERED, ANISOTROPIC };
+
+// The measurements of a tree over a data set
+struct BenchResult
+{
+   double             buildSeconds;
+   size_t             memoryUsage;   // bytes
+   vector<double>     latencies;     // of each single query, in us,
+				     // sorted
+   vector<double>     throughputs;   // queries/s of the batches, per
+				     // number of threads
+#ifdef KDTREE_STATS
+   KDTreeQueryStats   stats;         // of the single queries
+#endif
+};
+
+// Builds a FlatKDTree over 'points', and times the k nearest neighbor
+// queries of 'queries', each on its own from a single thread, and then
+// as batches spread over each number of threads
+BenchResult benchFlatTree(const vector<DATA_TYPE>& points,
+			  const vector<DATA_TYPE>& queries, int dimension,
+			  int k, const KDTreeBuildOptions& options,
+			  const vector<double>& threadCounts);
+
+// As benchFlatTree(), with a KDTree, which only finds the nearest
+// neighbor. Exits if the tree can't be built.
+BenchResult benchPointerTree(const vector<DATA_TYPE>& points,
+			     const vector<DATA_TYPE>& queries, int dimension,
+			     const vector<double>& threadCounts);
+
+// Fills 'coords' with 'count' points of the given distribution, drawn
+// with the given seed
+void generatePoints(Distribution distribution, int count, int dimension,
+		    uint64_t seed, vector<DATA_TYPE>& coords);
+
+// Parses a comma-separated list of values, such as "1e4,1e5", or exits
+vector<double> parseList(const char* list);
+
+// Returns the given percentile of sorted 'values'
+double percentile(const vector<double>& values, double fraction);
+
+// Describe the command line
+void printUsage();
+
+void printUsage()
+{
+   cout << "Usage: bench_kdtree [-g distributions] [-d dimensions] "
+	<< "[-n points] [-q queries] [-k neighbors] [-l leaf size] "
+	<< "[-o node layout] [-T tree] [-t threads] [-r seed]" << endl
+	<< "Lists are comma-separated; every combination is benchmarked."
+	<< endl
+	<< "  -g  uniform, clustered and/or anisotropic (default: all)"
+	<< endl
+	<< "  -d  dimensions (default 2,8,32)" << endl
+	<< "  -n  numbers of points (default 1e4,1e5,1e6)" << endl
+	<< "  -q  number of queries (default 10000)" << endl
+	<< "  -k  neighbors per query (default 1)" << endl
+	<< "  -l  maximum number of points per leaf (default "
+	<< DEFAULT_LEAF_SIZE << ")" << endl
+	<< "  -o  depth (depth-first, the default) or veb (van Emde Boas)"
+	<< endl
+	<< "  -T  flat (FlatKDTree, the default) or pointer (KDTree, whose "
+	<< "nodes are carved from an arena sized for the tree, and which "
+	<< "only finds the nearest neighbor)" << endl
+	<< "  -t  numbers of query threads (default: 1 and all cores)"
+	<< endl
+	<< "  -r  random seed (default 1)" << endl;
+}
+
+int
+main(int argc, char *argv[])
+{
+   // Parse the options
+   const char* distributionNames[] = {"uniform", "clustered",
+				      "anisotropic"};
+   vector<Distribution> distributions = {UNIFORM, CLUSTERED, ANISOTROPIC};
+   vector<double> dimensions = {2, 8, 32};
+   vector<double> pointCounts = {1e4, 1e5, 1e6};
+   vector<double> threadCounts = {1};
+   const int cores = max(1u, thread::hardware_concurrency());
+   if (cores > 1)
+   {
+      threadCounts.push_back(cores);
+   }
+   int queryCount = 10000;
+   int k = 1;
+   KDTreeBuildOptions options;
+   options.threads = 0;
+   bool pointerTree = false;
+   uint64_t seed = 1;
+   for (int arg = 1; arg < argc; arg += 2)
+   {
+      const string option(argv[arg]);
+      if (arg + 1 >= argc)
+      {
+	 printUsage();
+	 exit(1);
+      }
+
+      if (option == "-g")
+      {
+	 distributions.clear();
+	 stringstream names(argv[arg + 1]);
+	 string name;
+	 while (getline(names, name, ','))
+	 {
+	    const char** found = find(begin(distributionNames),
+				      end(distributionNames), name);
+	    if (found == end(distributionNames))
+	    {
+	       printUsage();
+	       exit(1);
+	    }
+	    distributions.push_back(
+	       Distribution(found - begin(distributionNames)));
+	 }
+      }
+      else if (option == "-d")
+      {
+	 dimensions = parseList(argv[arg + 1]);
+      }
+      else if (option == "-n")
+      {
+	 pointCounts = parseList(argv[arg + 1]);
+      }
+      else if (option == "-q")
+      {
+	 queryCount = atof(argv[arg + 1]);
+      }
+      else if (option == "-k")
+      {
+	 k = atoi(argv[arg + 1]);
+      }
+      else if (option == "-l")
+      {
+	 options.leafSize = atoi(argv[arg + 1]);
+      }
+      else if (option == "-o")
+      {
+	 const string layout(argv[arg + 1]);
+	 if (layout != "depth" && layout != "veb")
+	 {
+	    printUsage();
+	    exit(1);
+	 }
+	 options.nodeLayout =
+	    layout == "veb" ? LAYOUT_VAN_EMDE_BOAS : LAYOUT_DEPTH_FIRST;
+      }
+      else if (option == "-T")
+      {
+	 const string tree(argv[arg + 1]);
+	 if (tree != "flat" && tree != "pointer")
+	 {
+	    printUsage();
+	    exit(1);
+	 }
+	 pointerTree = tree == "pointer";
+      }
+      else if (option == "-t")
+      {
+	 threadCounts = parseList(argv[arg + 1]);
+      }
+      else if (option == "-r")
+      {
+	 seed = strtoull(argv[arg + 1], nullptr, 10);
+      }
+      else
+      {
+	 printUsage();
+	 exit(1);
+      }
+   }
+   if (queryCount < 1 || k < 1 || (pointerTree && k != 1))
+   {
+      printUsage();
+      exit(1);
+   }
+
+   cout << "Tree: " << (pointerTree ? "pointer" : "flat")
+	<< ", queries: " << queryCount << ", k: " << k;
+   if (!pointerTree)
+   {
+      cout << ", leaf size: " << options.leafSize << ", layout: "
+	   << (options.nodeLayout == LAYOUT_VAN_EMDE_BOAS ? "veb" : "depth");
+   }
+   cout << ", seed: " << seed << endl;
+   cout << left << setw(28) << "Benchmark" << right
+	<< setw(10) << "Build s" << setw(10) << "Bytes/pt"
+	<< setw(10) << "p50 us" << setw(10) << "p90 us"
+	<< setw(10) << "p99 us" << setw(10) << "p99.9 us";
+#ifdef KDTREE_STATS
+   cout << setw(10) << "Nodes/q" << setw(10) << "Dists/q";
+#endif
+   for (double threads : threadCounts)
+   {
+      cout << setw(14) << ("q/s @" + to_string(int(threads)));
+   }
+   cout << endl;
+
+   for (Distribution distribution : distributions)
+   {
+      for (double dimensionValue : dimensions)
+      {
+	 for (double pointValue : pointCounts)
+	 {
+	    const int dimension = dimensionValue;
+	    const int count = pointValue;
+	    vector<DATA_TYPE> points;
+	    vector<DATA_TYPE> queries;
+	    generatePoints(distribution, count, dimension, seed, points);
+	    generatePoints(distribution, queryCount, dimension, seed + 1,
+			   queries);
+
+	    const BenchResult result = pointerTree
+	       ? benchPointerTree(points, queries, dimension, threadCounts)
+	       : benchFlatTree(points, queries, dimension, k, options,
+			       threadCounts);
+
+	    const string name = string(distributionNames[distribution])
+	       + "/" + to_string(dimension) + "/" + to_string(count);
+	    cout << left << setw(28) << name << right << fixed
+		 << setprecision(3) << setw(10) << result.buildSeconds
+		 << setprecision(1)
+		 << setw(10) << double(result.memoryUsage)/count
+		 << setprecision(2)
+		 << setw(10) << percentile(result.latencies, 0.5)
+		 << setw(10) << percentile(result.latencies, 0.9)
+		 << setw(10) << percentile(result.latencies, 0.99)
+		 << setw(10) << percentile(result.latencies, 0.999);
+#ifdef KDTREE_STATS
+	    const KDTreeQueryStats& stats = result.stats;
+	    cout << setprecision(1)
+		 << setw(10) << double(stats.nodesVisited)/stats.queries
+		 << setw(10) << double(stats.distanceComputations)/stats.queries;
+#endif
+	    for (double throughput : result.throughputs)
+	    {
+	       cout << setprecision(0) << setw(14) << throughput;
+	    }
+	    cout << defaultfloat << endl;
+	 }
+      }
+   }
+}
+
+BenchResult benchFlatTree(const vector<DATA_TYPE>& points,
+			  const vector<DATA_TYPE>& queries, int dimension,
+			  int k, const KDTreeBuildOptions& options,
+			  const vector<double>& threadCounts)
+{
+   const int count = points.size()/dimension;
+   const int queryCount = queries.size()/dimension;
+   BenchResult result;
+
+   FlatKDTree<DATA_TYPE> tree;
+   const auto buildStart = chrono::steady_clock::now();
+   tree.build(points.data(), count, dimension, options);
+   const chrono::duration<double> buildElapsed =
+      chrono::steady_clock::now() - buildStart;
+   result.buildSeconds = buildElapsed.count();
+   result.memoryUsage = tree.memoryUsage();
+
+   // Time each query on its own, from a single thread, reusing one
+   // context so that the queries allocate nothing
+   vector<Neighbor> results(size_t(queryCount)*k);
+   result.latencies.resize(queryCount);
+   KDTreeQueryContext context;
+   resetKDTreeQueryStats();
+   for (int qq=0; qq<queryCount; ++qq)
+   {
+      const auto start = chrono::steady_clock::now();
+      const vector<Neighbor>& neighbors = tree.kNearestNeighbors(
+	 &queries[size_t(qq)*dimension], k, context);
+      const chrono::duration<double, micro> elapsed =
+	 chrono::steady_clock::now() - start;
+      result.latencies[qq] = elapsed.count();
+      copy(neighbors.begin(), neighbors.end(),
+	   results.begin() + size_t(qq)*k);
+   }
+   sort(result.latencies.begin(), result.latencies.end());
+#ifdef KDTREE_STATS
+   result.stats = kdTreeQueryStats();
+#endif
+
+   // ...then answer them as batches
+   for (double threads : threadCounts)
+   {
+      const auto start = chrono::steady_clock::now();
+      tree.kNearestNeighborsBatch(queries.data(), queryCount, k,
+				  results.data(), threads);
+      const chrono::duration<double> elapsed =
+	 chrono::steady_clock::now() - start;
+      result.throughputs.push_back(queryCount/elapsed.count());
+   }
+   return result;
+}
+
+BenchResult benchPointerTree(const vector<DATA_TYPE>& points,
+			     const vector<DATA_TYPE>& queries, int dimension,
+			     const vector<double>& threadCounts)
+{
+   const int count = points.size()/dimension;
+   const int queryCount = queries.size()/dimension;
+   BenchResult result;
+
+   // KDTree builds from a vector per point, which isn't timed. Its
+   // arena is sized for the tree up front, so a misjudged size fails
+   // the build.
+   vector< vector<DATA_TYPE> > rows(count);
+   for (int pp=0; pp<count; ++pp)
+   {
+      rows[pp].assign(&points[size_t(pp)*dimension],
+		      &points[size_t(pp + 1)*dimension]);
+   }
+   KDTree<DATA_TYPE> tree;
+   const auto buildStart = chrono::steady_clock::now();
+   if (!tree.build(rows))
+   {
+      cerr << "Failed to build the KDTree" << endl;
+      exit(1);
+   }
+   const chrono::duration<double> buildElapsed =
+      chrono::steady_clock::now() - buildStart;
+   result.buildSeconds = buildElapsed.count();
+   result.memoryUsage = tree.memoryUsage();
+
+   vector<Neighbor> results(queryCount);
+   result.latencies.resize(queryCount);
+   resetKDTreeQueryStats();
+   for (int qq=0; qq<queryCount; ++qq)
+   {
+      const auto start = chrono::steady_clock::now();
+      results[qq] = tree.nearestNeighbor(&queries[size_t(qq)*dimension]);
+      const chrono::duration<double, micro> elapsed =
+	 chrono::steady_clock::now() - start;
+      result.latencies[qq] = elapsed.count();
+   }
+   sort(result.latencies.begin(), result.latencies.end());
+#ifdef KDTREE_STATS
+   result.stats = kdTreeQueryStats();
+#endif
+
+   for (double threads : threadCounts)
+   {
+      const auto start = chrono::steady_clock::now();
+      parallelFor(queryCount, threads,
+		  [&](size_t qq, int)
+		  {
+		     results[qq] =
+			tree.nearestNeighbor(&queries[size_t(qq)*dimension]);
+		  });
+      const chrono::duration<double> elapsed =
+	 chrono::steady_clock::now() - start;
+      result.throughputs.push_back(queryCount/elapsed.count());
+   }
+   return result;
+}
+
+void generatePoints(Distribution distribution, int count, int dimension,
+		    uint64_t seed, vector<DATA_TYPE>& coords)
+{
+   mt19937_64 generator(seed);
+   uniform_real_distribution<DATA_TYPE> unit(0, 1);
+   coords.resize(size_t(count)*dimension);
+
+   switch (distribution)
+   {
+   case UNIFORM:
+      for (DATA_TYPE& value : coords)
+      {
+	 value = unit(generator);
+      }
+      break;
+
+   case CLUSTERED:
+   {
+      vector<DATA_TYPE> centers(CLUSTER_COUNT*dimension);
+      for (DATA_TYPE& value : centers)
+      {
+	 value = unit(generator);
+      }
+      uniform_int_distribution<int> cluster(0, CLUSTER_COUNT - 1);
+      normal_distribution<DATA_TYPE> spread(0, CLUSTER_SPREAD);
+      for (int pp=0; pp<count; ++pp)
+      {
+	 const DATA_TYPE* center = &centers[cluster(generator)*dimension];
+	 for (int aa=0; aa<dimension; ++aa)
+	 {
+	    coords[size_t(pp)*dimension + aa] = center[aa] + spread(generator);
+	 }
+      }
+      break;
+   }
+
+   case ANISOTROPIC:
+      for (int pp=0; pp<count; ++pp)
+      {
+	 DATA_TYPE side = 1;
+	 for (int aa=0; aa<dimension; ++aa)
+	 {
+	    coords[size_t(pp)*dimension + aa] = side*unit(generator);
+	    side /= 2;
+	 }
+      }
+      break;
+   }
+}
+
+vector<double> parseList(const char* list)
+{
+   vector<double> values;
+   stringstream items(list);
+   string item;
+   while (getline(items, item, ','))
+   {
+      char* end;
+      const double value = strtod(item.c_str(), &end);
+      if (*end || value < 1)
+      {
+	 printUsage();
+	 exit(1);
+      }
+      values.push_back(value);
+   }
+   return values;
+}
+
+double percentile(const vector<double>& values, double fraction)
+{
+   const size_t index = min<size_t>(fraction*values.size(),
+				     values.size() - 1);
+   return values[index];
+}
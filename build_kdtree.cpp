@@ -5,93 +5,239 @@
 #include <stdlib.h>
 #include <iostream>
 #include <fstream>
-#include <sstream>
 #include <vector>
 
+#include "csv_reader.h"
 #include "kdtree.h"
 
 using namespace std;
 
 // Our KD tree code is templated on dimension as well as
-// data-type. For the sake of this example, we are using
-// double-precision floating point numbers
-typedef double DATA_TYPE;
+// data-type. The tree holds double-precision floating point numbers,
+// or single-precision ones with '-p float', which halves its size.
+
+// Read the data set, and build and serialize a tree of DATA_TYPE
+// coordinates from it, or exit. If 'memoryMegabytes' is positive, the
+// tree is built on disk without holding more than about that much of
+// the data set in memory. If 'shardDepth' is positive, the tree is
+// split that many levels below its root into shards.
+template<class DATA_TYPE>
+void buildTree(const char* dataFilename, const KDTreeBuildOptions& options,
+	       double memoryMegabytes, int shardDepth);
+
+void printUsage()
+{
+   cout << "Usage: build_kdtree [-l leaf size] [-t threads] "
+	<< "[-s split rule] [-o node layout] [-p float|double] "
+	<< "[-m megabytes | -S shard depth] <data set>" << endl
+	<< "You must specify a data set as the last argument." << endl
+	<< "  -l  maximum number of points per leaf (default "
+	<< DEFAULT_LEAF_SIZE << ")" << endl
+	<< "  -t  number of build threads (default: all cores)" << endl
+	<< "  -s  how each node's split axis is chosen: cycle (default), "
+	<< "extent (widest extent) or variance (highest variance)" << endl
+	<< "  -o  order of the nodes in the tree: depth (depth-first, the "
+	<< "default) or veb (van Emde Boas)" << endl
+	<< "  -p  precision of the stored coordinates (default double)"
+	<< endl
+	<< "  -m  build the tree on disk, holding about this many megabytes "
+	<< "of points in memory, for data sets too large to load" << endl
+	<< "  -S  split the tree this many levels below its root into "
+	<< "shard files, <data set>.kdtree.0 and up, routed to by "
+	<< "<data set>.kdtree" << endl;
+}
 
 int
 main(int argc, char *argv[])
 {
+   // Parse the options, which precede the file name
+   KDTreeBuildOptions options;
+   options.threads = 0;
+   bool singlePrecision = false;
+   double memoryMegabytes = 0;
+   int shardDepth = 0;
+   int arg = 1;
+   for (; arg < argc && argv[arg][0] == '-'; arg += 2)
+   {
+      const string option(argv[arg]);
+      if (arg + 1 >= argc)
+      {
+	 printUsage();
+	 exit(1);
+      }
+
+      if (option == "-l")
+      {
+	 options.leafSize = atoi(argv[arg + 1]);
+      }
+      else if (option == "-t")
+      {
+	 options.threads = atoi(argv[arg + 1]);
+      }
+      else if (option == "-s")
+      {
+	 const string rule(argv[arg + 1]);
+	 if (rule == "cycle")
+	 {
+	    options.splitRule = SPLIT_CYCLE;
+	 }
+	 else if (rule == "extent")
+	 {
+	    options.splitRule = SPLIT_WIDEST_EXTENT;
+	 }
+	 else if (rule == "variance")
+	 {
+	    options.splitRule = SPLIT_MAX_VARIANCE;
+	 }
+	 else
+	 {
+	    printUsage();
+	    exit(1);
+	 }
+      }
+      else if (option == "-o")
+      {
+	 const string layout(argv[arg + 1]);
+	 if (layout == "depth")
+	 {
+	    options.nodeLayout = LAYOUT_DEPTH_FIRST;
+	 }
+	 else if (layout == "veb")
+	 {
+	    options.nodeLayout = LAYOUT_VAN_EMDE_BOAS;
+	 }
+	 else
+	 {
+	    printUsage();
+	    exit(1);
+	 }
+      }
+      else if (option == "-m")
+      {
+	 memoryMegabytes = atof(argv[arg + 1]);
+	 if (memoryMegabytes <= 0)
+	 {
+	    printUsage();
+	    exit(1);
+	 }
+      }
+      else if (option == "-S")
+      {
+	 shardDepth = atoi(argv[arg + 1]);
+	 if (shardDepth < 1)
+	 {
+	    printUsage();
+	    exit(1);
+	 }
+      }
+      else if (option == "-p")
+      {
+	 const string precision(argv[arg + 1]);
+	 if (precision != "float" && precision != "double")
+	 {
+	    printUsage();
+	    exit(1);
+	 }
+	 singlePrecision = precision == "float";
+      }
+      else
+      {
+	 printUsage();
+	 exit(1);
+      }
+   }
+
    // Minimal sanity checking of user input
-   if (argc != 2)
+   if (argc - arg != 1 || (memoryMegabytes > 0 && shardDepth > 0))
    {
-      cout << "You must specify a data set as the first argument" << endl;
+      printUsage();
       exit(1);
    }
+
+   const char* dataFilename = argv[arg];
+   if (singlePrecision)
+   {
+      buildTree<float>(dataFilename, options, memoryMegabytes, shardDepth);
+   }
    else
    {
-      cout << "Reading data from " << argv[1] << endl;
+      buildTree<double>(dataFilename, options, memoryMegabytes, shardDepth);
    }
+}
+
+template<class DATA_TYPE>
+void buildTree(const char* dataFilename, const KDTreeBuildOptions& options,
+	       double memoryMegabytes, int shardDepth)
+{
+   string serializedFilename(dataFilename);
+   serializedFilename += ".kdtree";
 
-   // Read the first line to determine the dimensionality
-   ifstream dataFile(argv[1], ifstream::in);
-   int dimension = 0;
-   if (dataFile.is_open())
+   if (memoryMegabytes > 0)
    {
-      string line;
-      if (getline(dataFile, line))
+      CsvPointReader<DATA_TYPE> reader;
+      if (!reader.open(dataFilename, options.threads))
       {
-	 stringstream ss(line);
-	 DATA_TYPE val;
-	 while (ss >> val)
-	 {
-	    dimension++;
-	    if (ss.peek() == ',')
-	       ss.ignore();
-	 }
+	 exit(1);
       }
+
+      // The budget counts each copy of a point held in memory, which
+      // comes with an index or two
+      KDTreeExternalBuildOptions externalOptions;
+      const double pointBytes =
+	 reader.dimension()*sizeof(DATA_TYPE) + 2*sizeof(int);
+      externalOptions.memoryPoints =
+	 max(1.0, memoryMegabytes*(1 << 20)/pointBytes);
+      cout << "Building KD tree from " << dataFilename << " into "
+	   << serializedFilename << ", holding up to "
+	   << externalOptions.memoryPoints << " points in memory" << endl;
+      if (!FlatKDTree<DATA_TYPE>::buildFile(reader, reader.dimension(),
+					    serializedFilename, options,
+					    externalOptions)
+	  || reader.failed())
+      {
+	 cerr << "Failed to successfully build the KD tree" << endl;
+	 remove(serializedFilename.c_str());
+	 exit(1);
+      }
+      return;
    }
 
-   if (dimension < 1)
+   cout << "Reading data from " << dataFilename << endl;
+
+   PointSet<DATA_TYPE> points;
+   if (!readPointsFromFile(dataFilename, points, options.threads))
    {
-      cout << argv[1] << " is improperly formatted or empty";
       exit(1);
    }
+   cout << "Read " << points.size() << " vectors of size "
+	<< points.dimension << endl;
 
-   // Rewind the file to the beginnning and parse
-   dataFile.seekg (0, dataFile.beg);
-   vector< vector<DATA_TYPE> > data;
-   if (dataFile.is_open())
+   if (shardDepth > 0)
    {
-      string line;
-      while (getline(dataFile, line))
+      cout << "Building a KD tree split " << shardDepth << " levels below "
+	   << "its root into shards, routed to by " << serializedFilename
+	   << endl;
+      if (!ShardedKDTree<DATA_TYPE>::buildFiles(
+	     points.coords.data(), points.size(), points.dimension,
+	     shardDepth, serializedFilename, options))
       {
-	 stringstream ss(line);
-	 vector<DATA_TYPE> lineData;
-	 DATA_TYPE val;
-	 while (ss >> val)
-	 {
-	    lineData.push_back(val);
-	    if (ss.peek() == ',')
-	       ss.ignore();
-	 }
-	 data.push_back(lineData);
+	 cerr << "Failed to successfully build the KD tree" << endl;
+	 exit(1);
       }
-      dataFile.close();
+      return;
    }
 
-   cout << "Read " << data.size() << " vectors of size " << dimension
-	<< endl;
-
-   KDTree<DATA_TYPE> tree;
-   if (!tree.build(data))
+   // The tree reads the points in place
+   FlatKDTree<DATA_TYPE> tree;
+   if (!tree.build(points.coords.data(), points.size(), points.dimension,
+		   options))
    {
       cerr << "Failed to successfully build the KD tree" << endl;
       exit(1);
    }
 
    // Serialize the tree out to disk
-   string serializedFilename(argv[1]);
-   serializedFilename += ".kdtree";
-   ofstream outfile (serializedFilename);
+   ofstream outfile (serializedFilename, ofstream::binary);
 
    cout << "Serializing KD tree to " << serializedFilename << endl;
    outfile << tree;
@@ -0,0 +1,476 @@
+// csv_reader - Reads a text file of consistently dimensioned points,
+//              one per line with comma-separated values, into a
+//              single row-major buffer. The file is mapped into memory
+//              (or read in one go where mapping isn't available), split
+//              into chunks at line boundaries, and the chunks are
+//              parsed in parallel with std::from_chars. Files too
+//              large to hold in memory can instead be read a batch of
+//              points at a time with CsvPointReader.
+//
+#ifndef CSV_READER_H
+#define CSV_READER_H
+
+#include <string.h>
+#include <charconv>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "kdtree.h"
+
+// The number of bytes parsed by each task
+#define CSV_CHUNK_SIZE (1 << 22)
+
+// A set of points, stored one after another in a single buffer
+template<class T>
+struct PointSet
+{
+   PointSet() : dimension(0) {}
+
+   size_t size() const
+   {
+      return dimension > 0 ? coords.size()/dimension : 0;
+   }
+   const T* operator[](size_t pointIdx) const
+   {
+      return &coords[pointIdx*dimension];
+   }
+
+   int            dimension;
+   std::vector<T> coords;     // dimension values per point
+};
+
+// Reads the points of a text file into 'points', parsing with 'threads'
+// threads (all of the hardware's threads if 'threads' is less than
+// one). Blank lines are ignored, and values may be surrounded by
+// spaces. Returns false if the file can't be read, is empty, or holds
+// a malformed line or a line with a different number of values than
+// the first.
+template<class T>
+bool readPointsFromFile(const char* filename, PointSet<T>& points,
+			int threads = 0);
+
+// Reads the points of a text file in the format readPointsFromFile
+// reads, a batch at a time, so that only a few chunks of the file's
+// points are held in memory at once. It can be passed as the source of
+// FlatKDTree::buildFile.
+template<class T>
+class CsvPointReader
+{
+  public:
+   CsvPointReader() : _data(nullptr), _end(nullptr), _dimension(0),
+		      _threads(0), _failed(false), _consumed(0) {}
+
+   // Opens the file, and reads its dimension from its first line with
+   // any values. Chunks are parsed with 'threads' threads (all of the
+   // hardware's threads if less than one). Returns false if the file
+   // can't be read or holds no points.
+   bool open(const char* filename, int threads = 0);
+
+   int dimension() const { return _dimension; }
+
+   // Copies up to 'maxPoints' more points to 'rows', one after another,
+   // returning how many were copied: 0 once all of them have been
+   // read, or if a line is malformed, which failed() then reports
+   size_t operator()(T* rows, size_t maxPoints);
+
+   bool failed() const { return _failed; }
+
+  private:
+   // Parses the next chunks of the file into '_values'
+   bool parseChunks();
+
+   std::string                 _filename;
+   std::shared_ptr<const char> _contents;
+   const char*                 _data;      // next unparsed line
+   const char*                 _end;
+   int                         _dimension;
+   int                         _threads;
+   bool                        _failed;
+   std::vector<T>              _values;    // parsed, not yet copied
+   size_t                      _consumed;  // values copied from _values
+};
+
+
+//////////////////
+// Implementations
+//
+
+// Returns the contents of a file, mapped into memory where possible,
+// setting 'length' to its size. Returns null if the file can't be read.
+inline std::shared_ptr<const char> fileContents(const char* filename,
+						size_t& length)
+{
+   using namespace std;
+
+   length = 0;
+#if defined(__unix__) || defined(__APPLE__)
+   const int fd = open(filename, O_RDONLY);
+   if (fd < 0)
+   {
+      return nullptr;
+   }
+   struct stat status;
+   if (fstat(fd, &status) != 0 || status.st_size == 0)
+   {
+      close(fd);
+      return nullptr;
+   }
+
+   const size_t mappedLength = status.st_size;
+   void* address =
+      mmap(nullptr, mappedLength, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (address != MAP_FAILED)
+   {
+      // The file is read from start to end, once
+      madvise(address, mappedLength, MADV_SEQUENTIAL);
+      length = mappedLength;
+      auto unmap = [mappedLength](const char* data)
+      {
+	 munmap(const_cast<char*>(data), mappedLength);
+      };
+      return shared_ptr<const char>(static_cast<const char*>(address),
+				    unmap);
+   }
+#endif
+
+   ifstream file(filename, ifstream::in | ifstream::binary);
+   if (!file.seekg(0, file.end))
+   {
+      return nullptr;
+   }
+   const streamoff size = file.tellg();
+   file.seekg(0, file.beg);
+   if (size <= 0)
+   {
+      return nullptr;
+   }
+
+   shared_ptr<char> buffer(new char[size], default_delete<char[]>());
+   if (!file.read(buffer.get(), size))
+   {
+      return nullptr;
+   }
+   length = size;
+   return buffer;
+}
+
+// Parses the lines in [begin, end), appending their values to 'coords'.
+// 'dimension' is the number of values per line, or 0 to take it from
+// the first non-blank line. Returns null on success, or where parsing
+// failed.
+template<class T>
+const char* parsePoints(const char* begin, const char* end, int& dimension,
+			std::vector<T>& coords)
+{
+   auto isSpace = [](char c)
+   {
+      return c == ' ' || c == '\t' || c == '\r';
+   };
+
+   const char* line = begin;
+   while (line < end)
+   {
+      const char* lineEnd =
+	 static_cast<const char*>(memchr(line, '\n', end - line));
+      if (!lineEnd)
+      {
+	 lineEnd = end;
+      }
+
+      int values = 0;
+      const char* cursor = line;
+      while (cursor < lineEnd && isSpace(*cursor))
+      {
+	 ++cursor;
+      }
+      while (cursor < lineEnd)
+      {
+	 // from_chars doesn't accept an explicit plus sign
+	 if (*cursor == '+')
+	 {
+	    ++cursor;
+	 }
+
+	 T value;
+	 const std::from_chars_result parsed =
+	    std::from_chars(cursor, lineEnd, value);
+	 if (parsed.ec != std::errc())
+	 {
+	    return cursor;
+	 }
+	 coords.push_back(value);
+	 ++values;
+
+	 // Values are separated by a comma; a trailing one is allowed
+	 cursor = parsed.ptr;
+	 while (cursor < lineEnd && isSpace(*cursor))
+	 {
+	    ++cursor;
+	 }
+	 if (cursor < lineEnd)
+	 {
+	    if (*cursor != ',')
+	    {
+	       return cursor;
+	    }
+	    ++cursor;
+	    while (cursor < lineEnd && isSpace(*cursor))
+	    {
+	       ++cursor;
+	    }
+	 }
+      }
+
+      if (values > 0)
+      {
+	 if (dimension == 0)
+	 {
+	    dimension = values;
+	 }
+	 else if (values != dimension)
+	 {
+	    return line;
+	 }
+      }
+      line = lineEnd + 1;
+   }
+
+   return nullptr;
+}
+
+template<class T>
+bool readPointsFromFile(const char* filename, PointSet<T>& points,
+			int threads)
+{
+   using namespace std;
+
+   points.dimension = 0;
+   points.coords.clear();
+
+   size_t length;
+   const shared_ptr<const char> contents = fileContents(filename, length);
+   if (!contents)
+   {
+      cerr << "Unable to read " << filename << endl;
+      return false;
+   }
+   const char* data = contents.get();
+   const char* end = data + length;
+
+   // Take the dimension from the first line which holds any values
+   for (const char* line = data; points.dimension == 0 && line < end; )
+   {
+      const char* lineEnd =
+	 static_cast<const char*>(memchr(line, '\n', end - line));
+      if (!lineEnd)
+      {
+	 lineEnd = end;
+      }
+      vector<T> values;
+      if (parsePoints(line, lineEnd, points.dimension, values))
+      {
+	 cerr << filename << ":" << 1 + count(data, line, '\n')
+	      << ": malformed point" << endl;
+	 return false;
+      }
+      line = lineEnd + 1;
+   }
+   if (points.dimension == 0)
+   {
+      cerr << filename << " holds no points" << endl;
+      return false;
+   }
+
+   // Split the file into chunks which each start at the beginning of a
+   // line
+   vector<const char*> starts(1, data);
+   while (end - starts.back() > CSV_CHUNK_SIZE)
+   {
+      const char* next = static_cast<const char*>(
+	 memchr(starts.back() + CSV_CHUNK_SIZE, '\n',
+		end - starts.back() - CSV_CHUNK_SIZE));
+      if (!next)
+      {
+	 break;
+      }
+      starts.push_back(next + 1);
+   }
+   starts.push_back(end);
+
+   // Parse each chunk into its own buffer
+   const size_t chunks = starts.size() - 1;
+   vector<vector<T>> chunkCoords(chunks);
+   vector<const char*> errors(chunks, nullptr);
+   parallelFor(chunks, threads,
+	       [&](size_t cc, int)
+	       {
+		  int dimension = points.dimension;
+
+		  // Preallocate for values of about eight characters
+		  chunkCoords[cc].reserve((starts[cc + 1] - starts[cc])/8);
+		  errors[cc] = parsePoints(starts[cc], starts[cc + 1],
+					   dimension, chunkCoords[cc]);
+	       }, 1);
+
+   for (size_t cc=0; cc<chunks; ++cc)
+   {
+      if (errors[cc])
+      {
+	 cerr << filename << ":" << 1 + count(data, errors[cc], '\n')
+	      << ": malformed point" << endl;
+	 points.dimension = 0;
+	 return false;
+      }
+   }
+
+   // Gather the chunks into a single buffer
+   if (chunks == 1)
+   {
+      points.coords.swap(chunkCoords[0]);
+      return true;
+   }
+   vector<size_t> offsets(chunks + 1, 0);
+   for (size_t cc=0; cc<chunks; ++cc)
+   {
+      offsets[cc + 1] = offsets[cc] + chunkCoords[cc].size();
+   }
+   points.coords.resize(offsets[chunks]);
+   parallelFor(chunks, threads,
+	       [&](size_t cc, int)
+	       {
+		  copy(chunkCoords[cc].begin(), chunkCoords[cc].end(),
+		       points.coords.begin() + offsets[cc]);
+		  vector<T>().swap(chunkCoords[cc]);
+	       }, 1);
+   return true;
+}
+
+template<class T>
+bool CsvPointReader<T>::open(const char* filename, int threads)
+{
+   using namespace std;
+
+   _filename = filename;
+   _threads = threads < 1 ? max(1u, thread::hardware_concurrency()) : threads;
+   _failed = false;
+   _values.clear();
+   _consumed = 0;
+   _dimension = 0;
+
+   size_t length;
+   _contents = fileContents(filename, length);
+   if (!_contents)
+   {
+      cerr << "Unable to read " << filename << endl;
+      return false;
+   }
+   _data = _contents.get();
+   _end = _data + length;
+
+   // Take the dimension from the first line which holds any values
+   for (const char* line = _data; _dimension == 0 && line < _end; )
+   {
+      const char* lineEnd =
+	 static_cast<const char*>(memchr(line, '\n', _end - line));
+      if (!lineEnd)
+      {
+	 lineEnd = _end;
+      }
+      if (parsePoints(line, lineEnd, _dimension, _values))
+      {
+	 cerr << filename << ":" << 1 + count(_data, line, '\n')
+	      << ": malformed point" << endl;
+	 return false;
+      }
+      line = lineEnd + 1;
+   }
+   _values.clear();
+   if (_dimension == 0)
+   {
+      cerr << filename << " holds no points" << endl;
+      return false;
+   }
+   return true;
+}
+
+template<class T>
+size_t CsvPointReader<T>::operator()(T* rows, size_t maxPoints)
+{
+   size_t copied = 0;
+   while (copied < maxPoints && !_failed)
+   {
+      if (_consumed == _values.size() && !parseChunks())
+      {
+	 break;
+      }
+      const size_t count = std::min(maxPoints - copied,
+				    (_values.size() - _consumed)/_dimension);
+      std::copy(&_values[_consumed], &_values[_consumed] + count*_dimension,
+		rows + copied*_dimension);
+      _consumed += count*_dimension;
+      copied += count;
+   }
+   return _failed ? 0 : copied;
+}
+
+template<class T>
+bool CsvPointReader<T>::parseChunks()
+{
+   using namespace std;
+
+   _values.clear();
+   _consumed = 0;
+   if (_data >= _end)
+   {
+      return false;
+   }
+
+   // Split the next part of the file into a chunk per thread, each
+   // starting at the beginning of a line
+   vector<const char*> starts(1, _data);
+   while (int(starts.size()) <= _threads && starts.back() < _end)
+   {
+      const char* next = nullptr;
+      if (_end - starts.back() > CSV_CHUNK_SIZE)
+      {
+	 next = static_cast<const char*>(
+	    memchr(starts.back() + CSV_CHUNK_SIZE, '\n',
+		   _end - starts.back() - CSV_CHUNK_SIZE));
+      }
+      starts.push_back(next ? next + 1 : _end);
+   }
+   _data = starts.back();
+
+   // Parse each chunk into its own buffer, and gather them
+   const size_t chunks = starts.size() - 1;
+   vector<vector<T>> chunkCoords(chunks);
+   vector<const char*> errors(chunks, nullptr);
+   parallelFor(chunks, _threads,
+	       [&](size_t cc, int)
+	       {
+		  int dimension = _dimension;
+		  chunkCoords[cc].reserve((starts[cc + 1] - starts[cc])/8);
+		  errors[cc] = parsePoints(starts[cc], starts[cc + 1],
+					   dimension, chunkCoords[cc]);
+	       }, 1);
+   for (size_t cc=0; cc<chunks; ++cc)
+   {
+      if (errors[cc])
+      {
+	 cerr << _filename << ":"
+	      << 1 + count(_contents.get(), errors[cc], '\n')
+	      << ": malformed point" << endl;
+	 _failed = true;
+	 return false;
+      }
+      _values.insert(_values.end(), chunkCoords[cc].begin(),
+		     chunkCoords[cc].end());
+   }
+   return true;
+}
+
+#endif
@@ -2,444 +2,6473 @@
 //          is templated on point dimension as well as data type.
 //          This class supports building from a vector of points,
 //          nearest neighbor queries, serialization to a text file, as
-//          well as deserialization.
+//          well as deserialization. FlatKDTree offers the same
+//          interface over a compact, pointer-free array layout, which
+//          is serialized in a binary format that can be queried in
+//          place from a memory-mapped file. DynamicKDTree keeps a
+//          forest of FlatKDTrees that points can be inserted into and
+//          erased from, and ShardedKDTree splits one into shard files
+//          behind a small routing index.
 //
+#ifndef KDTREE_H
+#define KDTREE_H
+
 #include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <exception>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <map>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <numeric>
+#include <optional>
+#include <random>
 #include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
 #include <vector>
 
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+// A tree whose dimension is only known at run time
+#define DYNAMIC_DIMENSION 0
+
+// The type used to hold a single point: a fixed-size array when the
+// dimension is known at compile time, so no heap allocation is needed,
+// or a vector otherwise
+template<class T, int Dim>
+struct PointStorage
+{
+   typedef std::array<T, Dim> type;
+
+   static type create(int /*dimension*/)
+   {
+      return type();
+   }
+};
+
+template<class T>
+struct PointStorage<T, DYNAMIC_DIMENSION>
+{
+   typedef std::vector<T> type;
+
+   static type create(int dimension)
+   {
+      return type(dimension);
+   }
+};
+
 
 // A helper class to track a templated point along with an index that
 // refers back to the primal dataset
-template<class T>
+template<class T, int Dim = DYNAMIC_DIMENSION>
 class IndexedPoint
 {
   public:
-  IndexedPoint() : index(-1)
+  IndexedPoint() : index(-1), point()
    {}
 
-  IndexedPoint(int idx, const std::vector<T>& pt)
+  IndexedPoint(int idx, const typename PointStorage<T, Dim>::type& pt)
      : index(idx)
      , point(pt)
    {}
 
    int index;
-   std::vector<T> point;
+   typename PointStorage<T, Dim>::type point;
+};
+
+
+// One result of a k-nearest-neighbor query: the index of a point in
+// the primal dataset, along with its squared distance from the query
+struct Neighbor
+{
+   int index;
+   double sqrDistance;
+
+   bool operator<(const Neighbor& other) const
+   {
+      return sqrDistance < other.sqrDistance;
+   }
 };
 
 
 // Forward declarations
 //
-template<class T> class KDTree;
+class KNearestHeap;
+class EuclideanMetric;
+template<class T, class Metric = EuclideanMetric> class KDTree;
+template<class T, int Dim> class FlatKDTree;
+template<class T, int Dim> class DynamicKDTree;
+template<class Q, class T, int Dim> class QuantizedKDTree;
+template<class T, int Dim> class ShardedKDTree;
+template<class T> class KDTreeScratchFile;
 
 
 /////////////////////
 // Class declarations
-template<class T> class KDNode
+
+// The distance metrics a KDTree can be searched with. A metric is a
+// policy class rather than a virtual interface, so its kernels are
+// inlined into the search and can be vectorized. Each provides:
+//
+//   distance(a, b, dimension)  the distance between two points, or a
+//                              monotonic function of it (such as its
+//                              square) that is cheaper to compute
+//   planeDistance(q, split, axis)
+//                              a lower bound on distance() from a point
+//                              whose coordinate along 'axis' is 'q' to
+//                              any point on the other side of the plane
+//                              through 'split'
+//
+// Nearest neighbor searches only compare these values, so any metric
+// whose plane bound holds gives exact results.
+
+// The Euclidian (L2) distance, compared by its square
+class EuclideanMetric
 {
   public:
-   KDNode<T>()
-      : _leftNode{nullptr}
-      , _rightNode{nullptr}
-   {};
+   template<class T>
+   double distance(const T* a, const T* b, int dimension) const
+   {
+      double dist = 0.0;
+      for (int ii=0; ii<dimension; ++ii)
+      {
+	 const double diff = double(a[ii]) - double(b[ii]);
+	 dist += diff*diff;
+      }
+      return dist;
+   }
+
+   template<class T>
+   double planeDistance(T q, T split, int /*axis*/) const
+   {
+      const double diff = double(q) - double(split);
+      return diff*diff;
+   }
+};
+
+// The Manhattan (L1) distance: the sum of the absolute differences
+class ManhattanMetric
+{
+  public:
+   template<class T>
+   double distance(const T* a, const T* b, int dimension) const
+   {
+      double dist = 0.0;
+      for (int ii=0; ii<dimension; ++ii)
+      {
+	 dist += fabs(double(a[ii]) - double(b[ii]));
+      }
+      return dist;
+   }
+
+   template<class T>
+   double planeDistance(T q, T split, int /*axis*/) const
+   {
+      return fabs(double(q) - double(split));
+   }
+};
+
+// The Chebyshev (L-infinity) distance: the largest absolute difference
+class ChebyshevMetric
+{
+  public:
+   template<class T>
+   double distance(const T* a, const T* b, int dimension) const
+   {
+      double dist = 0.0;
+      for (int ii=0; ii<dimension; ++ii)
+      {
+	 dist = std::max(dist, fabs(double(a[ii]) - double(b[ii])));
+      }
+      return dist;
+   }
+
+   template<class T>
+   double planeDistance(T q, T split, int /*axis*/) const
+   {
+      return fabs(double(q) - double(split));
+   }
+};
 
-   void build(std::vector< IndexedPoint<T> >& data,
-	      typename std::vector< IndexedPoint<T> >::iterator start,
-	      typename std::vector< IndexedPoint<T> >::iterator end,
-	      int axis = -1);
+// The Euclidian distance with each axis' difference scaled: the square
+// root of the sum of weights[i]*diff[i]^2, compared by its square. The
+// weights must not be negative.
+class WeightedEuclideanMetric
+{
+  public:
+   explicit WeightedEuclideanMetric(const std::vector<double>& weights)
+      : _weights(weights)
+   {}
+
+   template<class T>
+   double distance(const T* a, const T* b, int dimension) const
+   {
+      assert(int(_weights.size()) == dimension);
+      const double* weights = _weights.data();
+      double dist = 0.0;
+      for (int ii=0; ii<dimension; ++ii)
+      {
+	 const double diff = double(a[ii]) - double(b[ii]);
+	 dist += weights[ii]*diff*diff;
+      }
+      return dist;
+   }
+
+   template<class T>
+   double planeDistance(T q, T split, int axis) const
+   {
+      const double diff = double(q) - double(split);
+      return _weights[axis]*diff*diff;
+   }
+
+  private:
+   std::vector<double> _weights;
+};
+
+// The Euclidian distance on a torus, where each axis wraps around
+// after its period, compared by its square. Coordinates must lie in
+// [0, period) along each axis.
+class PeriodicEuclideanMetric
+{
+  public:
+   explicit PeriodicEuclideanMetric(const std::vector<double>& periods)
+      : _periods(periods)
+   {}
+
+   template<class T>
+   double distance(const T* a, const T* b, int dimension) const
+   {
+      assert(int(_periods.size()) == dimension);
+      const double* periods = _periods.data();
+      double dist = 0.0;
+      for (int ii=0; ii<dimension; ++ii)
+      {
+	 const double diff = fabs(double(a[ii]) - double(b[ii]));
+	 const double wrapped = std::min(diff, periods[ii] - diff);
+	 dist += wrapped*wrapped;
+      }
+      return dist;
+   }
+
+   // The other side of the plane is reached either directly, or by
+   // wrapping around through the nearer end of the period
+   template<class T>
+   double planeDistance(T q, T split, int axis) const
+   {
+      const double direct = fabs(double(q) - double(split));
+      const double wrapped = q <= split
+	 ? double(q)
+	 : _periods[axis] - double(q);
+      const double diff = std::min(direct, wrapped);
+      return diff*diff;
+   }
+
+  private:
+   std::vector<double> _periods;
+};
+
+// The memory a KDTree's nodes, and their points, are allocated from.
+// Allocations are carved out of a few large buffers in order, and only
+// released all at once when the arena is destroyed, so building a tree
+// costs a handful of mallocs rather than one or two per node, and
+// tearing it down neither runs a destructor per node nor recurses.
+class KDNodeArena : private std::pmr::memory_resource
+{
+  public:
+   // 'initialSize' is the number of bytes of the first buffer; later
+   // buffers grow geometrically. If the arena isn't 'growable', running
+   // out of the first buffer throws bad_alloc instead, so that a tree
+   // whose size is known up front fails to build if it was misjudged,
+   // rather than quietly allocating more.
+   explicit KDNodeArena(size_t initialSize = 4096, bool growable = true)
+      : _growable(growable), _bytes(0), _resource(initialSize, this)
+   {}
+
+   void* allocate(size_t bytes, size_t alignment)
+   {
+      return _resource.allocate(bytes, alignment);
+   }
+
+   // The number of bytes of the buffers allocated so far
+   size_t bytes() const { return _bytes; }
+
+  private:
+   // The buffers come from the heap, through the arena, which counts
+   // them
+   void* do_allocate(size_t bytes, size_t alignment) override
+   {
+      if (!_growable && _bytes != 0)
+      {
+	 throw std::bad_alloc();
+      }
+      void* buffer =
+	 std::pmr::new_delete_resource()->allocate(bytes, alignment);
+      _bytes += bytes;
+      return buffer;
+   }
+
+   void do_deallocate(void* buffer, size_t bytes, size_t alignment) override
+   {
+      std::pmr::new_delete_resource()->deallocate(buffer, bytes, alignment);
+   }
+
+   bool do_is_equal(const std::pmr::memory_resource& other) const
+      noexcept override
+   {
+      return this == &other;
+   }
+
+   bool                                _growable;
+   size_t                              _bytes;
+   std::pmr::monotonic_buffer_resource _resource;
+};
+
+// A node of a KDTree, which holds a single point. Nodes are allocated
+// from their tree's arena, and each is immediately followed in it by
+// the coordinates of its point.
+template<class T> class KDNode
+{
+  public:
+   // Builds the subtree over the points of 'rows' (row-major, of the
+   // given dimension) whose indices are order[start, end), returning
+   // its root. The nodes are allocated from 'arena'.
+   static KDNode<T>* build(KDNodeArena& arena, const T* rows,
+			   int dimension, std::vector<int>& order,
+			   int start, int end, int axis = -1);
 
-   void nearestNeighbor(const std::vector<T>& queryPoint,
-			IndexedPoint<T>& best, double& bestSqrDistance);
+   // Returns the node of the subtree whose point is nearest the query
+   // point, by the given metric, if it is closer than 'bestDistance'
+   // (measured as Metric::distance() measures it), updating
+   // 'bestDistance'. Returns null if there's no closer point.
+   template<class Metric>
+   const KDNode<T>* nearestNeighbor(const T* queryPoint,
+				    const Metric& metric,
+				    double& bestDistance) const;
 
    // We use streams for serialization/deserialization
    template<class U> friend std::ostream& operator<< (std::ostream &out,
 						      const KDNode<U> &node);
-   template<class U> friend std::istream& operator>> (std::istream &is,
-						      KDNode<U> &node);
 
    // We want this function that works on trees to be a friend of the
-   // node class, so it can access the private constructor below
-   template<class U> friend std::istream& operator>> (std::istream &is,
-						      KDTree<U> &tree);
+   // node class, so it can access the private functions below
+   template<class U, class M> friend std::istream& operator>> (
+      std::istream &is, KDTree<U, M> &tree);
+
+   // Trees read the index and point of the node a query finds
+   template<class U, class M> friend class KDTree;
 
   private:
-   // Used during deserialization and made private because we don't
-   // want consumers of this class to be able to partially construct
-   // nodes in this manner
-   KDNode<T>(int axis)
+   // Nodes are only made by create(), which allocates room for their
+   // point after them
+   KDNode<T>(int axis, int index, int dimension)
       : _axis(axis)
+      , _index(index)
+      , _dimension(dimension)
       , _leftNode{nullptr}
       , _rightNode{nullptr}
    {};
 
-   int                         _axis;  // separation axis
-   IndexedPoint<T>             _location;
+   // Returns a new node without children, allocated from 'arena' and
+   // holding a copy of 'point'
+   static KDNode<T>* create(KDNodeArena& arena, int axis, int index,
+			    const T* point, int dimension);
 
-   // pointers, possibly null, to the children of this node
-   std::unique_ptr<KDNode<T>>  _leftNode;
-   std::unique_ptr<KDNode<T>>  _rightNode;
+   // Reads a node whose axis has already been read, and its subtrees,
+   // into nodes allocated from 'arena'. 'values' is scratch space.
+   static KDNode<T>* read(std::istream& in, int axis, KDNodeArena& arena,
+			  std::vector<T>& values);
+
+   const T* point() const
+   {
+      return reinterpret_cast<const T*>(this + 1);
+   }
+
+   int         _axis;       // separation axis
+   int         _index;      // of the point in the primal dataset
+   int         _dimension;
+
+   // pointers, possibly null, to the children of this node, which live
+   // in the same arena
+   KDNode<T>*  _leftNode;
+   KDNode<T>*  _rightNode;
 };
 
 
-template<class T> class KDTree
+// A kd tree of individually allocated nodes, searched by the distance
+// 'Metric' (see EuclideanMetric). The metric only affects queries, so
+// a tree file can be read by a tree of any metric.
+template<class T, class Metric> class KDTree
 {
   public:
-   KDTree<T>() : _rootNode{nullptr} {};
+   explicit KDTree(const Metric& metric = Metric())
+      : _metric(metric), _rootNode{nullptr} {};
+   KDTree(KDTree&& other);
+   KDTree& operator=(KDTree&& other);
 
    // 'build' takes a vector of points and builds a balanced KD tree.
    bool build(const std::vector< std::vector<T> >& data);
 
    // Returns the value and index (into the primal dataset) of the
-   // closest point (Euclidian distance) to the query point
+   // closest point (by the tree's metric) to the query point
    IndexedPoint<T> nearestNeighbor(const std::vector<T>& queryPoint);
 
+   // Returns the index of the closest point to the query point, of the
+   // tree's dimension, and its distance (as Metric::distance() measures
+   // it), without copying the point, so that the query allocates no
+   // memory. The index is -1 if the tree is empty.
+   Neighbor nearestNeighbor(const T* queryPoint) const;
+
+   const Metric& metric() const { return _metric; }
+
+   // The number of bytes of the arena holding the nodes and their
+   // points
+   size_t memoryUsage() const { return _arena ? _arena->bytes() : 0; }
+
    // Used in serializaton and deserialization
-   template<class U> friend std::ostream& operator<< (std::ostream &out,
-						      const KDTree<U> &tree);
-   template<class U> friend std::istream& operator>> (std::istream &is,
-						      KDTree<U> &node);
+   template<class U, class M> friend std::ostream& operator<< (
+      std::ostream &out, const KDTree<U, M> &tree);
+   template<class U, class M> friend std::istream& operator>> (
+      std::istream &is, KDTree<U, M> &node);
+
+  private:
+   Metric                       _metric;
+
+   // The arena holds every node, so the root is released along with it
+   std::unique_ptr<KDNodeArena> _arena;
+   KDNode<T>*                   _rootNode;
+};
+
+
+// We use 'index == -1' to indicate a child that doesn't exist
+#define NULL_NODE -1
+
+// We use 'axis == -2' to mark a leaf node
+#define LEAF_AXIS -2
+
+// The capacity of the explicit stacks used by queries, which hold at
+// most one entry per level of the tree. Trees are built balanced, so
+// even a tree of 2^31 points is far shallower than this.
+#define MAX_SEARCH_DEPTH 64
+
+// The number of points held by each leaf of a FlatKDTree, unless
+// otherwise specified
+#define DEFAULT_LEAF_SIZE 16
+
+// The number of points whose distances are computed at once when
+// scanning a leaf
+#define BLOCK_WIDTH 8
+
+// The number of queries of an interleaved batch (see
+// KDTreeQueryOptions::interleave) handed to a thread at a time
+#define INTERLEAVE_GROUP 256
+
+// The size, in bytes, of the cache lines prefetched for interleaved
+// queries
+#define CACHE_LINE_SIZE 64
+
+// A node of a FlatKDTree. Nodes are stored contiguously, in
+// depth-first order (or van Emde Boas order, see NodeLayout), and
+// refer to their children by index into the node array rather than
+// by pointer. Either way, a node's children follow it in the array.
+// Children are addressed explicitly rather than implicitly (2*i+1 and
+// 2*i+2) so that trees which aren't perfectly balanced don't waste
+// space.
+//
+// Points are only held by leaves: a leaf refers to a contiguous range
+// of the tree's points, from 'left' up to (but not including) 'right'.
+template<class T>
+struct FlatKDNode
+{
+   T   split;  // position of the separating plane along 'axis'
+   int axis;   // separation axis, or LEAF_AXIS
+   int left;   // index of the left child, or first point of a leaf
+   int right;  // index of the right child, or last point + 1 of a leaf
+};
+
+// How a FlatKDTree chooses the axis of each node's separating plane:
+// cycling through the axes with depth, or along the axis over which
+// the node's points have the widest extent or the highest variance.
+// The data-dependent rules cost a pass over each node's points, but
+// give better shaped cells when the data is anisotropic.
+enum SplitRule
+{
+   SPLIT_CYCLE,
+   SPLIT_WIDEST_EXTENT,
+   SPLIT_MAX_VARIANCE
+};
+
+// The order in which a FlatKDTree's nodes are laid out in its node
+// array. In depth-first order, a node's left child immediately
+// follows it, but the deep nodes of a root-to-leaf path lie far apart.
+// The van Emde Boas order recursively splits the tree at half its
+// height, laying out the top half followed by each of the subtrees
+// below it, so that a path from the root to a leaf crosses O(log_B n)
+// blocks of B nodes, whatever the size of a cache line or page. This
+// matters most for memory-mapped trees, where each page touched for
+// the first time has to be read from disk.
+enum NodeLayout
+{
+   LAYOUT_DEPTH_FIRST,
+   LAYOUT_VAN_EMDE_BOAS
+};
+
+// Parameters controlling the construction of a FlatKDTree
+class KDTreeBuildOptions
+{
+  public:
+   KDTreeBuildOptions()
+      : leafSize{DEFAULT_LEAF_SIZE}
+      , threads{1}
+      , splitRule{SPLIT_CYCLE}
+      , nodeLayout{LAYOUT_DEPTH_FIRST}
+   {}
+
+   // The maximum number of points in a leaf, which are scanned
+   // linearly by queries
+   int leafSize;
+
+   // The number of threads to build with (all of the hardware's threads
+   // if less than one)
+   int threads;
+
+   // How the separating axis of each node is chosen
+   SplitRule splitRule;
+
+   // The order of the nodes in the node array
+   NodeLayout nodeLayout;
+};
+
+// Parameters controlling the construction of a FlatKDTree too large to
+// build in memory (see FlatKDTree::buildFile)
+class KDTreeExternalBuildOptions
+{
+  public:
+   KDTreeExternalBuildOptions()
+      : memoryPoints{1 << 24}
+      , sampleSize{1 << 20}
+   {}
+
+   // The most points held in memory at once, counting every copy of a
+   // point, but not the index or two kept with each. Subtrees are built
+   // in memory, one per thread, if both copies of their points fit in
+   // an equal share of this; larger ones are partitioned on disk, which
+   // holds at most half of this in memory, plus the samples of the
+   // handful of scratch files being written. Pending subtrees park
+   // their samples on disk.
+   size_t memoryPoints;
+
+   // The number of points sampled to bracket each split of a subtree
+   // too large to build in memory, which is at most memoryPoints/16.
+   // About 8/sqrt(sampleSize) of a subtree's points lie between the
+   // bracket's bounds, and are read back into memory to be split if
+   // they're at most memoryPoints/2; otherwise a narrower bracket is
+   // taken around the split among them.
+   size_t sampleSize;
+
+   // The prefix of the names of the scratch files holding the points of
+   // subtrees yet to be built (the name of the tree file if empty)
+   std::string scratchPrefix;
+};
+
+// Options which trade the exactness of a FlatKDTree's nearest neighbor
+// queries for speed, or change the order of batch queries. By default,
+// queries are exact and answered in the order given.
+class KDTreeQueryOptions
+{
+  public:
+   KDTreeQueryOptions()
+      : epsilon{0}
+      , maxLeaves{0}
+      , sortBatch{false}
+      , interleave{1}
+   {}
+
+   // Subtrees are skipped unless they could hold a point more than
+   // (1 + epsilon) times closer than the worst result found so far, so
+   // that the i'th result is at most (1 + epsilon) times as far away as
+   // the true i'th nearest neighbor
+   double epsilon;
+
+   // The most leaves a query scans before settling for the best results
+   // found so far (no limit if less than one). This bounds the time
+   // taken by any one query, but doesn't bound the results' error, and
+   // a k nearest neighbor query may see fewer than k points.
+   int maxLeaves;
+
+   // Whether a batch of queries is answered in the order of the leaves
+   // its query points land in, rather than in the order given, so that
+   // consecutive queries search the same parts of the tree while they
+   // are still in the caches. The results are the same, and are still
+   // written in the order of the queries. Sorting costs a descent of
+   // the tree per query, which a large batch of scattered queries of a
+   // tree too large for the caches more than makes up for.
+   bool sortBatch;
+
+   // The number of queries of a batch each thread keeps in flight.
+   // Rather than answering one query after another, a thread advances
+   // each of them in turn by a node or a leaf, prefetching the one it
+   // will need next before moving on to the next query, so that their
+   // waits for memory overlap. This pays off when the tree is far
+   // larger than the caches, such as a large mapped tree; otherwise a
+   // query rarely waits, and switching between them only costs time,
+   // as it does for a sorted batch (see sortBatch) whose consecutive
+   // queries find each other's nodes in the caches. Queries are
+   // answered one at a time if less than two.
+   int interleave;
+};
+
+// Scratch space for a FlatKDTree's queries, which a caller keeps (one
+// per thread) and passes to each query. Its buffers grow to fit the
+// largest query made with it and are then reused, so that queries
+// allocate no memory of their own once it has warmed up.
+class KDTreeQueryContext
+{
+  public:
+   KDTreeQueryContext() {}
 
   private:
-   std::unique_ptr<KDNode<T>> _rootNode;
+   template<class T, int Dim> friend class FlatKDTree;
+
+   std::vector<double>   _axisOffsets;  // of the cell being searched
+   std::vector<Neighbor> _heap;         // the candidates of a k nearest
+					// neighbor query
+   std::vector<Neighbor> _results;      // of the last query
+};
+
+// Counts of the work done by nearest neighbor and radius searches, to
+// show why queries are slow and to tune leaf sizes and split rules.
+// Searches only count their work when this file is compiled with
+// KDTREE_STATS defined, so the counters cost nothing otherwise.
+struct KDTreeQueryStats
+{
+   uint64_t queries = 0;
+   uint64_t nodesVisited = 0;          // internal nodes and leaves
+   uint64_t leavesScanned = 0;
+   uint64_t distanceComputations = 0;  // points compared with a query
+   uint64_t backtracks = 0;            // subtrees on the far side of a
+				       // splitting plane searched after
+				       // the near side
+   uint64_t maxStackDepth = 0;         // the most subtrees deferred at
+				       // once by any one query
+
+   void add(const KDTreeQueryStats& other)
+   {
+      queries += other.queries;
+      nodesVisited += other.nodesVisited;
+      leavesScanned += other.leavesScanned;
+      distanceComputations += other.distanceComputations;
+      backtracks += other.backtracks;
+      maxStackDepth = std::max(maxStackDepth, other.maxStackDepth);
+   }
+};
+
+// Prints the totals, and the averages per query
+inline std::ostream& operator<< (std::ostream& out,
+				 const KDTreeQueryStats& stats);
+
+// Returns the counts of every search since the last reset, by any
+// thread, and resets them
+inline KDTreeQueryStats kdTreeQueryStats();
+inline void resetKDTreeQueryStats();
+
+// Returns the counts of the calling thread's last search
+inline KDTreeQueryStats lastKDTreeQueryStats();
+
+// Counts 'n' of a KDTreeQueryStats counter for the enclosing search,
+// when KDTREE_STATS is defined
+#ifdef KDTREE_STATS
+#define KDTREE_COUNT(counter, n) (queryStats.stats.counter += (n))
+#define KDTREE_COUNT_DEPTH(depth) (queryStats.stats.maxStackDepth =	\
+      std::max<uint64_t>(queryStats.stats.maxStackDepth, (depth)))
+#else
+#define KDTREE_COUNT(counter, n) ((void)0)
+#define KDTREE_COUNT_DEPTH(depth) ((void)0)
+#endif
+
+#ifdef KDTREE_STATS
+// The totals of every search, which each search adds its counts to as
+// it finishes
+struct KDTreeSharedStats
+{
+   std::atomic<uint64_t> queries{0};
+   std::atomic<uint64_t> nodesVisited{0};
+   std::atomic<uint64_t> leavesScanned{0};
+   std::atomic<uint64_t> distanceComputations{0};
+   std::atomic<uint64_t> backtracks{0};
+   std::atomic<uint64_t> maxStackDepth{0};
+};
+inline KDTreeSharedStats kdTreeSharedStats;
+inline thread_local KDTreeQueryStats kdTreeLastQueryStats;
+
+// Collects the counts of one search, and publishes them when it ends
+class KDTreeQueryStatsScope
+{
+  public:
+   KDTreeQueryStatsScope()
+   {
+      stats.queries = 1;
+   }
+   ~KDTreeQueryStatsScope()
+   {
+      using namespace std;
+
+      KDTreeSharedStats& shared = kdTreeSharedStats;
+      shared.queries.fetch_add(1, memory_order_relaxed);
+      shared.nodesVisited.fetch_add(stats.nodesVisited,
+				    memory_order_relaxed);
+      shared.leavesScanned.fetch_add(stats.leavesScanned,
+				     memory_order_relaxed);
+      shared.distanceComputations.fetch_add(stats.distanceComputations,
+					    memory_order_relaxed);
+      shared.backtracks.fetch_add(stats.backtracks, memory_order_relaxed);
+      uint64_t depth = shared.maxStackDepth.load(memory_order_relaxed);
+      while (depth < stats.maxStackDepth
+	     && !shared.maxStackDepth.compare_exchange_weak(
+		depth, stats.maxStackDepth, memory_order_relaxed))
+      {
+      }
+      kdTreeLastQueryStats = stats;
+   }
+
+   KDTreeQueryStats stats;
+};
+#define KDTREE_STATS_SCOPE() KDTreeQueryStatsScope queryStats
+#else
+#define KDTREE_STATS_SCOPE() ((void)0)
+#endif
+
+// The version of the binary FlatKDTree format written by this code
+#define FLAT_KDTREE_VERSION 1
+
+// The alignment, in bytes, of each array of a serialized FlatKDTree
+#define FLAT_KDTREE_ALIGNMENT 64
+
+// The header of a serialized FlatKDTree. It is followed by the raw node
+// array, coordinate buffer and index array, each at the given offset
+// from the start of the header (a multiple of FLAT_KDTREE_ALIGNMENT,
+// so that the arrays can be used in place if the file is mapped into
+// memory). All values are in the byte order of the writing machine,
+// which 'byteOrder' records.
+struct FlatKDTreeHeader
+{
+   char     magic[8];         // "KDTREE" followed by two zeros
+   uint32_t version;          // FLAT_KDTREE_VERSION
+   uint32_t byteOrder;        // 0x01020304
+   uint32_t coordinateType;   // see coordinateTypeCode()
+   int32_t  dimension;
+   int32_t  size;             // number of points
+   int32_t  nodeCount;
+   int32_t  blockWidth;       // 1 or BLOCK_WIDTH
+   int32_t  nodeSize;         // sizeof(FlatKDNode<T>)
+   uint64_t nodesOffset;
+   uint64_t coordsOffset;     // (size rounded up to blockWidth)*dimension
+			      // coordinates
+   uint64_t indicesOffset;    // size indices
+   uint64_t fileSize;
 };
 
+static_assert(sizeof(int) == sizeof(int32_t),
+	      "FlatKDTree indices are serialized as 32 bit integers");
+
+// A compact alternative to KDTree: all nodes live in a single array,
+// and the points live in a single coordinate buffer, ordered so that
+// the points of each leaf are contiguous. A query never follows a
+// pointer or touches a per-node allocation.
+//
+// Unless the leaves are smaller than BLOCK_WIDTH, the coordinate
+// buffer is split into blocks of BLOCK_WIDTH points, each stored one
+// axis after another, so that a leaf can be scanned with SIMD
+// instructions. Leaves always start on a block boundary.
+//
+// If Dim is given, the dimension is fixed at compile time: points are
+// std::arrays and the distance computations are fully unrolled.
+// Otherwise the dimension is taken from the data the tree is built
+// from.
+template<class T, int Dim = DYNAMIC_DIMENSION> class FlatKDTree
+{
+  public:
+   typedef typename PointStorage<T, Dim>::type Point;
+
+   FlatKDTree()
+      : _dimension(Dim), _size(0), _blockWidth(1), _nodeCount(0),
+	_nodeData(nullptr), _coordData(nullptr), _indexData(nullptr) {};
+   FlatKDTree(const FlatKDTree& other);
+   FlatKDTree(FlatKDTree&& other);
+   FlatKDTree& operator=(const FlatKDTree& other);
+   FlatKDTree& operator=(FlatKDTree&& other);
+
+   // 'build' takes a vector of points (either std::vectors or
+   // std::arrays) and builds a balanced KD tree.
+   template<class InputPoint>
+   bool build(const std::vector<InputPoint>& data,
+	      const KDTreeBuildOptions& options = KDTreeBuildOptions());
+
+   // Builds the tree from 'count' points stored one after another,
+   // 'dimension' values each. The points are only read, so the build
+   // needs no memory beyond the finished tree and an index per point.
+   bool build(const T* points, int count, int dimension,
+	      const KDTreeBuildOptions& options = KDTreeBuildOptions());
+
+   // Returns the value and index (into the primal dataset) of the
+   // closest point (Euclidian distance) to the query point. 'options'
+   // may trade the exactness of this and the following queries for
+   // speed.
+   IndexedPoint<T, Dim> nearestNeighbor(
+      const Point& queryPoint,
+      const KDTreeQueryOptions& options = KDTreeQueryOptions()) const;
+   IndexedPoint<T, Dim> nearestNeighbor(
+      const T* queryPoint,
+      const KDTreeQueryOptions& options = KDTreeQueryOptions()) const;
+
+   // Returns the k closest points to the query point, sorted by
+   // increasing distance. Fewer than k are returned if the tree holds
+   // fewer than k points.
+   std::vector<Neighbor> kNearestNeighbors(
+      const Point& queryPoint, int k,
+      const KDTreeQueryOptions& options = KDTreeQueryOptions()) const;
+   std::vector<Neighbor> kNearestNeighbors(
+      const T* queryPoint, int k,
+      const KDTreeQueryOptions& options = KDTreeQueryOptions()) const;
+
+   // Appends every point within 'radius' (inclusive) of the query point
+   // to 'results', in no particular order, and returns their number.
+   // 'results' isn't cleared, so a caller can reuse its storage from
+   // one query to the next.
+   int radiusSearch(const Point& queryPoint, double radius,
+		    std::vector<Neighbor>& results) const;
+   int radiusSearch(const T* queryPoint, double radius,
+		    std::vector<Neighbor>& results) const;
+
+   // Returns the number of points within 'radius' (inclusive) of the
+   // query point, without collecting them
+   int radiusCount(const Point& queryPoint, double radius) const;
+   int radiusCount(const T* queryPoint, double radius) const;
+
+   // Versions of the above which use the scratch space of 'context'
+   // rather than allocating their own, so that they allocate nothing
+   // once the context has warmed up. The neighbor's point isn't
+   // materialized, and the results returned by reference are held by
+   // the context, until its next query.
+   Neighbor nearestNeighbor(
+      const T* queryPoint, KDTreeQueryContext& context,
+      const KDTreeQueryOptions& options = KDTreeQueryOptions()) const;
+   const std::vector<Neighbor>& kNearestNeighbors(
+      const T* queryPoint, int k, KDTreeQueryContext& context,
+      const KDTreeQueryOptions& options = KDTreeQueryOptions()) const;
+   const std::vector<Neighbor>& radiusSearch(
+      const T* queryPoint, double radius,
+      KDTreeQueryContext& context) const;
+
+   // Finds the k nearest neighbors in this tree of every point held by
+   // the tree 'queries', writing those of the query point with index i
+   // (into the dataset 'queries' was built from) to results[i*k,
+   // (i+1)*k), closest first, with an index of -1 for any missing
+   // neighbors. Both trees are traversed together, so that a whole
+   // node of nearby query points is pruned against a node of this tree
+   // at once, which beats querying each point in turn when there are
+   // many queries in few dimensions. The work is spread over 'threads'
+   // threads (all of the hardware's threads if less than one).
+   void allNearestNeighbors(const FlatKDTree& queries, int k,
+			    std::vector<Neighbor>& results,
+			    int threads = 0) const;
+
+   // As above, finding the k nearest neighbors of each of this tree's
+   // points among its other points
+   void allNearestNeighbors(int k, std::vector<Neighbor>& results,
+			    int threads = 0) const;
+
+   // Batch versions of the above, which spread the queries over
+   // 'threads' threads (all of the hardware's threads if 'threads' is
+   // less than one). The results of the i'th query are written to the
+   // i'th entry of the caller-sized 'results' (nearestNeighborBatch),
+   // or the k entries starting at results[i*k] (kNearestNeighborsBatch),
+   // with an index of -1 for any missing neighbors.
+   void nearestNeighborBatch(
+      const std::vector<Point>& queryPoints, std::vector<Neighbor>& results,
+      int threads = 0,
+      const KDTreeQueryOptions& options = KDTreeQueryOptions()) const;
+   void nearestNeighborBatch(
+      const T* queryPoints, int count, Neighbor* results, int threads = 0,
+      const KDTreeQueryOptions& options = KDTreeQueryOptions()) const;
+   void kNearestNeighborsBatch(
+      const std::vector<Point>& queryPoints, int k,
+      std::vector<Neighbor>& results, int threads = 0,
+      const KDTreeQueryOptions& options = KDTreeQueryOptions()) const;
+   void kNearestNeighborsBatch(
+      const T* queryPoints, int count, int k, Neighbor* results,
+      int threads = 0,
+      const KDTreeQueryOptions& options = KDTreeQueryOptions()) const;
+
+   int size() const { return _size; }
+   int nodeCount() const { return _nodeCount; }
+   int dimension() const
+   {
+      return Dim == DYNAMIC_DIMENSION ? _dimension : Dim;
+   }
+
+   // Returns the number of bytes taken by the node, coordinate and
+   // index arrays, whether they are owned or mapped
+   size_t memoryUsage() const;
+
+   // Builds a tree over more points than fit in memory, writing it
+   // straight to 'filename' in the format operator<< writes, to be read
+   // or mapped with mapFile(). 'source(rows, maxPoints)' is called to
+   // fill 'rows' with up to 'maxPoints' more points of 'dimension'
+   // values each, one after another, and returns how many it read, or
+   // 0 once there are no more; points are numbered in the order they
+   // are read.
+   //
+   // Subtrees too large to hold in memory are split on disk: their
+   // points are streamed from a scratch file into one for each child,
+   // with a sample bracketing the split so that only the points near
+   // it need sorting in memory. Splits are at the same ranks as
+   // build()'s, so the tree has the same shape and split values; the
+   // data-dependent split rules choose the axis of these splits from
+   // the sample. The smaller subtrees are built in memory, with
+   // 'options.threads' threads, and written into place. The nodes are
+   // always laid out in depth-first order.
+   template<class Source>
+   static bool buildFile(
+      Source& source, int dimension, const std::string& filename,
+      const KDTreeBuildOptions& options = KDTreeBuildOptions(),
+      const KDTreeExternalBuildOptions& externalOptions =
+	 KDTreeExternalBuildOptions());
+
+   // Maps a file written by operator<< into memory and queries it in
+   // place: loading costs a header check rather than a copy of the
+   // tree, pages are read in as queries touch them, and processes
+   // mapping the same file share its pages. The tree keeps the mapping
+   // until it is rebuilt, reloaded or destroyed. Returns false if the
+   // file can't be mapped or wasn't written for this type of tree.
+   bool mapFile(const std::string& filename);
+   bool isMapped() const { return bool(_mapping); }
+
+   // Used in serializaton and deserialization, in the binary format
+   // described by FlatKDTreeHeader. Streams must be opened in binary
+   // mode.
+   template<class U, int D> friend std::ostream& operator<< (
+      std::ostream &out, const FlatKDTree<U, D> &tree);
+   template<class U, int D> friend std::istream& operator>> (
+      std::istream &is, FlatKDTree<U, D> &tree);
+
+   // Search and rebuild their trees
+   template<class U, int D> friend class DynamicKDTree;
+   template<class U, class V, int D> friend class QuantizedKDTree;
+   template<class U, int D> friend class ShardedKDTree;
+
+  private:
+   void clear();
+
+   // Points the arrays queries read from at the owned vectors
+   void bindStorage();
+
+   // Returns whether the node array, which was loaded from a file, can
+   // be traversed safely: every split axis is within the dimension,
+   // every child follows its parent, every leaf refers to a range of
+   // the points which starts on a block boundary, and no leaf is deeper
+   // than the search stacks
+   bool validNodes() const;
+
+   // Builds the tree as build() does, as if it were the subtree of a
+   // node split along 'parentAxis' (-1 for the root)
+   bool buildBelow(const T* points, int count, int dimension,
+		   int parentAxis, const KDTreeBuildOptions& options);
+
+   // Returns the number of nodes build() makes over 'count' points,
+   // given the number of nodes over each count found so far
+   int64_t subtreeNodeCount(int count, int leafSize,
+			    std::map<int, int64_t>& counts) const;
+
+   // The state of a buildFile() call
+   struct ExternalBuild;
+
+   // Builds the subtree over the points of 'points', whose root is node
+   // 'nodeIdx' and which starts at slot 'slot', writing it into place.
+   // Subtrees small enough to build in memory are queued in the state,
+   // to be built by buildQueuedSubtrees().
+   void buildExternalSubtree(ExternalBuild& state,
+			     std::unique_ptr<KDTreeScratchFile<T>> points,
+			     int parentAxis, int nodeIdx, int slot) const;
+
+   // Builds the queued subtrees in memory, side by side, and writes them
+   // into place
+   void buildQueuedSubtrees(ExternalBuild& state) const;
+
+   // Returns where the points of order[start, end) are split between
+   // the two children of a node
+   int splitPosition(int start, int end) const;
+
+   // Appends the nodes of the subtree over order[start, end) to
+   // 'nodes', returning the index of its root node
+   int buildRange(const T* rows, std::vector<int>& order, int start,
+		  int end, int axis, const KDTreeBuildOptions& options,
+		  std::vector<FlatKDNode<T>>& nodes) const;
+
+   // Returns the nodes of the subtree over order[start, end), built by
+   // 'threads' threads
+   std::vector<FlatKDNode<T>> buildParallel(const T* rows,
+					    std::vector<int>& order,
+					    int start, int end, int axis,
+					    const KDTreeBuildOptions& options,
+					    int threads) const;
+
+   // Reorders the nodes into van Emde Boas order, keeping the root
+   // first
+   void layoutVanEmdeBoas();
+
+   // Appends the nodes of the 'height' top levels of the subtree under
+   // 'nodeIdx' to 'layout', in van Emde Boas order
+   void vanEmdeBoasOrder(int nodeIdx, int height,
+			 std::vector<int>& layout) const;
+
+   // Appends the nodes 'depth' levels below 'nodeIdx' to 'roots', from
+   // left to right
+   void nodesAtDepth(int nodeIdx, int depth, std::vector<int>& roots) const;
+
+   // Returns the separating axis of the node over order[start, end),
+   // whose parent was split along 'parentAxis', computing the spread of
+   // its points with 'threads' threads
+   int splitAxis(const T* rows, const std::vector<int>& order, int start,
+		 int end, int parentAxis, SplitRule rule,
+		 int threads = 1) const;
+
+   // Fills the coordinate buffer from row-major 'rows', in the given
+   // order
+   void packPoints(const T* rows, const std::vector<int>& order,
+		   int blockWidth, int threads = 1);
+
+   // Offers every point of a leaf to 'results'
+   template<class ResultSet>
+   void scanLeaf(const FlatKDNode<T>& leaf, const T* queryPoint,
+		 ResultSet& results) const;
+
+   // A subtree yet to be searched, whose cell is 'cellDistance'
+   // (squared) from the query point, and 'offset' from it along the
+   // axis its parent was split on
+   struct PendingNode
+   {
+      int    nodeIdx;
+      int    axis;
+      double offset;
+      double cellDistance;
+      int    undoCount;   // the length of the undo log at its parent
+   };
+
+   // The previous offset along an axis whose offset was changed
+   struct AxisOffset
+   {
+      int    axis;
+      double offset;
+   };
+
+   // Visits every node that may hold a point closer than the worst of
+   // 'results' (within the limits of 'options'), offering each point
+   // to it. The search's scratch space is taken from 'context', if
+   // there is one.
+   template<class ResultSet>
+   void search(int nodeIdx, const T* queryPoint, ResultSet& results,
+	       const KDTreeQueryOptions& options = KDTreeQueryOptions(),
+	       KDTreeQueryContext* context = nullptr) const;
+
+   // Returns the bounding box of every node's points: the low corner of
+   // node i starts at [2*i*dimension()], followed by the high corner
+   std::vector<T> nodeBounds() const;
+
+   // The state of an all nearest neighbors search
+   struct DualTreeSearch
+   {
+      const FlatKDTree*     queries;
+      std::vector<T>        queryBounds;
+      std::vector<T>        referenceBounds;
+      std::vector<double>   diameters;   // of each query node's box
+      std::vector<double>   nodeWorst;   // a bound on the distance to
+					 // the kth neighbor of any point
+					 // of each query node
+      std::vector<double>   nodeBest;    // the best kth candidate
+					 // distance of each query node
+      std::vector<Neighbor> heaps;       // k candidates per query point
+      std::vector<int>      heapSizes;
+      int                   k;
+      bool                  excludeSelf;
+   };
+
+   // Returns the squared distance between the bounding boxes of a query
+   // node and a node of this tree
+   double nodeDistance(const DualTreeSearch& state, int queryNode,
+		       int referenceNode) const;
+
+   // Bounds a query node's kth neighbor distances given the worst and
+   // best kth candidate distances of its points
+   void boundQueryNode(DualTreeSearch& state, int queryNode, double worst,
+		       double best) const;
+
+   // Offers the points of the subtree at referenceNode to the points
+   // of the query subtree at queryNode. 'queryPoint' is scratch space
+   // for one point.
+   void dualTreeSearch(DualTreeSearch& state, int queryNode,
+		       int referenceNode, T* queryPoint) const;
+
+   // Returns the first point of the leaf the query point lands in
+   int landingLeaf(const T* queryPoint) const;
+
+   // A query of an interleaved batch, stopped where it last waited for
+   // memory, with the state search() keeps on its stack
+   struct SearchCursor
+   {
+      PendingNode pending[MAX_SEARCH_DEPTH];
+      int         pendingCount;
+      AxisOffset  undo[MAX_SEARCH_DEPTH];
+      int         undoCount;
+      double*     axisOffsets;   // of the current cell, per axis
+      double      cellDistance;
+      int         nodeIdx;       // the node to visit next
+      bool        leafFetched;   // whether its points have been
+				 // prefetched, if it is a leaf
+      int         leavesLeft;
+      size_t      query;         // its index in the batch
+      const T*    queryPoint;
+#ifdef KDTREE_STATS
+      std::optional<KDTreeQueryStatsScope> queryStats;
+#endif
+   };
+
+   // Starts the cursor's search of the whole tree for the query point
+   void startSearch(SearchCursor& cursor, size_t query, const T* queryPoint,
+		    const KDTreeQueryOptions& options) const;
+
+   // Advances the cursor's search, as search() would, until it comes to
+   // memory that may not be in the caches, which it prefetches. Returns
+   // false once the search is over.
+   template<class ResultSet>
+   bool advanceSearch(SearchCursor& cursor, ResultSet& results,
+		      double pruneScale) const;
+
+   // Answers the queries of a batch in the given order, spread over
+   // 'threads' threads which each keep options.interleave of them in
+   // flight. 'queryPoint(ii)' returns the ii'th query point, whose
+   // results are collected by a copy of 'empty' and then handed to
+   // 'finish(ii, results)', which leaves them empty again.
+   template<class ResultSet, class QueryPoints, class Finish>
+   void interleavedBatch(const std::vector<int>& order, int threads,
+			 const QueryPoints& queryPoint,
+			 const ResultSet& empty, const Finish& finish,
+			 const KDTreeQueryOptions& options) const;
+
+   // Writes the k nearest neighbors collected by 'heap' to
+   // results[0, k), as kNearestNeighborsBatch() does, and empties it
+   void finishNeighbors(KNearestHeap& heap, int k, Neighbor* results) const;
+
+   // Returns the order in which to answer a batch of 'count' queries,
+   // 'queryPoint(ii)' returning the ii'th query point: the order given,
+   // or unless options.sortBatch is false, the order of the leaves they
+   // land in, found with 'threads' threads
+   template<class QueryPoints>
+   std::vector<int> batchOrder(size_t count, int threads,
+			       const KDTreeQueryOptions& options,
+			       const QueryPoints& queryPoint) const;
+
+   // Finds the k nearest neighbors with the given context, writing them
+   // to results[0, k)
+   void kNearestNeighbors(const T* queryPoint, int k,
+			  KDTreeQueryContext& context, Neighbor* results,
+			  const KDTreeQueryOptions& options) const;
+
+
+   const T& coordinate(int pointIdx, int axis) const
+   {
+      const size_t block = pointIdx/_blockWidth;
+      const size_t lane = pointIdx%_blockWidth;
+      return _coordData[(block*dimension() + axis)*_blockWidth + lane];
+   }
+
+   Point point(int pointIdx) const;
+
+   int                        _dimension;
+   int                        _size;        // number of points
+   int                        _blockWidth;  // 1 or BLOCK_WIDTH
+   int                        _nodeCount;
+
+   // The arrays queries read from: either the vectors below, or the
+   // pages of a mapped file
+   const FlatKDNode<T>*       _nodeData;
+   const T*                   _coordData;
+   const int*                 _indexData;
+   std::shared_ptr<const void> _mapping;   // unmaps the file when the
+					   // last copy goes away
+
+   std::vector<FlatKDNode<T>> _nodes;
+   std::vector<T>             _coords;   // dimension() values per point,
+					 // padded to a whole block
+   std::vector<int>           _indices;  // index into the primal
+					 // dataset, per point
+};
+
+// Publishes successive versions of a tree (such as a FlatKDTree) to
+// concurrent readers. A reader takes a snapshot, a reference-counted
+// pointer to the current version, and queries it for as long as it
+// likes; a writer builds the next version off to the side and
+// publishes it, and readers pick it up with their next snapshot. A
+// version is freed once it has been replaced and its last snapshot has
+// gone away, so neither side waits for the other's queries or builds.
+template<class Tree>
+class SharedKDTree
+{
+  public:
+   typedef std::shared_ptr<const Tree> Snapshot;
+
+   SharedKDTree()
+      : _current(std::make_shared<const Tree>())
+   {}
+   explicit SharedKDTree(Snapshot tree)
+      : _current(std::move(tree))
+   {}
+
+   // Returns the current version
+   Snapshot snapshot() const
+   {
+      return std::atomic_load(&_current);
+   }
+
+   // Makes 'tree' the current version, returning the previous one, so
+   // the writer rather than the last reader can drop it
+   Snapshot publish(Snapshot tree)
+   {
+      return std::atomic_exchange(&_current, std::move(tree));
+   }
+   Snapshot publish(Tree&& tree)
+   {
+      return publish(std::make_shared<const Tree>(std::move(tree)));
+   }
+
+  private:
+   Snapshot _current;   // only accessed atomically
+};
+
+// The number of points a DynamicKDTree collects before building them
+// into a tree; the trees of its forest hold up to this many points
+// times a power of two
+#define DYNAMIC_KDTREE_BUFFER 256
+
+// A kd tree that points can be inserted into and erased from, by the
+// logarithmic method (Bentley and Saxe, "Decomposable Searching Problems
+// I: Static-to-Dynamic Transformation", 1980). Points are held by a
+// forest of FlatKDTrees, the ith of which holds at most
+// DYNAMIC_KDTREE_BUFFER*2^i points, plus a small buffer of the latest
+// insertions. When the buffer fills, it is merged with the trees below
+// the first empty one into that one, so each point is rebuilt O(log n)
+// times over its life and queries search O(log n) trees. Erased points
+// are only marked until their tree is next rebuilt; once as many of the
+// trees' points are erased as not, the whole forest is rebuilt into a
+// single tree.
+//
+// Points are identified by the id insert() returns, which queries
+// report as the neighbor's index.
+template<class T, int Dim = DYNAMIC_DIMENSION> class DynamicKDTree
+{
+  public:
+   typedef typename PointStorage<T, Dim>::type Point;
+
+   // Throws invalid_argument unless the points have at least one axis
+   // (Dim, if it is fixed) and the leaves can hold at least one point
+   explicit DynamicKDTree(
+      int dimension,
+      const KDTreeBuildOptions& options = KDTreeBuildOptions());
+
+   // An empty tree of the fixed dimension Dim. A tree of a dynamic
+   // dimension has to be given its dimension.
+   DynamicKDTree()
+      : DynamicKDTree(Dim)
+   {
+      static_assert(Dim != DYNAMIC_DIMENSION,
+		    "a DynamicKDTree of dynamic dimension must be given one");
+   }
+
+   // Replaces the contents with 'count' points stored one after another,
+   // which are given the ids 0 to count - 1. Returns false, leaving the
+   // tree empty, if they couldn't be built into a tree.
+   bool build(const T* points, int count);
+
+   // Adds a point, returning its id, or -1 if it couldn't be added
+   int insert(const Point& point);
+   int insert(const T* point);
+
+   // Removes the point with the given id. Returns false if there's no
+   // such point.
+   bool erase(int id);
+
+   // The queries of FlatKDTree, over the points that haven't been
+   // erased. Neighbors are identified by their ids, and
+   // nearestNeighbor() returns an index of -1 if there are no points.
+   Neighbor nearestNeighbor(
+      const Point& queryPoint,
+      const KDTreeQueryOptions& options = KDTreeQueryOptions()) const;
+   Neighbor nearestNeighbor(
+      const T* queryPoint,
+      const KDTreeQueryOptions& options = KDTreeQueryOptions()) const;
+   std::vector<Neighbor> kNearestNeighbors(
+      const Point& queryPoint, int k,
+      const KDTreeQueryOptions& options = KDTreeQueryOptions()) const;
+   std::vector<Neighbor> kNearestNeighbors(
+      const T* queryPoint, int k,
+      const KDTreeQueryOptions& options = KDTreeQueryOptions()) const;
+   int radiusSearch(const Point& queryPoint, double radius,
+		    std::vector<Neighbor>& results) const;
+   int radiusSearch(const T* queryPoint, double radius,
+		    std::vector<Neighbor>& results) const;
+
+   // The number of points that haven't been erased
+   int size() const { return _size; }
+   int dimension() const
+   {
+      return Dim == DYNAMIC_DIMENSION ? _dimension : Dim;
+   }
+
+   // The number of trees in the forest, and the number of erased points
+   // they still hold
+   int treeCount() const;
+   int erasedCount() const { return _erased; }
+
+  private:
+   // One tree of the forest, with the id of each of its primal points
+   struct Level
+   {
+      FlatKDTree<T, Dim> tree;
+      std::vector<int>   ids;
+   };
+
+   // Appends the live points of a level to 'rows' and their ids to
+   // 'ids', and empties it
+   void drain(Level& level, std::vector<T>& rows, std::vector<int>& ids);
+
+   // Builds level 'levelIdx' from the points of 'rows', one per id,
+   // taking their ids. Returns false, leaving the level empty and 'ids'
+   // as they were, if the tree couldn't be built.
+   bool buildLevel(int levelIdx, const T* rows, std::vector<int>& ids);
+
+   // Builds every live point, including the buffered ones, into a
+   // single tree. Returns false, leaving them all buffered, if the tree
+   // couldn't be built.
+   bool rebuild();
+
+   // Offers every live point that may be closer than the worst of
+   // 'results' to it, under its id
+   template<class ResultSet>
+   void search(const T* queryPoint, ResultSet& results,
+	       const KDTreeQueryOptions& options) const;
+
+   int                _dimension;
+   KDTreeBuildOptions _options;
+   std::vector<Level> _levels;
+   std::vector<T>     _buffer;        // dimension() values per point
+   std::vector<int>   _bufferIds;
+   std::vector<char>  _live;          // per id
+   int                _size;          // number of live points
+   int                _erased;        // number of erased points in trees
+};
+
+// A FlatKDTree over coordinates quantized to the integer type Q (such
+// as int16_t or uint8_t), answering exact queries over the original
+// points of type T. The tree's coordinates take a half or a quarter of
+// the space of floats, and an eighth of doubles, so a query reads that
+// much less memory while it searches; only the candidates which could
+// be among the neighbors are re-ranked by their exact distances, read
+// from a copy of the original points kept in the tree's order.
+//
+// Each axis is shifted by its own offset, but all axes share one scale,
+// so that distances between quantized points stay proportional to the
+// original distances, within the rounding error. The search prunes by
+// the exact distance of the worst neighbor found so far, widened by the
+// largest possible rounding error, so it is certain to find the exact
+// k nearest neighbors.
+template<class Q, class T = double, int Dim = DYNAMIC_DIMENSION>
+class QuantizedKDTree
+{
+  public:
+   QuantizedKDTree()
+      : _scale(1), _pointError(0) {}
+
+   // Builds the tree from 'count' points stored one after another,
+   // 'dimension' values each
+   bool build(const T* points, int count, int dimension,
+	      const KDTreeBuildOptions& options = KDTreeBuildOptions());
+
+   // The exact queries of FlatKDTree, identifying neighbors by their
+   // index into the primal dataset. nearestNeighbor() returns an index
+   // of -1 if the tree is empty.
+   Neighbor nearestNeighbor(const T* queryPoint) const;
+   std::vector<Neighbor> kNearestNeighbors(const T* queryPoint,
+					   int k) const;
+   void nearestNeighborBatch(const T* queryPoints, int count,
+			     Neighbor* results, int threads = 0) const;
+   void kNearestNeighborsBatch(const T* queryPoints, int count, int k,
+			       Neighbor* results, int threads = 0) const;
+
+   int size() const { return _tree.size(); }
+   int dimension() const { return _tree.dimension(); }
+
+   // Returns the number of bytes taken by the quantized tree, and by the
+   // exact points it re-ranks candidates with
+   size_t memoryUsage() const;
+
+  private:
+   // Quantizes a query point, clamping it to the box the points are
+   // quantized in. Returns the distance between the clamped point and
+   // its quantized point, and sets 'clampDistance' to the squared
+   // distance by which it was clamped, in the units of the original
+   // points.
+   double quantize(const T* queryPoint, Q* quantized,
+		   double& clampDistance) const;
+
+   FlatKDTree<Q, Dim>  _tree;
+   std::vector<T>      _points;      // the original points, row-major,
+				     // in the order of the tree's points
+   std::vector<double> _offsets;     // per axis
+   double              _scale;       // the size of one quantization step
+   double              _pointError;  // the furthest a point may be from
+					// its quantized point
+};
+
+
+// The version of the binary ShardedKDTree routing index format written
+// by this code
+#define SHARDED_KDTREE_VERSION 1
+
+// The header of a serialized ShardedKDTree routing index. It begins as
+// a FlatKDTreeHeader does, and is followed by the routing nodes, the
+// bounding box of each shard (its low corner followed by its high
+// corner) and the number of points of each shard, one array after
+// another.
+struct ShardedKDTreeHeader
+{
+   char     magic[8];         // "KDSHARDS"
+   uint32_t version;          // SHARDED_KDTREE_VERSION
+   uint32_t byteOrder;        // 0x01020304
+   uint32_t coordinateType;   // see coordinateTypeCode()
+   int32_t  dimension;
+   int32_t  size;             // number of points over all shards
+   int32_t  nodeCount;        // number of routing nodes
+   int32_t  shardCount;
+   int32_t  nodeSize;         // sizeof(FlatKDNode<T>)
+};
+
+// One logical FlatKDTree split into shards, so that an index too large
+// for one machine can be spread over several. The top levels of the
+// tree become a small routing index, whose leaves are the subtrees
+// below them, and each subtree is written to a file of its own as an
+// ordinary FlatKDTree whose indices are those of the whole data set.
+//
+// A query descends the routing index to the shard whose cell holds it,
+// and then backtracks into every other shard whose points' bounding box
+// is closer than the worst result found so far, merging the results of
+// all the shards it searches. A router that sends queries to shards
+// served elsewhere can do the same with route(): it asks the nearest
+// shard first, and each further shard only while its distance is below
+// the kth nearest distance found so far.
+template<class T, int Dim = DYNAMIC_DIMENSION> class ShardedKDTree
+{
+  public:
+   typedef typename PointStorage<T, Dim>::type Point;
+
+   ShardedKDTree()
+      : _dimension(Dim), _size(0) {};
+
+   // Builds a tree over 'count' points stored one after another,
+   // 'dimension' values each, as FlatKDTree::build() would, and splits
+   // it 'shardDepth' levels below the root into (up to) 2^shardDepth
+   // shards. The routing index is written to 'filename', and each shard
+   // to shardFilename(filename, shard).
+   static bool buildFiles(
+      const T* points, int count, int dimension, int shardDepth,
+      const std::string& filename,
+      const KDTreeBuildOptions& options = KDTreeBuildOptions());
+
+   // Returns the name of the file holding a shard of the routing index
+   // in 'filename'
+   static std::string shardFilename(const std::string& filename,
+				    int shard);
+
+   // Reads the routing index from 'filename', without any of the
+   // shards, which is all route() needs. Returns false if the file
+   // can't be read, wasn't written for this type of tree, or holds a
+   // routing index that queries couldn't safely traverse.
+   bool loadIndex(const std::string& filename);
+
+   // Reads the routing index and maps every shard into memory (see
+   // FlatKDTree::mapFile())
+   bool load(const std::string& filename);
+
+   // Returns every shard whose points' bounding box is within 'radius'
+   // (inclusive) of the query point, nearest first, as a Neighbor whose
+   // index is the shard and whose distance is that of its box
+   std::vector<Neighbor> route(
+      const T* queryPoint,
+      double radius = std::numeric_limits<double>::infinity()) const;
+
+   // The queries of FlatKDTree, over the points of every shard. The
+   // leaf budget of 'options' applies to each shard searched.
+   // nearestNeighbor() returns an index of -1 if there are no points.
+   // Until load() has mapped the shards, the queries find nothing.
+   Neighbor nearestNeighbor(
+      const Point& queryPoint,
+      const KDTreeQueryOptions& options = KDTreeQueryOptions()) const;
+   Neighbor nearestNeighbor(
+      const T* queryPoint,
+      const KDTreeQueryOptions& options = KDTreeQueryOptions()) const;
+   std::vector<Neighbor> kNearestNeighbors(
+      const Point& queryPoint, int k,
+      const KDTreeQueryOptions& options = KDTreeQueryOptions()) const;
+   std::vector<Neighbor> kNearestNeighbors(
+      const T* queryPoint, int k,
+      const KDTreeQueryOptions& options = KDTreeQueryOptions()) const;
+   int radiusSearch(const Point& queryPoint, double radius,
+		    std::vector<Neighbor>& results) const;
+   int radiusSearch(const T* queryPoint, double radius,
+		    std::vector<Neighbor>& results) const;
+
+   int size() const { return _size; }
+   int dimension() const
+   {
+      return Dim == DYNAMIC_DIMENSION ? _dimension : Dim;
+   }
+   int shardCount() const { return _shardSizes.size(); }
+
+   // Whether load() has mapped the shards, rather than loadIndex() only
+   // reading the routing index
+   bool shardsLoaded() const { return !_shards.empty(); }
+
+   // The trees of the shards, once load() has mapped them
+   const FlatKDTree<T, Dim>& shard(int shard) const
+   {
+      return _shards[shard];
+   }
+
+  private:
+   // The state of a buildFiles() call
+   struct ShardBuild;
+
+   // Appends the routing nodes of the subtree over order[start, end),
+   // 'depth' levels below the root and split along 'parentAxis', to
+   // the state's index, building and writing its shards. Returns the
+   // index of its root node.
+   static int buildRouting(ShardBuild& state, int start, int end,
+			   int parentAxis, int depth);
+
+   // Returns whether the routing index, which was read from a file, can
+   // be traversed safely: every split axis is within the dimension,
+   // every child follows its parent, no leaf is deeper than the search
+   // stacks, each shard has a single leaf and at least one point, and
+   // the shards hold 'size' points between them
+   bool validIndex(int size) const;
+
+   // Returns the squared distance from the query point to the bounding
+   // box of a shard
+   double shardDistance(int shard, const T* queryPoint) const;
+
+   // Appends the shards under routing node 'nodeIdx' whose bounding
+   // boxes are within 'sqrRadius' of the query point to 'shards'
+   void routeBelow(int nodeIdx, const T* queryPoint, double sqrRadius,
+		   std::vector<Neighbor>& shards) const;
+
+   // Visits every shard under routing node 'nodeIdx' that may hold a
+   // point closer than the worst of 'results', the one on the query
+   // point's side of each split first, offering each of its points to
+   // 'results' under its index into the whole data set
+   template<class ResultSet>
+   void search(int nodeIdx, const T* queryPoint, ResultSet& results,
+	       const KDTreeQueryOptions& options) const;
+
+   int                             _dimension;
+   int                             _size;         // over all shards
+   std::vector<FlatKDNode<T>>      _nodes;        // a leaf's 'left' is
+						  // its shard
+   std::vector<T>                  _bounds;       // 2*dimension() values
+						  // per shard
+   std::vector<int>                _shardSizes;
+   std::vector<FlatKDTree<T, Dim>> _shards;       // empty until load()
+};
+
+
+//////////////////
+// Implementations
+
+// Helper functions
+
+// Returns the squared Euclidian distance between two equal-sized
+// vectors.
+template<class T>
+double squaredDistance(const std::vector<T>& a, const std::vector<T>& b)
+{
+   assert(a.size() == b.size());
+
+   double dist = 0.0;
+   for (int ii=0; ii<a.size(); ++ii)
+   {
+      dist += (a[ii]-b[ii])*(a[ii]-b[ii]);
+   }
+
+   return dist;
+}
+
+// Asks for the cache line holding 'address' to be fetched, without
+// waiting for it
+inline void prefetch(const void* address)
+{
+#if defined(__GNUC__) || defined(__clang__)
+   __builtin_prefetch(address);
+#elif defined(_M_X64) || defined(_M_IX86)
+   _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#else
+   (void)address;
+#endif
+}
+
+// Returns the squared Euclidian distance between two points of the
+// given dimension
+template<class T>
+double squaredDistance(const T* a, const T* b, int dimension)
+{
+   double dist = 0.0;
+   for (int ii=0; ii<dimension; ++ii)
+   {
+      const double diff = double(a[ii]) - double(b[ii]);
+      dist += diff*diff;
+   }
+
+   return dist;
+}
+
+// Returns the squared Euclidian distance between two points of
+// dimension Dim, unrolled at compile time
+template<class T, int Dim>
+struct FixedSquaredDistance
+{
+   static double eval(const T* a, const T* b)
+   {
+      const double diff = double(a[Dim-1]) - double(b[Dim-1]);
+      return FixedSquaredDistance<T, Dim-1>::eval(a, b) + diff*diff;
+   }
+};
+
+template<class T>
+struct FixedSquaredDistance<T, 0>
+{
+   static double eval(const T*, const T*)
+   {
+      return 0.0;
+   }
+};
+
+// Dispatches to the unrolled distance when Dim is known at compile time
+template<int Dim, class T>
+double squaredDistance(const T* a, const T* b, int dimension)
+{
+   return Dim == DYNAMIC_DIMENSION
+      ? squaredDistance(a, b, dimension)
+      : FixedSquaredDistance<T, Dim>::eval(a, b);
+}
+
+// Computes the squared Euclidian distances between a query point and
+// each of the BLOCK_WIDTH points of a block, whose coordinates are
+// stored one axis after another. This is the portable version; float
+// and double blocks use SIMD instructions where they're available.
+template<class T, int Dim>
+struct BlockSquaredDistances
+{
+   static void eval(const T* block, const T* queryPoint, int dimension,
+		    double* distances)
+   {
+      const int dim = Dim == DYNAMIC_DIMENSION ? dimension : Dim;
+      std::fill_n(distances, BLOCK_WIDTH, 0.0);
+      for (int aa=0; aa<dim; ++aa)
+      {
+	 const T* axis = block + aa*BLOCK_WIDTH;
+	 for (int ll=0; ll<BLOCK_WIDTH; ++ll)
+	 {
+	    const double diff = double(axis[ll]) - double(queryPoint[aa]);
+	    distances[ll] += diff*diff;
+	 }
+      }
+   }
+};
+
+#if defined(__AVX512F__) || defined(__AVX2__) || \
+   (defined(__ARM_NEON) && defined(__aarch64__))
+static_assert(BLOCK_WIDTH == 8, "SIMD kernels expect blocks of 8 points");
+#endif
+
+#if defined(__AVX512F__)
+
+template<int Dim>
+struct BlockSquaredDistances<double, Dim>
+{
+   static void eval(const double* block, const double* queryPoint,
+		    int dimension, double* distances)
+   {
+      const int dim = Dim == DYNAMIC_DIMENSION ? dimension : Dim;
+      __m512d sum = _mm512_setzero_pd();
+      for (int aa=0; aa<dim; ++aa)
+      {
+	 const __m512d diff = _mm512_sub_pd(
+	    _mm512_loadu_pd(block + aa*BLOCK_WIDTH),
+	    _mm512_set1_pd(queryPoint[aa]));
+	 sum = _mm512_add_pd(sum, _mm512_mul_pd(diff, diff));
+      }
+      _mm512_storeu_pd(distances, sum);
+   }
+};
+
+template<int Dim>
+struct BlockSquaredDistances<float, Dim>
+{
+   static void eval(const float* block, const float* queryPoint,
+		    int dimension, double* distances)
+   {
+      const int dim = Dim == DYNAMIC_DIMENSION ? dimension : Dim;
+      __m512d sum = _mm512_setzero_pd();
+      for (int aa=0; aa<dim; ++aa)
+      {
+	 const __m512d diff = _mm512_sub_pd(
+	    _mm512_cvtps_pd(_mm256_loadu_ps(block + aa*BLOCK_WIDTH)),
+	    _mm512_set1_pd(queryPoint[aa]));
+	 sum = _mm512_add_pd(sum, _mm512_mul_pd(diff, diff));
+      }
+      _mm512_storeu_pd(distances, sum);
+   }
+};
+
+#elif defined(__AVX2__)
+
+template<int Dim>
+struct BlockSquaredDistances<double, Dim>
+{
+   static void eval(const double* block, const double* queryPoint,
+		    int dimension, double* distances)
+   {
+      const int dim = Dim == DYNAMIC_DIMENSION ? dimension : Dim;
+      __m256d sumLo = _mm256_setzero_pd();
+      __m256d sumHi = _mm256_setzero_pd();
+      for (int aa=0; aa<dim; ++aa)
+      {
+	 const double* axis = block + aa*BLOCK_WIDTH;
+	 const __m256d query = _mm256_set1_pd(queryPoint[aa]);
+	 const __m256d diffLo = _mm256_sub_pd(_mm256_loadu_pd(axis), query);
+	 const __m256d diffHi = _mm256_sub_pd(_mm256_loadu_pd(axis + 4),
+					      query);
+	 sumLo = _mm256_add_pd(sumLo, _mm256_mul_pd(diffLo, diffLo));
+	 sumHi = _mm256_add_pd(sumHi, _mm256_mul_pd(diffHi, diffHi));
+      }
+      _mm256_storeu_pd(distances, sumLo);
+      _mm256_storeu_pd(distances + 4, sumHi);
+   }
+};
+
+template<int Dim>
+struct BlockSquaredDistances<float, Dim>
+{
+   static void eval(const float* block, const float* queryPoint,
+		    int dimension, double* distances)
+   {
+      const int dim = Dim == DYNAMIC_DIMENSION ? dimension : Dim;
+      __m256d sumLo = _mm256_setzero_pd();
+      __m256d sumHi = _mm256_setzero_pd();
+      for (int aa=0; aa<dim; ++aa)
+      {
+	 const float* axis = block + aa*BLOCK_WIDTH;
+	 const __m256d query = _mm256_set1_pd(queryPoint[aa]);
+	 const __m256d diffLo = _mm256_sub_pd(
+	    _mm256_cvtps_pd(_mm_loadu_ps(axis)), query);
+	 const __m256d diffHi = _mm256_sub_pd(
+	    _mm256_cvtps_pd(_mm_loadu_ps(axis + 4)), query);
+	 sumLo = _mm256_add_pd(sumLo, _mm256_mul_pd(diffLo, diffLo));
+	 sumHi = _mm256_add_pd(sumHi, _mm256_mul_pd(diffHi, diffHi));
+      }
+      _mm256_storeu_pd(distances, sumLo);
+      _mm256_storeu_pd(distances + 4, sumHi);
+   }
+};
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+template<int Dim>
+struct BlockSquaredDistances<double, Dim>
+{
+   static void eval(const double* block, const double* queryPoint,
+		    int dimension, double* distances)
+   {
+      const int dim = Dim == DYNAMIC_DIMENSION ? dimension : Dim;
+      float64x2_t sum[BLOCK_WIDTH/2];
+      for (int vv=0; vv<BLOCK_WIDTH/2; ++vv)
+      {
+	 sum[vv] = vdupq_n_f64(0.0);
+      }
+      for (int aa=0; aa<dim; ++aa)
+      {
+	 const double* axis = block + aa*BLOCK_WIDTH;
+	 const float64x2_t query = vdupq_n_f64(queryPoint[aa]);
+	 for (int vv=0; vv<BLOCK_WIDTH/2; ++vv)
+	 {
+	    const float64x2_t diff = vsubq_f64(vld1q_f64(axis + 2*vv), query);
+	    sum[vv] = vaddq_f64(sum[vv], vmulq_f64(diff, diff));
+	 }
+      }
+      for (int vv=0; vv<BLOCK_WIDTH/2; ++vv)
+      {
+	 vst1q_f64(distances + 2*vv, sum[vv]);
+      }
+   }
+};
+
+template<int Dim>
+struct BlockSquaredDistances<float, Dim>
+{
+   static void eval(const float* block, const float* queryPoint,
+		    int dimension, double* distances)
+   {
+      const int dim = Dim == DYNAMIC_DIMENSION ? dimension : Dim;
+      float64x2_t sum[BLOCK_WIDTH/2];
+      for (int vv=0; vv<BLOCK_WIDTH/2; ++vv)
+      {
+	 sum[vv] = vdupq_n_f64(0.0);
+      }
+      for (int aa=0; aa<dim; ++aa)
+      {
+	 const float* axis = block + aa*BLOCK_WIDTH;
+	 const float64x2_t query = vdupq_n_f64(queryPoint[aa]);
+	 for (int vv=0; vv<BLOCK_WIDTH/2; ++vv)
+	 {
+	    const float64x2_t diff = vsubq_f64(
+	       vcvt_f64_f32(vld1_f32(axis + 2*vv)), query);
+	    sum[vv] = vaddq_f64(sum[vv], vmulq_f64(diff, diff));
+	 }
+      }
+      for (int vv=0; vv<BLOCK_WIDTH/2; ++vv)
+      {
+	 vst1q_f64(distances + 2*vv, sum[vv]);
+      }
+   }
+};
+
+#endif
+
+// Tracks the single best candidate of a nearest neighbor query
+class NearestResult
+{
+  public:
+   NearestResult()
+      : point{-1}
+      , sqrDistance{std::numeric_limits<double>::max()}
+   {}
+
+   double worstDistance() const { return sqrDistance; }
+
+   void insert(int pointIdx, double distance)
+   {
+      if (distance < sqrDistance)
+      {
+	 sqrDistance = distance;
+	 point = pointIdx;
+      }
+   }
+
+   int point;
+   double sqrDistance;
+};
+
+// Tracks the k best candidates of a query in a max-heap with a fixed
+// capacity, so the worst of them is always at hand for pruning and the
+// heap's storage is only allocated once
+class KNearestHeap
+{
+  public:
+   explicit KNearestHeap(int k)
+      : _k{k}
+   {
+      _heap.reserve(k);
+   }
+
+   // Keeps the candidates in 'storage', whose capacity is reused
+   KNearestHeap(int k, std::vector<Neighbor>&& storage)
+      : _k{k}
+      , _heap(std::move(storage))
+   {
+      _heap.clear();
+      _heap.reserve(k);
+   }
+
+   // The distance a candidate has to beat to be kept
+   double worstDistance() const
+   {
+      return int(_heap.size()) < _k
+	 ? std::numeric_limits<double>::max()
+	 : _heap.front().sqrDistance;
+   }
+
+   void insert(int pointIdx, double distance)
+   {
+      if (int(_heap.size()) < _k)
+      {
+	 _heap.push_back(Neighbor{pointIdx, distance});
+	 std::push_heap(_heap.begin(), _heap.end());
+      }
+      else if (distance < _heap.front().sqrDistance)
+      {
+	 std::pop_heap(_heap.begin(), _heap.end());
+	 _heap.back() = Neighbor{pointIdx, distance};
+	 std::push_heap(_heap.begin(), _heap.end());
+      }
+   }
+
+   // Hands over the candidates, sorted by increasing distance. The
+   // heap is left empty.
+   std::vector<Neighbor> sorted()
+   {
+      std::sort_heap(_heap.begin(), _heap.end());
+      return std::move(_heap);
+   }
+
+  private:
+   int _k;
+   std::vector<Neighbor> _heap;
+};
+
+// Collects every candidate within a fixed distance of a query
+class RadiusResult
+{
+  public:
+   RadiusResult(double sqrRadius, std::vector<Neighbor>& neighbors)
+      : _sqrRadius{sqrRadius}
+      , _neighbors(neighbors)
+   {}
+
+   double worstDistance() const { return _sqrRadius; }
+
+   void insert(int pointIdx, double distance)
+   {
+      if (distance <= _sqrRadius)
+      {
+	 Neighbor neighbor;
+	 neighbor.index = pointIdx;
+	 neighbor.sqrDistance = distance;
+	 _neighbors.push_back(neighbor);
+      }
+   }
+
+  private:
+   double _sqrRadius;
+   std::vector<Neighbor>& _neighbors;
+};
+
+// Tracks the k best candidates of one point of an all nearest
+// neighbors search, in a max-heap that lives in a larger array,
+// ignoring the point itself
+class HeapResult
+{
+  public:
+   HeapResult(Neighbor* heap, int& size, int k, int excluded)
+      : _heap{heap}
+      , _size(size)
+      , _k{k}
+      , _excluded{excluded}
+   {}
+
+   double worstDistance() const
+   {
+      return _size < _k
+	 ? std::numeric_limits<double>::max()
+	 : _heap[0].sqrDistance;
+   }
+
+   void insert(int pointIdx, double distance)
+   {
+      if (pointIdx == _excluded)
+      {
+	 return;
+      }
+      if (_size < _k)
+      {
+	 _heap[_size++] = Neighbor{pointIdx, distance};
+	 std::push_heap(_heap, _heap + _size);
+      }
+      else if (distance < _heap[0].sqrDistance)
+      {
+	 std::pop_heap(_heap, _heap + _k);
+	 _heap[_k - 1] = Neighbor{pointIdx, distance};
+	 std::push_heap(_heap, _heap + _k);
+      }
+   }
+
+  private:
+   Neighbor* _heap;
+   int&      _size;
+   int       _k;
+   int       _excluded;
+};
+
+// Tracks the k best candidates of a query of a QuantizedKDTree by their
+// exact distances, skipping those whose quantized distance shows they
+// can't be among them, and pruning by the quantized distance any point
+// closer than the worst candidate could have
+template<class T, int Dim>
+class RerankedResult
+{
+  public:
+   RerankedResult(KNearestHeap& heap, const T* points, const T* queryPoint,
+		  int dimension, double scale, double clampDistance,
+		  double error)
+      : _heap(heap)
+      , _points{points}
+      , _queryPoint{queryPoint}
+      , _dimension{dimension}
+      , _scale{scale}
+      , _clampDistance{clampDistance}
+      , _error{error}
+      , _bound{std::numeric_limits<double>::max()}
+   {}
+
+   double worstDistance() const { return _bound; }
+
+   void insert(int pointIdx, double distance)
+   {
+      if (distance > _bound)
+      {
+	 return;
+      }
+      _heap.insert(pointIdx,
+		   squaredDistance<Dim>(_queryPoint,
+					_points + size_t(pointIdx)*_dimension,
+					_dimension));
+      const double worst = _heap.worstDistance();
+      if (worst < std::numeric_limits<double>::max())
+      {
+	 const double reach =
+	    (sqrt(std::max(worst - _clampDistance, 0.0)) + _error)/_scale;
+	 _bound = reach*reach;
+      }
+   }
+
+  private:
+   KNearestHeap& _heap;
+   const T*      _points;      // exact, row-major, per tree point
+   const T*      _queryPoint;
+   int           _dimension;
+   double        _scale;       // of a quantization step
+   double        _clampDistance;   // (squared) from the query point to
+				   // the box the points are quantized in
+   double        _error;       // the most by which a quantized distance
+			       // may fall short of the exact one, from a
+			       // point of the box
+   double        _bound;       // (squared, in quantization steps)
+};
+
+// Passes the candidates of one tree of a DynamicKDTree on to another
+// result set under their ids, skipping those that have been erased
+template<class ResultSet>
+class LiveResult
+{
+  public:
+   LiveResult(ResultSet& results, const int* indices, const int* ids,
+	      const char* live)
+      : _results(results)
+      , _indices{indices}
+      , _ids{ids}
+      , _live{live}
+   {}
+
+   double worstDistance() const { return _results.worstDistance(); }
+
+   void insert(int pointIdx, double distance)
+   {
+      const int id = _ids[_indices[pointIdx]];
+      if (_live[id])
+      {
+	 _results.insert(id, distance);
+      }
+   }
+
+  private:
+   ResultSet&  _results;
+   const int*  _indices;   // the tree's primal index of each point
+   const int*  _ids;       // the id of each primal point
+   const char* _live;      // per id
+};
+
+// Passes the points a shard of a ShardedKDTree offers on to another
+// result set, under their indices into the whole data set
+template<class ResultSet>
+class ShardResult
+{
+  public:
+   ShardResult(ResultSet& results, const int* indices)
+      : _results(results)
+      , _indices{indices}
+   {}
+
+   double worstDistance() const { return _results.worstDistance(); }
+
+   void insert(int pointIdx, double distance)
+   {
+      _results.insert(_indices[pointIdx], distance);
+   }
+
+  private:
+   ResultSet& _results;
+   const int* _indices;   // the shard's primal index of each point
+};
+
+// Counts the candidates within a fixed distance of a query
+class RadiusCount
+{
+  public:
+   explicit RadiusCount(double sqrRadius)
+      : count{0}
+      , _sqrRadius{sqrRadius}
+   {}
+
+   double worstDistance() const { return _sqrRadius; }
+
+   void insert(int, double distance)
+   {
+      count += distance <= _sqrRadius;
+   }
+
+   int count;
+
+  private:
+   double _sqrRadius;
+};
+
+// Identifies the coordinate type of a serialized tree by its kind
+// ('f'loating point, signed 'i'nteger or 'u'nsigned integer) and size
+template<class T>
+uint32_t coordinateTypeCode()
+{
+   const uint32_t kind = std::numeric_limits<T>::is_integer
+      ? (std::numeric_limits<T>::is_signed ? 'i' : 'u')
+      : 'f';
+   return (kind << 8) | sizeof(T);
+}
+
+// Rounds a byte offset up to the alignment of a serialized tree's arrays
+inline uint64_t alignedOffset(uint64_t offset)
+{
+   return (offset + FLAT_KDTREE_ALIGNMENT - 1)
+      / FLAT_KDTREE_ALIGNMENT * FLAT_KDTREE_ALIGNMENT;
+}
+
+// Returns the header of a serialized FlatKDTree of T coordinates with the
+// given dimensions, laying its arrays out one after another
+template<class T>
+FlatKDTreeHeader flatKDTreeHeader(int dimension, int size, int nodeCount,
+				  int blockWidth)
+{
+   const uint64_t coordCount = (uint64_t(size) + blockWidth - 1)
+      / blockWidth*blockWidth*dimension;
+
+   FlatKDTreeHeader header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, "KDTREE", 6);
+   header.version = FLAT_KDTREE_VERSION;
+   header.byteOrder = 0x01020304;
+   header.coordinateType = coordinateTypeCode<T>();
+   header.dimension = dimension;
+   header.size = size;
+   header.nodeCount = nodeCount;
+   header.blockWidth = blockWidth;
+   header.nodeSize = sizeof(FlatKDNode<T>);
+   header.nodesOffset = alignedOffset(sizeof(header));
+   header.coordsOffset = alignedOffset(
+      header.nodesOffset + uint64_t(nodeCount)*sizeof(FlatKDNode<T>));
+   header.indicesOffset = alignedOffset(
+      header.coordsOffset + coordCount*sizeof(T));
+   header.fileSize = header.indicesOffset + uint64_t(size)*sizeof(int32_t);
+   return header;
+}
+
+// Returns the number of bytes taken by a serialized FlatKDTree<T, Dim>
+// with the given header, or 0 if the header wasn't written for that
+// type of tree or its arrays aren't laid out as operator<< lays them
+// out
+template<class T, int Dim>
+uint64_t flatKDTreeFileSize(const FlatKDTreeHeader& header)
+{
+   if (memcmp(header.magic, "KDTREE\0\0", 8) != 0
+       || header.version != FLAT_KDTREE_VERSION
+       || header.byteOrder != 0x01020304
+       || header.coordinateType != coordinateTypeCode<T>()
+       || header.nodeSize != int32_t(sizeof(FlatKDNode<T>))
+       || header.dimension < 1
+       || (Dim != DYNAMIC_DIMENSION && header.dimension != Dim)
+       || (header.blockWidth != 1 && header.blockWidth != BLOCK_WIDTH)
+       || header.size < 1 || header.nodeCount < 1)
+   {
+      return 0;
+   }
+
+   const uint64_t blocks =
+      (uint64_t(header.size) + header.blockWidth - 1)/header.blockWidth;
+   const uint64_t nodesEnd = header.nodesOffset
+      + uint64_t(header.nodeCount)*sizeof(FlatKDNode<T>);
+   const uint64_t coordsEnd = header.coordsOffset
+      + blocks*header.blockWidth*header.dimension*sizeof(T);
+   const uint64_t indicesEnd = header.indicesOffset
+      + uint64_t(header.size)*sizeof(int32_t);
+   if (header.nodesOffset < sizeof(header)
+       || header.nodesOffset % FLAT_KDTREE_ALIGNMENT != 0
+       || header.coordsOffset % FLAT_KDTREE_ALIGNMENT != 0
+       || header.indicesOffset % FLAT_KDTREE_ALIGNMENT != 0
+       || header.coordsOffset < nodesEnd
+       || header.indicesOffset < coordsEnd
+       || header.fileSize != indicesEnd)
+   {
+      return 0;
+   }
+   return header.fileSize;
+}
+
+// Calls 'function(ii, thread)' for each ii in [0, count), spreading the
+// calls over 'threads' threads (all of the hardware's threads if
+// 'threads' is less than one); 'thread' identifies the calling thread,
+// from 0 up to 'threads'. Work is handed out in chunks of 'chunkSize'
+// calls, so threads that finish early take on more of it. If a call
+// throws, the threads stop taking on work, and the first exception is
+// rethrown once they have all finished.
+template<class Function>
+void parallelFor(size_t count, int threads, const Function& function,
+		 size_t chunkSize = 64)
+{
+   if (threads < 1)
+   {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+   }
+   threads = std::min<size_t>(threads, (count + chunkSize - 1)/chunkSize);
+
+   if (threads <= 1)
+   {
+      for (size_t ii=0; ii<count; ++ii)
+      {
+	 function(ii, 0);
+      }
+      return;
+   }
+
+   std::atomic<size_t> next(0);
+   std::mutex errorMutex;
+   std::exception_ptr error;
+   auto worker = [&](int thread)
+   {
+      try
+      {
+	 for (;;)
+	 {
+	    const size_t first = next.fetch_add(chunkSize);
+	    if (first >= count)
+	    {
+	       return;
+	    }
+
+	    const size_t last = std::min(count, first + chunkSize);
+	    for (size_t ii=first; ii<last; ++ii)
+	    {
+	       function(ii, thread);
+	    }
+	 }
+      }
+      catch (...)
+      {
+	 next = count;
+	 std::lock_guard<std::mutex> lock(errorMutex);
+	 if (!error)
+	 {
+	    error = std::current_exception();
+	 }
+      }
+   };
+
+   std::vector<std::thread> pool;
+   for (int tt=1; tt<threads; ++tt)
+   {
+      pool.push_back(std::thread(worker, tt));
+   }
+   worker(0);
+   for (auto& thread : pool)
+   {
+      thread.join();
+   }
+   if (error)
+   {
+      std::rethrow_exception(error);
+   }
+}
+
+// The number of points below which a FlatKDTree subtree is built by a
+// single thread
+#define PARALLEL_BUILD_THRESHOLD 65536
+
+// The number of points below which a median is found by a single
+// thread
+#define PARALLEL_PARTITION_THRESHOLD (1 << 20)
+
+// Reorders order[start, end), indices of rows of a row-major buffer, so
+// that order[median] is the row that would be there if they were sorted
+// by their 'axis' coordinate, with no greater row before it and no
+// smaller row after it, as std::nth_element does. Rows are first split
+// around two pivots sampled to bracket the median, in parallel, so
+// only the rows between the pivots need to be searched serially.
+template<class T>
+void parallelNthElement(const T* rows, int dimension, int axis,
+			std::vector<int>& order, int start, int median,
+			int end, int threads)
+{
+   using namespace std;
+
+   auto value = [&](int row) { return rows[size_t(row)*dimension + axis]; };
+   const size_t count = end - start;
+
+   // Pick pivots a few standard errors either side of the median's
+   // rank in a regular sample
+   const int sampleSize = 4096;
+   vector<T> sample(sampleSize);
+   for (int ss=0; ss<sampleSize; ++ss)
+   {
+      sample[ss] = value(order[start + (count*ss)/sampleSize]);
+   }
+   sort(sample.begin(), sample.end());
+   const double rank = double(median - start)/count;
+   const T low = sample[max(0, int((rank - 0.05)*sampleSize))];
+   const T high = sample[min(sampleSize - 1, int((rank + 0.05)*sampleSize))];
+
+   // Count the rows of each thread's slice that fall below, between and
+   // above the pivots...
+   const size_t slice = (count + threads - 1)/threads;
+   vector<array<size_t, 3>> counts(threads);
+   auto bucket = [&](int row)
+   {
+      const T v = value(row);
+      return v < low ? 0 : (v > high ? 2 : 1);
+   };
+   parallelFor(threads, threads,
+	       [&](size_t tt, int)
+	       {
+		  counts[tt].fill(0);
+		  const size_t last = min(count, (tt + 1)*slice);
+		  for (size_t ii=tt*slice; ii<last; ++ii)
+		  {
+		     ++counts[tt][bucket(order[start + ii])];
+		  }
+	       }, 1);
+
+   // ...then scatter them to their place in the split
+   vector<array<size_t, 3>> offsets(threads);
+   size_t total = 0;
+   for (int bb=0; bb<3; ++bb)
+   {
+      for (int tt=0; tt<threads; ++tt)
+      {
+	 offsets[tt][bb] = total;
+	 total += counts[tt][bb];
+      }
+   }
+
+   vector<int> split(count);
+   parallelFor(threads, threads,
+	       [&](size_t tt, int)
+	       {
+		  const size_t last = min(count, (tt + 1)*slice);
+		  for (size_t ii=tt*slice; ii<last; ++ii)
+		  {
+		     const int row = order[start + ii];
+		     split[offsets[tt][bucket(row)]++] = row;
+		  }
+	       }, 1);
+   copy(split.begin(), split.end(), order.begin() + start);
+
+   // The median is almost always between the pivots, but may not be
+   const int lowEnd = start + offsets[threads - 1][0];
+   const int highStart = start + offsets[threads - 1][1];
+   const int first = median < lowEnd ? start
+      : (median < highStart ? lowEnd : highStart);
+   const int last = median < lowEnd ? lowEnd
+      : (median < highStart ? highStart : end);
+   nth_element(order.begin() + first, order.begin() + median,
+	       order.begin() + last,
+	       [&](int i, int j) { return value(i) < value(j); });
+}
+
+// Compares two row indices into a row-major coordinate buffer based
+// on their in_axis'th element; used for sorting
+template <class T>
+class CoordinateCompare
+{
+  public:
+   CoordinateCompare(const T* coords, int dimension, int in_axis)
+      : _coords{coords}
+      , _dimension{dimension}
+      , _axis{in_axis}
+   {}
+
+   bool operator()(int i, int j) const
+   {
+      return _coords[size_t(i)*_dimension + _axis]
+	 < _coords[size_t(j)*_dimension + _axis];
+   }
+
+  private:
+   const T* _coords;
+   int _dimension;
+   int _axis;
+};
+
+// A file of points, each stored as its coordinates followed by its index
+// into the primal dataset, which is written and then read back in
+// order, any number of times. A uniform sample of the points written
+// is kept in memory, or parked in a file of its own while it isn't
+// needed. The files are removed when the object is destroyed.
+template<class T>
+class KDTreeScratchFile
+{
+  public:
+   KDTreeScratchFile(const std::string& filename, int dimension,
+		     size_t sampleSize, uint64_t seed);
+   ~KDTreeScratchFile();
+
+   // Appends a point, which can only be done before the file is read
+   void append(const T* row, int index);
+
+   // Appends up to 'maxPoints' more points to 'rows' and 'indices',
+   // returning how many were read
+   size_t read(std::vector<T>& rows, std::vector<int>& indices,
+	       size_t maxPoints);
+
+   // Starts reading again from the first point
+   void rewind();
+
+   size_t size() const { return _size; }
+
+   // The sampled points, one after another, read back into memory if
+   // they were parked
+   const std::vector<T>& sample();
+
+   // Writes the sample out to a file of its own and frees it, until
+   // sample() next needs it. No more points can be appended.
+   void parkSample();
+
+   // Frees the sample, once no more points are appended and it isn't
+   // needed
+   void discardSample()
+   {
+      std::vector<T>().swap(_sample);
+      _sampleSize = 0;
+   }
+
+  private:
+   // Writes out the buffered points, and switches to reading
+   void finishWriting();
+
+   std::string       _filename;
+   int               _dimension;
+   size_t            _recordSize;
+   FILE*             _file;
+   bool              _writing;
+   size_t            _size;
+   std::vector<char> _buffer;       // points yet to be written
+
+   size_t            _sampleSize;
+   std::vector<T>    _sample;
+   size_t            _parkedSize;   // coordinates in the sample's file,
+				    // if it is parked
+   std::mt19937_64   _random;
+};
+
+// The size of the buffer through which scratch files are written
+#define SCRATCH_BUFFER_SIZE (1 << 20)
+
+template<class T>
+KDTreeScratchFile<T>::KDTreeScratchFile(const std::string& filename,
+					int dimension, size_t sampleSize,
+					uint64_t seed)
+   : _filename(filename), _dimension(dimension),
+     _recordSize(dimension*sizeof(T) + sizeof(int32_t)),
+     _file(fopen(filename.c_str(), "w+b")), _writing(true), _size(0),
+     _sampleSize(sampleSize), _parkedSize(0), _random(seed)
+{
+   if (!_file)
+   {
+      throw std::runtime_error("unable to create " + filename + ": "
+			       + strerror(errno));
+   }
+   _buffer.reserve(SCRATCH_BUFFER_SIZE + _recordSize);
+}
+
+template<class T>
+KDTreeScratchFile<T>::~KDTreeScratchFile()
+{
+   fclose(_file);
+   remove(_filename.c_str());
+   if (_parkedSize > 0)
+   {
+      remove((_filename + ".sample").c_str());
+   }
+}
+
+template<class T>
+const std::vector<T>& KDTreeScratchFile<T>::sample()
+{
+   if (_parkedSize > 0)
+   {
+      const std::string filename = _filename + ".sample";
+      FILE* file = fopen(filename.c_str(), "rb");
+      _sample.resize(_parkedSize);
+      const bool read = file
+	 && fread(_sample.data(), sizeof(T), _parkedSize, file) == _parkedSize;
+      if (file)
+      {
+	 fclose(file);
+      }
+      if (!read)
+      {
+	 throw std::runtime_error("unable to read " + filename);
+      }
+      remove(filename.c_str());
+      _parkedSize = 0;
+   }
+   return _sample;
+}
+
+template<class T>
+void KDTreeScratchFile<T>::parkSample()
+{
+   if (_writing)
+   {
+      finishWriting();
+   }
+   if (_sample.empty())
+   {
+      return;
+   }
+
+   const std::string filename = _filename + ".sample";
+   FILE* file = fopen(filename.c_str(), "wb");
+   bool written = file
+      && fwrite(_sample.data(), sizeof(T), _sample.size(), file)
+	 == _sample.size();
+   if (file)
+   {
+      written = fclose(file) == 0 && written;
+   }
+   if (!written)
+   {
+      remove(filename.c_str());
+      throw std::runtime_error("unable to write " + filename);
+   }
+   _parkedSize = _sample.size();
+   std::vector<T>().swap(_sample);
+}
+
+template<class T>
+void KDTreeScratchFile<T>::append(const T* row, int index)
+{
+   assert(_writing);
+
+   // Sample the rows by reservoir sampling
+   if (_size < _sampleSize)
+   {
+      _sample.insert(_sample.end(), row, row + _dimension);
+   }
+   else
+   {
+      const uint64_t replaced =
+	 std::uniform_int_distribution<uint64_t>(0, _size)(_random);
+      if (replaced < _sampleSize)
+      {
+	 std::copy(row, row + _dimension, &_sample[replaced*_dimension]);
+      }
+   }
+
+   const size_t offset = _buffer.size();
+   _buffer.resize(offset + _recordSize);
+   memcpy(&_buffer[offset], row, _dimension*sizeof(T));
+   const int32_t index32 = index;
+   memcpy(&_buffer[offset + _dimension*sizeof(T)], &index32,
+	  sizeof(index32));
+   ++_size;
+
+   if (_buffer.size() >= SCRATCH_BUFFER_SIZE)
+   {
+      if (fwrite(_buffer.data(), 1, _buffer.size(), _file) != _buffer.size())
+      {
+	 throw std::runtime_error("unable to write " + _filename + ": "
+				  + strerror(errno));
+      }
+      _buffer.clear();
+   }
+}
+
+template<class T>
+void KDTreeScratchFile<T>::finishWriting()
+{
+   if (fwrite(_buffer.data(), 1, _buffer.size(), _file) != _buffer.size()
+       || fflush(_file) != 0)
+   {
+      throw std::runtime_error("unable to write " + _filename + ": "
+			       + strerror(errno));
+   }
+   std::vector<char>().swap(_buffer);
+   _writing = false;
+   rewind();
+}
+
+template<class T>
+void KDTreeScratchFile<T>::rewind()
+{
+   if (_writing)
+   {
+      finishWriting();
+      return;
+   }
+   if (fseek(_file, 0, SEEK_SET) != 0)
+   {
+      throw std::runtime_error("unable to read " + _filename + ": "
+			       + strerror(errno));
+   }
+}
+
+template<class T>
+size_t KDTreeScratchFile<T>::read(std::vector<T>& rows,
+				  std::vector<int>& indices, size_t maxPoints)
+{
+   if (_writing)
+   {
+      finishWriting();
+   }
+
+   std::vector<char> records(
+      std::min(maxPoints, SCRATCH_BUFFER_SIZE/_recordSize + 1)*_recordSize);
+   size_t total = 0;
+   while (total < maxPoints)
+   {
+      const size_t wanted = std::min(maxPoints - total,
+				     records.size()/_recordSize);
+      const size_t count =
+	 fread(records.data(), _recordSize, wanted, _file);
+      if (count < wanted && ferror(_file))
+      {
+	 throw std::runtime_error("unable to read " + _filename + ": "
+				  + strerror(errno));
+      }
+
+      const size_t rowsEnd = rows.size();
+      rows.resize(rowsEnd + count*_dimension);
+      for (size_t ii=0; ii<count; ++ii)
+      {
+	 const char* record = &records[ii*_recordSize];
+	 memcpy(&rows[rowsEnd + ii*_dimension], record,
+		_dimension*sizeof(T));
+	 int32_t index;
+	 memcpy(&index, record + _dimension*sizeof(T), sizeof(index));
+	 indices.push_back(index);
+      }
+      total += count;
+      if (count < wanted)
+      {
+	 break;
+      }
+   }
+   return total;
+}
+
+// Query statistics
+inline KDTreeQueryStats kdTreeQueryStats()
+{
+   KDTreeQueryStats stats;
+#ifdef KDTREE_STATS
+   KDTreeSharedStats& shared = kdTreeSharedStats;
+   stats.queries = shared.queries.exchange(0);
+   stats.nodesVisited = shared.nodesVisited.exchange(0);
+   stats.leavesScanned = shared.leavesScanned.exchange(0);
+   stats.distanceComputations = shared.distanceComputations.exchange(0);
+   stats.backtracks = shared.backtracks.exchange(0);
+   stats.maxStackDepth = shared.maxStackDepth.exchange(0);
+#endif
+   return stats;
+}
+
+inline void resetKDTreeQueryStats()
+{
+   kdTreeQueryStats();
+}
+
+inline KDTreeQueryStats lastKDTreeQueryStats()
+{
+#ifdef KDTREE_STATS
+   return kdTreeLastQueryStats;
+#else
+   return KDTreeQueryStats();
+#endif
+}
+
+inline std::ostream& operator<< (std::ostream& out,
+				 const KDTreeQueryStats& stats)
+{
+   const double queries = std::max<uint64_t>(stats.queries, 1);
+   out << "Queries: " << stats.queries << std::endl
+       << "Nodes visited: " << stats.nodesVisited << " ("
+       << stats.nodesVisited/queries << " per query)" << std::endl
+       << "Leaves scanned: " << stats.leavesScanned << " ("
+       << stats.leavesScanned/queries << " per query)" << std::endl
+       << "Distance computations: " << stats.distanceComputations << " ("
+       << stats.distanceComputations/queries << " per query)" << std::endl
+       << "Backtracks: " << stats.backtracks << " ("
+       << stats.backtracks/queries << " per query)" << std::endl
+       << "Max stack depth: " << stats.maxStackDepth << std::endl;
+   return out;
+}
+
+//
+// KDTree member function implementations
+//
+template <class T, class Metric>
+KDTree<T, Metric>::KDTree(KDTree&& other)
+   : _metric(std::move(other._metric))
+   , _arena(std::move(other._arena))
+   , _rootNode(other._rootNode)
+{
+   other._rootNode = nullptr;
+}
+
+template <class T, class Metric>
+KDTree<T, Metric>& KDTree<T, Metric>::operator=(KDTree&& other)
+{
+   if (this != &other)
+   {
+      _metric = std::move(other._metric);
+      _arena = std::move(other._arena);
+      _rootNode = other._rootNode;
+      other._rootNode = nullptr;
+   }
+   return *this;
+}
+
+template <class T, class Metric>
+bool KDTree<T, Metric>::build(const std::vector< std::vector<T> >& data)
+{
+   using namespace std;
+
+   bool success = false;
+   try
+   {
+      if (data.empty())
+      {
+	 throw invalid_argument("no points to build from");
+      }
+
+      // Copy the input data into a single row-major buffer, and
+      // partition an array of row indices rather than the rows
+      const int dimension = data[0].size();
+      vector<T> rows;
+      rows.reserve(data.size()*dimension);
+      for (const auto& point : data)
+      {
+	 if (int(point.size()) != dimension)
+	 {
+	    throw invalid_argument("points are not consistently dimensioned");
+	 }
+	 rows.insert(rows.end(), point.begin(), point.end());
+      }
+      vector<int> order(data.size());
+      iota(order.begin(), order.end(), 0);
+
+      // Each node's point is the median of its points, which its right
+      // subtree holds too, so there are 2N - 1 nodes for N points. The
+      // arena's only buffer holds them all, padded to the nodes'
+      // alignment; building more fails rather than growing it.
+      const size_t nodeBytes =
+	 (sizeof(KDNode<T>) + dimension*sizeof(T) + alignof(KDNode<T>) - 1)
+	 / alignof(KDNode<T>)*alignof(KDNode<T>);
+      unique_ptr<KDNodeArena> arena(new KDNodeArena(
+	 (2*data.size() - 1)*nodeBytes, false));
+      KDNode<T>* root = KDNode<T>::build(*arena, rows.data(), dimension,
+					 order, 0, order.size());
+      _arena = std::move(arena);
+      _rootNode = root;
+      success = true;
+   }
+   catch (exception& e)
+   {
+      cerr << "Exception during construction: " << e.what() << endl;
+   }
+
+   return success;
+}
+
+template <class T, class Metric>
+IndexedPoint<T> KDTree<T, Metric>::nearestNeighbor(
+   const std::vector<T>& queryPoint)
+{
+   using namespace std;
+
+   if (_rootNode == nullptr)
+   {
+      cerr << "No tree has been constructed" << endl;
+      return IndexedPoint<T>();
+   }
+
+   assert(_rootNode->_dimension == int(queryPoint.size()));
+
+   // Initialize the nearest point to the origin, and assign it a
+   // maxiamally bad distance
+   IndexedPoint<T> best;
+   best.point.resize(queryPoint.size(), 0);
+   best.index = -1;
+   double dist = std::numeric_limits<T>::max();
+
+   try
+   {
+      // Only the best node is tracked, and its point copied at the end
+      const KDNode<T>* bestNode =
+	 _rootNode->nearestNeighbor(queryPoint.data(), _metric, dist);
+      if (bestNode != nullptr)
+      {
+	 best.index = bestNode->_index;
+	 best.point.assign(bestNode->point(),
+			   bestNode->point() + bestNode->_dimension);
+      }
+   }
+     catch (exception& e)
+   {
+      cerr << "Exception during nearest neighbor query: " << e.what() << endl;
+   }
+
+   return best;
+}
+
+template <class T, class Metric>
+Neighbor KDTree<T, Metric>::nearestNeighbor(const T* queryPoint) const
+{
+   using namespace std;
+
+   Neighbor best{-1, numeric_limits<double>::max()};
+   if (_rootNode == nullptr)
+   {
+      return best;
+   }
+
+   try
+   {
+      const KDNode<T>* bestNode =
+	 _rootNode->nearestNeighbor(queryPoint, _metric, best.sqrDistance);
+      if (bestNode != nullptr)
+      {
+	 best.index = bestNode->_index;
+      }
+   }
+   catch (exception& e)
+   {
+      cerr << "Exception during nearest neighbor query: " << e.what() << endl;
+   }
+
+   return best;
+}
+
+// Serialization
+template <class T, class Metric>
+std::ostream& operator<< (std::ostream &out, const KDTree<T, Metric>& tree)
+{
+   using namespace std;
+
+   // Ensure that we seialize our results at full numeric precision
+   out.precision(numeric_limits<T>::max_digits10);
+
+   if (tree._rootNode != nullptr)
+   {
+      out << *(tree._rootNode);
+   }
+
+   return out;
+}
+
+// We use 'axis == -1' as an indictor for a node that doesn't exist.
+#define NULLPTR_MARKER -1
+
+inline int intFromStream(std::istream& in)
+{
+   using namespace std;
+
+   // Read an int
+   string line;
+   getline(in, line);
+   istringstream axis_stream(line);
+
+   int val;
+   if (!(axis_stream >> val))
+   {
+      // End of file
+      return -1;
+   }
+
+   return val;
+}
+
+template <class T>
+std::ostream& operator<< (std::ostream &out, const KDNode<T>& node)
+{
+   using namespace std;
+
+   out << node._axis << endl;
+
+   out << node._index << endl;
+   for (int ii=0; ii<node._dimension; ++ii)
+   {
+      out << node.point()[ii] << " ";
+   }
+   out << endl;
+
+   if (node._leftNode != nullptr)
+   {
+      out << *(node._leftNode);
+   }
+   else
+   {
+      out << NULLPTR_MARKER << endl;
+   }
+
+   if (node._rightNode != nullptr)
+   {
+      out << *(node._rightNode);
+   }
+   else
+   {
+      out << NULLPTR_MARKER << endl;
+   }
+
+   return out;
+}
+
+
+// Deserialization
+template<class T, class Metric>
+std::istream& operator>> (std::istream &in, KDTree<T, Metric>& tree)
+{
+   using namespace std;
+
+   // Read the axis so we can determine if our tree should even
+   // be constructed
+   int axis = intFromStream(in);
+
+   if (axis == -1)
+   {
+      // A root node doesn't exist or we've reached the end of the file
+      return in;
+   }
+
+   // Read the whole tree into a new arena, which replaces the old one
+   unique_ptr<KDNodeArena> arena(new KDNodeArena);
+   vector<T> values;
+   KDNode<T>* root = KDNode<T>::read(in, axis, *arena, values);
+   tree._arena = std::move(arena);
+   tree._rootNode = root;
+   return in;
+}
+
+
+// KDNode member function defintion
+//
+template <class T>
+KDNode<T>* KDNode<T>::create(KDNodeArena& arena, int axis, int index,
+			     const T* point, int dimension)
+{
+   static_assert(alignof(T) <= alignof(KDNode<T>),
+		 "a node's point must be aligned where the node ends");
+
+   void* memory = arena.allocate(sizeof(KDNode<T>) + dimension*sizeof(T),
+				 alignof(KDNode<T>));
+   KDNode<T>* node = new (memory) KDNode<T>(axis, index, dimension);
+   std::copy(point, point + dimension,
+	     const_cast<T*>(node->point()));
+   return node;
+}
+
+template <class T>
+KDNode<T>* KDNode<T>::read(std::istream& in, int axis, KDNodeArena& arena,
+			   std::vector<T>& values)
+{
+   using namespace std;
+
+   const int index = intFromStream(in);
+
+   string line;
+   getline(in, line);
+   istringstream point_stream(line);
+
+   values.clear();
+   T elem;
+   while (point_stream >> elem)
+   {
+      values.push_back(elem);
+   }
+   KDNode<T>* node = create(arena, axis, index, values.data(),
+			    values.size());
+
+   // read axis of left child
+   axis = intFromStream(in);
+   if (axis != -1)
+   {
+      node->_leftNode = read(in, axis, arena, values);
+   }
+
+   // read axis of right child; -1 means the node doesn't exist or
+   // we've reached the end of the file
+   axis = intFromStream(in);
+   if (axis != -1)
+   {
+      node->_rightNode = read(in, axis, arena, values);
+   }
+
+   return node;
+}
+
+template <class T>
+KDNode<T>* KDNode<T>::build(KDNodeArena& arena, const T* rows,
+			    int dimension, std::vector<int>& order,
+			    int start, int end, int axis)
+{
+   using namespace std;
+
+   axis = (axis + 1) % dimension; // separating axis of this node
+
+   const int dataSize = end - start;
+   if (dataSize < 2)
+   {
+      // copy, so we can discard the data vector after construction
+      return create(arena, axis, order[start],
+		    &rows[size_t(order[start])*dimension], dimension);
+   }
+
+   // find median element
+   const int median = start + dataSize/2;
+   nth_element(order.begin() + start, order.begin() + median,
+	       order.begin() + end,
+	       CoordinateCompare<T>(rows, dimension, axis));
+
+   // Allocating the node before its subtrees keeps the nodes in
+   // depth-first order in the arena
+   KDNode<T>* node = create(arena, axis, order[median],
+			    &rows[size_t(order[median])*dimension],
+			    dimension);
+   if (start != median)
+   {
+      node->_leftNode = build(arena, rows, dimension, order, start, median,
+			      axis);
+   }
+   node->_rightNode = build(arena, rows, dimension, order, median, end,
+			    axis);
+   return node;
+}
+
+
+template <class T>
+template <class Metric>
+const KDNode<T>* KDNode<T>::nearestNeighbor(const T* queryPoint,
+					    const Metric& metric,
+					    double& bestDistance) const
+{
+   using namespace std;
+
+   // The nodes still to be visited, each with the metric's distance
+   // from the query point to the splitting plane that separates it from
+   // the path the search took (zero for the side the query point is on)
+   pair<const KDNode<T>*, double> pending[MAX_SEARCH_DEPTH];
+   int pendingCount = 0;
+   pending[pendingCount++] = make_pair(this, 0.0);
+
+   KDTREE_STATS_SCOPE();
+
+   // Only the best node is tracked
+   const KDNode<T>* bestNode = nullptr;
+   while (pendingCount > 0)
+   {
+      const pair<const KDNode<T>*, double> next = pending[--pendingCount];
+
+      // If this node's splitting plane is no longer within the
+      // radius of the best distance hypersphere, the node can't hold
+      // anything closer
+      if (next.second > bestDistance)
+      {
+	 continue;
+      }
+      KDTREE_COUNT(nodesVisited, 1);
+      KDTREE_COUNT(distanceComputations, 1);
+      KDTREE_COUNT(backtracks, next.second > 0);
+
+      // If the point at this node is closer than our current best, make
+      // it the best
+      const KDNode<T>& node = *next.first;
+      const double distance = metric.distance(node.point(), queryPoint,
+					      node._dimension);
+      if (distance < bestDistance)
+      {
+	 bestDistance = distance;
+	 bestNode = &node;
+      }
+
+      // Visit the child on the query point's side of the splitting
+      // plane first, and then the other, in case it is actually closer
+      const T split = node.point()[node._axis];
+      const bool goLeft = queryPoint[node._axis] <= split;
+      const KDNode<T>* nearNode = goLeft && node._leftNode != nullptr
+	 ? node._leftNode
+	 : node._rightNode;
+      const KDNode<T>* farNode = goLeft
+	 ? node._rightNode
+	 : node._leftNode;
+      if (pendingCount + 2 > MAX_SEARCH_DEPTH)
+      {
+	 throw length_error("tree is too deep to search");
+      }
+      if (farNode != nullptr && farNode != nearNode)
+      {
+	 pending[pendingCount++] = make_pair(
+	    farNode, metric.planeDistance(queryPoint[node._axis], split,
+					  node._axis));
+      }
+      if (nearNode != nullptr)
+      {
+	 pending[pendingCount++] = make_pair(nearNode, 0.0);
+      }
+      KDTREE_COUNT(leavesScanned, nearNode == nullptr);
+      KDTREE_COUNT_DEPTH(pendingCount);
+   }
+
+   return bestNode;
+}
+
+
+// FlatKDTree member function implementations
+//
+template <class T, int Dim>
+void FlatKDTree<T, Dim>::clear()
+{
+   _dimension = Dim;
+   _size = 0;
+   _blockWidth = 1;
+   _nodes.clear();
+   _coords.clear();
+   _indices.clear();
+   _mapping.reset();
+   bindStorage();
+}
+
+template <class T, int Dim>
+void FlatKDTree<T, Dim>::bindStorage()
+{
+   _nodeCount = _nodes.size();
+   _nodeData = _nodes.data();
+   _coordData = _coords.data();
+   _indexData = _indices.data();
+}
+
+template <class T, int Dim>
+bool FlatKDTree<T, Dim>::validNodes() const
+{
+   // Children follow their parents, so a single pass in array order
+   // reaches every node after the nodes referring to it
+   std::vector<int> depth(_nodeCount, 0);
+   for (int nn=0; nn<_nodeCount; ++nn)
+   {
+      const FlatKDNode<T>& node = _nodeData[nn];
+      if (node.axis == LEAF_AXIS)
+      {
+	 if (node.left < 0 || node.left > node.right || node.right > _size
+	     || node.left % _blockWidth != 0 || depth[nn] > MAX_SEARCH_DEPTH)
+	 {
+	    return false;
+	 }
+      }
+      else if (node.axis < 0 || node.axis >= dimension()
+	       || node.left <= nn || node.left >= _nodeCount
+	       || node.right <= nn || node.right >= _nodeCount)
+      {
+	 return false;
+      }
+      else
+      {
+	 depth[node.left] = std::max(depth[node.left], depth[nn] + 1);
+	 depth[node.right] = std::max(depth[node.right], depth[nn] + 1);
+      }
+   }
+   return true;
+}
+
+template <class T, int Dim>
+FlatKDTree<T, Dim>::FlatKDTree(const FlatKDTree& other)
+   : FlatKDTree()
+{
+   *this = other;
+}
+
+template <class T, int Dim>
+FlatKDTree<T, Dim>::FlatKDTree(FlatKDTree&& other)
+   : FlatKDTree()
+{
+   *this = std::move(other);
+}
+
+// A copy of a mapped tree shares its mapping; otherwise the arrays
+// are copied, and the copy must read from its own vectors
+template <class T, int Dim>
+FlatKDTree<T, Dim>& FlatKDTree<T, Dim>::operator=(const FlatKDTree& other)
+{
+   if (this != &other)
+   {
+      _dimension = other._dimension;
+      _size = other._size;
+      _blockWidth = other._blockWidth;
+      _nodes = other._nodes;
+      _coords = other._coords;
+      _indices = other._indices;
+      _mapping = other._mapping;
+      bindStorage();
+      if (_mapping)
+      {
+	 _nodeCount = other._nodeCount;
+	 _nodeData = other._nodeData;
+	 _coordData = other._coordData;
+	 _indexData = other._indexData;
+      }
+   }
+   return *this;
+}
+
+template <class T, int Dim>
+FlatKDTree<T, Dim>& FlatKDTree<T, Dim>::operator=(FlatKDTree&& other)
+{
+   if (this != &other)
+   {
+      // Moving a vector keeps its buffer, so the array pointers stay
+      // valid
+      _dimension = other._dimension;
+      _size = other._size;
+      _blockWidth = other._blockWidth;
+      _nodeCount = other._nodeCount;
+      _nodeData = other._nodeData;
+      _coordData = other._coordData;
+      _indexData = other._indexData;
+      _nodes = std::move(other._nodes);
+      _coords = std::move(other._coords);
+      _indices = std::move(other._indices);
+      _mapping = std::move(other._mapping);
+      other.clear();
+   }
+   return *this;
+}
+
+template <class T, int Dim>
+template <class InputPoint>
+bool FlatKDTree<T, Dim>::build(const std::vector<InputPoint>& data,
+			       const KDTreeBuildOptions& options)
+{
+   using namespace std;
+
+   const int dimension = Dim != DYNAMIC_DIMENSION || data.empty()
+      ? Dim
+      : int(data[0].size());
+
+   // Pack the input into a single row-major buffer
+   vector<T> rows;
+   try
+   {
+      rows.reserve(data.size()*dimension);
+      for (const auto& point : data)
+      {
+	 if (int(point.size()) != dimension)
+	 {
+	    throw invalid_argument("points are not consistently dimensioned");
+	 }
+	 rows.insert(rows.end(), point.begin(), point.end());
+      }
+   }
+   catch (exception& e)
+   {
+      clear();
+      cerr << "Exception during construction: " << e.what() << endl;
+      return false;
+   }
+
+   return build(rows.data(), data.size(), dimension, options);
+}
+
+template <class T, int Dim>
+bool FlatKDTree<T, Dim>::build(const T* points, int count, int dimension,
+			       const KDTreeBuildOptions& options)
+{
+   return buildBelow(points, count, dimension, -1, options);
+}
+
+template <class T, int Dim>
+bool FlatKDTree<T, Dim>::buildBelow(const T* points, int count,
+				    int dimension, int parentAxis,
+				    const KDTreeBuildOptions& options)
+{
+   using namespace std;
+
+   clear();
+
+   bool success = false;
+   try
+   {
+      if (count < 1)
+      {
+	 throw invalid_argument("no points to build from");
+      }
+      if (options.leafSize < 1)
+      {
+	 throw invalid_argument("leaves must hold at least one point");
+      }
+      if (dimension < 1
+	  || (Dim != DYNAMIC_DIMENSION && dimension != Dim))
+      {
+	 throw invalid_argument("points are not of the tree's dimension");
+      }
+      _dimension = dimension;
+
+      // Leaves too small to fill a block are scanned point by point
+      _blockWidth = options.leafSize < BLOCK_WIDTH ? 1 : BLOCK_WIDTH;
+
+      // Partition an array of row indices, rather than the points
+      // themselves, which are only read
+      vector<int> order(count);
+      iota(order.begin(), order.end(), 0);
+
+      const int threads = options.threads < 1
+	 ? max(1u, thread::hardware_concurrency())
+	 : options.threads;
+      _nodes = buildParallel(points, order, 0, order.size(), parentAxis,
+			     options, threads);
+      if (options.nodeLayout == LAYOUT_VAN_EMDE_BOAS)
+      {
+	 layoutVanEmdeBoas();
+      }
+
+      // Finally, lay the points out in leaf order
+      packPoints(points, order, _blockWidth, threads);
+      _indices.swap(order);
+      bindStorage();
+      success = true;
+   }
+   catch (exception& e)
+   {
+      clear();
+      cerr << "Exception during construction: " << e.what() << endl;
+   }
+
+   return success;
+}
+
+template <class T, int Dim>
+int FlatKDTree<T, Dim>::splitPosition(int start, int end) const
+{
+   // The median element becomes the first point of the right subtree.
+   // It is rounded down to a whole number of blocks so that every leaf
+   // starts on a block boundary.
+   const int half = (end - start)/2;
+   return start + std::max(_blockWidth, half - half%_blockWidth);
+}
+
+template <class T, int Dim>
+int FlatKDTree<T, Dim>::buildRange(const T* rows, std::vector<int>& order,
+				   int start, int end, int axis,
+				   const KDTreeBuildOptions& options,
+				   std::vector<FlatKDNode<T>>& nodes) const
+{
+   using namespace std;
+
+   // Nodes are appended in depth-first order, so this node's subtrees
+   // follow it in the array
+   const int nodeIdx = nodes.size();
+   nodes.push_back(FlatKDNode<T>());
+
+   if (end - start <= options.leafSize)
+   {
+      nodes[nodeIdx].split = T();
+      nodes[nodeIdx].axis = LEAF_AXIS;
+      nodes[nodeIdx].left = start;
+      nodes[nodeIdx].right = end;
+      return nodeIdx;
+   }
+
+   axis = splitAxis(rows, order, start, end, axis, options.splitRule);
+
+   // find median element
+   const int median = splitPosition(start, end);
+   nth_element(order.begin() + start, order.begin() + median,
+	       order.begin() + end,
+	       CoordinateCompare<T>(rows, dimension(), axis));
+   const T split = rows[size_t(order[median])*dimension() + axis];
+
+   const int left = buildRange(rows, order, start, median, axis, options,
+			       nodes);
+   const int right = buildRange(rows, order, median, end, axis, options,
+				nodes);
+
+   FlatKDNode<T>& node = nodes[nodeIdx];
+   node.split = split;
+   node.axis = axis;
+   node.left = left;
+   node.right = right;
+
+   return nodeIdx;
+}
+
+template <class T, int Dim>
+std::vector<FlatKDNode<T>> FlatKDTree<T, Dim>::buildParallel(
+   const T* rows, std::vector<int>& order, int start, int end, int axis,
+   const KDTreeBuildOptions& options, int threads) const
+{
+   using namespace std;
+
+   vector<FlatKDNode<T>> nodes;
+   if (threads <= 1 || end - start < PARALLEL_BUILD_THRESHOLD)
+   {
+      nodes.reserve(2*((end - start)/options.leafSize + 1));
+      buildRange(rows, order, start, end, axis, options, nodes);
+      return nodes;
+   }
+
+   FlatKDNode<T> node = FlatKDNode<T>();
+   node.axis = splitAxis(rows, order, start, end, axis, options.splitRule,
+			 threads);
+
+   const int median = splitPosition(start, end);
+   if (end - start < PARALLEL_PARTITION_THRESHOLD)
+   {
+      nth_element(order.begin() + start, order.begin() + median,
+		  order.begin() + end,
+		  CoordinateCompare<T>(rows, dimension(), node.axis));
+   }
+   else
+   {
+      parallelNthElement(rows, dimension(), node.axis, order, start, median,
+			 end, threads);
+   }
+   node.split = rows[size_t(order[median])*dimension() + node.axis];
+
+   // Build the left subtree on a new thread, and the right one on this
+   // thread, splitting the remaining threads between them
+   vector<FlatKDNode<T>> left;
+   exception_ptr leftError;
+   thread leftThread([&]()
+		     {
+			try
+			{
+			   left = buildParallel(rows, order, start, median,
+						node.axis, options, threads/2);
+			}
+			catch (...)
+			{
+			   leftError = current_exception();
+			}
+		     });
+
+   vector<FlatKDNode<T>> right;
+   try
+   {
+      right = buildParallel(rows, order, median, end, node.axis, options,
+			    threads - threads/2);
+   }
+   catch (...)
+   {
+      leftThread.join();
+      throw;
+   }
+   leftThread.join();
+   if (leftError)
+   {
+      rethrow_exception(leftError);
+   }
+
+   // Splice the subtrees in after this node, moving their child indices
+   // along with them
+   node.left = 1;
+   node.right = 1 + left.size();
+   nodes.reserve(1 + left.size() + right.size());
+   nodes.push_back(node);
+   for (const auto* subtree : {&left, &right})
+   {
+      const int offset = nodes.size();
+      for (FlatKDNode<T> child : *subtree)
+      {
+	 if (child.axis != LEAF_AXIS)
+	 {
+	    child.left += offset;
+	    child.right += offset;
+	 }
+	 nodes.push_back(child);
+      }
+   }
+
+   return nodes;
+}
+
+template <class T, int Dim>
+void FlatKDTree<T, Dim>::layoutVanEmdeBoas()
+{
+   using namespace std;
+
+   // Children follow their parents, so each node's children are done
+   // before it
+   vector<int> heights(_nodes.size(), 1);
+   for (int nn=int(_nodes.size()) - 1; nn>=0; --nn)
+   {
+      const FlatKDNode<T>& node = _nodes[nn];
+      if (node.axis != LEAF_AXIS)
+      {
+	 heights[nn] = 1 + max(heights[node.left], heights[node.right]);
+      }
+   }
+
+   vector<int> layout;
+   layout.reserve(_nodes.size());
+   vanEmdeBoasOrder(0, heights[0], layout);
+   assert(layout.size() == _nodes.size() && layout[0] == 0);
+
+   // Move each node to its new position, along with its child indices
+   vector<int> position(_nodes.size());
+   for (size_t nn=0; nn<layout.size(); ++nn)
+   {
+      position[layout[nn]] = nn;
+   }
+   vector<FlatKDNode<T>> nodes(_nodes.size());
+   for (size_t nn=0; nn<layout.size(); ++nn)
+   {
+      FlatKDNode<T> node = _nodes[layout[nn]];
+      if (node.axis != LEAF_AXIS)
+      {
+	 node.left = position[node.left];
+	 node.right = position[node.right];
+      }
+      nodes[nn] = node;
+   }
+   _nodes.swap(nodes);
+}
+
+template <class T, int Dim>
+void FlatKDTree<T, Dim>::vanEmdeBoasOrder(int nodeIdx, int height,
+					  std::vector<int>& layout) const
+{
+   if (height == 1 || _nodes[nodeIdx].axis == LEAF_AXIS)
+   {
+      layout.push_back(nodeIdx);
+      return;
+   }
+
+   // Lay out the top half of the levels, then each of the subtrees
+   // hanging from its bottom level. The top half is rounded down, so
+   // the subtrees a path ends in are as large as they can be.
+   const int top = height/2;
+   vanEmdeBoasOrder(nodeIdx, top, layout);
+
+   std::vector<int> roots;
+   nodesAtDepth(nodeIdx, top, roots);
+   for (int root : roots)
+   {
+      vanEmdeBoasOrder(root, height - top, layout);
+   }
+}
+
+template <class T, int Dim>
+void FlatKDTree<T, Dim>::nodesAtDepth(int nodeIdx, int depth,
+				      std::vector<int>& roots) const
+{
+   const FlatKDNode<T>& node = _nodes[nodeIdx];
+   if (depth == 0)
+   {
+      roots.push_back(nodeIdx);
+   }
+   else if (node.axis != LEAF_AXIS)
+   {
+      nodesAtDepth(node.left, depth - 1, roots);
+      nodesAtDepth(node.right, depth - 1, roots);
+   }
+}
+
+template <class T, int Dim>
+int FlatKDTree<T, Dim>::splitAxis(const T* rows, const std::vector<int>& order,
+				  int start, int end, int parentAxis,
+				  SplitRule rule, int threads) const
+{
+   using namespace std;
+
+   if (rule == SPLIT_CYCLE)
+   {
+      return (parentAxis + 1) % dimension();
+   }
+
+   // Gather the bounds of the points along each axis, and the sums
+   // needed for their variance. Offsets from the first point are
+   // summed, rather than the coordinates, to limit cancellation.
+   struct AxisSpread
+   {
+      double low;
+      double high;
+      double sum;
+      double sumSquares;
+   };
+   const int dimension = this->dimension();
+   const int pieces = end - start < PARALLEL_PARTITION_THRESHOLD
+      ? 1
+      : max(1, threads);
+   vector<AxisSpread> spreads(size_t(pieces)*dimension);
+   const T* origin = rows + size_t(order[start])*dimension;
+   parallelFor(pieces, pieces,
+	       [&](size_t pp, int)
+	       {
+		  AxisSpread* spread = &spreads[pp*dimension];
+		  for (int aa=0; aa<dimension; ++aa)
+		  {
+		     spread[aa].low = numeric_limits<double>::max();
+		     spread[aa].high = -numeric_limits<double>::max();
+		     spread[aa].sum = 0;
+		     spread[aa].sumSquares = 0;
+		  }
+
+		  const int first = start + (end - start)*pp/pieces;
+		  const int last = start + (end - start)*(pp + 1)/pieces;
+		  for (int ii=first; ii<last; ++ii)
+		  {
+		     const T* row = rows + size_t(order[ii])*dimension;
+		     for (int aa=0; aa<dimension; ++aa)
+		     {
+			const double offset = double(row[aa]) - origin[aa];
+			spread[aa].low = min(spread[aa].low, offset);
+			spread[aa].high = max(spread[aa].high, offset);
+			spread[aa].sum += offset;
+			spread[aa].sumSquares += offset*offset;
+		     }
+		  }
+	       }, 1);
+
+   // Pick the axis with the largest spread, preferring lower axes
+   const double count = end - start;
+   int bestAxis = 0;
+   double bestScore = -1;
+   for (int aa=0; aa<dimension; ++aa)
+   {
+      AxisSpread total = spreads[aa];
+      for (int pp=1; pp<pieces; ++pp)
+      {
+	 const AxisSpread& spread = spreads[size_t(pp)*dimension + aa];
+	 total.low = min(total.low, spread.low);
+	 total.high = max(total.high, spread.high);
+	 total.sum += spread.sum;
+	 total.sumSquares += spread.sumSquares;
+      }
+
+      const double mean = total.sum/count;
+      const double score = rule == SPLIT_WIDEST_EXTENT
+	 ? total.high - total.low
+	 : total.sumSquares/count - mean*mean;
+      if (score > bestScore)
+      {
+	 bestAxis = aa;
+	 bestScore = score;
+      }
+   }
+
+   return bestAxis;
+}
+
+template <class T, int Dim>
+void FlatKDTree<T, Dim>::packPoints(const T* rows,
+				    const std::vector<int>& order,
+				    int blockWidth, int threads)
+{
+   _size = order.size();
+   _blockWidth = blockWidth;
+
+   // The last block is padded with copies of the last point
+   const size_t blocks = (size_t(_size) + _blockWidth - 1)/_blockWidth;
+   _coords.resize(blocks*_blockWidth*dimension());
+   parallelFor(blocks, threads,
+	       [&](size_t bb, int)
+	       {
+		  T* block = &_coords[bb*_blockWidth*dimension()];
+		  for (int ll=0; ll<_blockWidth; ++ll)
+		  {
+		     const size_t slot = std::min<size_t>(bb*_blockWidth + ll,
+							  _size - 1);
+		     const T* row = rows + size_t(order[slot])*dimension();
+		     for (int aa=0; aa<dimension(); ++aa)
+		     {
+			block[aa*_blockWidth + ll] = row[aa];
+		     }
+		  }
+	       }, 4096);
+}
+
+template <class T, int Dim>
+size_t FlatKDTree<T, Dim>::memoryUsage() const
+{
+   const size_t blocks = (size_t(_size) + _blockWidth - 1)/_blockWidth;
+   return size_t(_nodeCount)*sizeof(FlatKDNode<T>)
+      + blocks*_blockWidth*dimension()*sizeof(T)
+      + size_t(_size)*sizeof(int);
+}
+
+template <class T, int Dim>
+typename FlatKDTree<T, Dim>::Point FlatKDTree<T, Dim>::point(
+   int pointIdx) const
+{
+   Point result = PointStorage<T, Dim>::create(dimension());
+   for (int aa=0; aa<dimension(); ++aa)
+   {
+      result[aa] = coordinate(pointIdx, aa);
+   }
+
+   return result;
+}
+
+template <class T, int Dim>
+IndexedPoint<T, Dim> FlatKDTree<T, Dim>::nearestNeighbor(
+   const Point& queryPoint, const KDTreeQueryOptions& options) const
+{
+   assert(int(queryPoint.size()) == dimension());
+   return nearestNeighbor(queryPoint.data(), options);
+}
+
+template <class T, int Dim>
+IndexedPoint<T, Dim> FlatKDTree<T, Dim>::nearestNeighbor(
+   const T* queryPoint, const KDTreeQueryOptions& options) const
+{
+   using namespace std;
+
+   if (_nodeCount == 0)
+   {
+      cerr << "No tree has been constructed" << endl;
+      return IndexedPoint<T, Dim>();
+   }
+
+   NearestResult best;
+   search(0, queryPoint, best, options);
+
+   // Only the final result is materialized as an IndexedPoint
+   return IndexedPoint<T, Dim>(_indexData[best.point], point(best.point));
+}
+
+template <class T, int Dim>
+std::vector<Neighbor> FlatKDTree<T, Dim>::kNearestNeighbors(
+   const Point& queryPoint, int k, const KDTreeQueryOptions& options) const
+{
+   assert(int(queryPoint.size()) == dimension());
+   return kNearestNeighbors(queryPoint.data(), k, options);
+}
+
+template <class T, int Dim>
+std::vector<Neighbor> FlatKDTree<T, Dim>::kNearestNeighbors(
+   const T* queryPoint, int k, const KDTreeQueryOptions& options) const
+{
+   if (_nodeCount == 0 || k < 1)
+   {
+      return std::vector<Neighbor>();
+   }
+
+   KNearestHeap heap(std::min(k, size()));
+   search(0, queryPoint, heap, options);
+
+   // The heap tracks the tree's points; report indices into the primal
+   // dataset
+   std::vector<Neighbor> neighbors = heap.sorted();
+   for (auto& neighbor : neighbors)
+   {
+      neighbor.index = _indexData[neighbor.index];
+   }
+
+   return neighbors;
+}
+
+template <class T, int Dim>
+int FlatKDTree<T, Dim>::radiusSearch(const Point& queryPoint, double radius,
+				     std::vector<Neighbor>& results) const
+{
+   assert(int(queryPoint.size()) == dimension());
+   return radiusSearch(queryPoint.data(), radius, results);
+}
+
+template <class T, int Dim>
+int FlatKDTree<T, Dim>::radiusSearch(const T* queryPoint, double radius,
+				     std::vector<Neighbor>& results) const
+{
+   if (_nodeCount == 0 || radius < 0)
+   {
+      return 0;
+   }
+
+   const size_t first = results.size();
+   RadiusResult found(radius*radius, results);
+   search(0, queryPoint, found);
+
+   // Report indices into the primal dataset
+   for (size_t nn=first; nn<results.size(); ++nn)
+   {
+      results[nn].index = _indexData[results[nn].index];
+   }
+
+   return results.size() - first;
+}
+
+template <class T, int Dim>
+int FlatKDTree<T, Dim>::radiusCount(const Point& queryPoint,
+				    double radius) const
+{
+   assert(int(queryPoint.size()) == dimension());
+   return radiusCount(queryPoint.data(), radius);
+}
+
+template <class T, int Dim>
+int FlatKDTree<T, Dim>::radiusCount(const T* queryPoint, double radius) const
+{
+   if (_nodeCount == 0 || radius < 0)
+   {
+      return 0;
+   }
+
+   RadiusCount found(radius*radius);
+   search(0, queryPoint, found);
+   return found.count;
+}
+
+template <class T, int Dim>
+void FlatKDTree<T, Dim>::allNearestNeighbors(int k,
+					     std::vector<Neighbor>& results,
+					     int threads) const
+{
+   allNearestNeighbors(*this, k, results, threads);
+}
+
+// A dual-tree search (Gray and Moore, "'N-Body' Problems in Statistical
+// Learning", 2001): a pair of a query node and a reference node is
+// skipped if their bounding boxes are further apart than the kth
+// neighbor of any of the query node's points could be. Otherwise the
+// reference node is split if the query node lies on one side of its
+// plane, and the query node if not, until the query node is a leaf,
+// whose points each search what remains of the reference subtree. A
+// reference split is thereby made once for a whole query subtree rather
+// than once per query point.
+template <class T, int Dim>
+void FlatKDTree<T, Dim>::allNearestNeighbors(const FlatKDTree& queries,
+					     int k,
+					     std::vector<Neighbor>& results,
+					     int threads) const
+{
+   using namespace std;
+
+   assert(queries.dimension() == dimension() || queries._nodeCount == 0);
+
+   results.clear();
+   if (k < 1 || queries._nodeCount == 0)
+   {
+      return;
+   }
+   results.resize(size_t(queries.size())*k);
+   if (_nodeCount == 0)
+   {
+      for (Neighbor& neighbor : results)
+      {
+	 neighbor.index = -1;
+	 neighbor.sqrDistance = numeric_limits<double>::max();
+      }
+      return;
+   }
+
+   DualTreeSearch state;
+   state.queries = &queries;
+   state.queryBounds = queries.nodeBounds();
+   state.referenceBounds = &queries == this
+      ? state.queryBounds
+      : nodeBounds();
+   state.diameters.resize(queries._nodeCount);
+   for (int nn=0; nn<queries._nodeCount; ++nn)
+   {
+      const T* low = &state.queryBounds[size_t(nn)*2*dimension()];
+      const T* high = low + dimension();
+      double diameter = 0;
+      for (int aa=0; aa<dimension(); ++aa)
+      {
+	 diameter += (double(high[aa]) - double(low[aa]))
+	    *(double(high[aa]) - double(low[aa]));
+      }
+      state.diameters[nn] = sqrt(diameter);
+   }
+   state.nodeWorst.assign(queries._nodeCount,
+			  numeric_limits<double>::max());
+   state.nodeBest.assign(queries._nodeCount,
+			 numeric_limits<double>::max());
+   state.heaps.resize(size_t(queries.size())*k);
+   state.heapSizes.assign(queries.size(), 0);
+   state.k = k;
+   state.excludeSelf = &queries == this;
+
+   // Hand out the query subtrees a few levels down to the threads; a
+   // subtree's points and nodes are only touched by the thread
+   // searching it
+   if (threads < 1)
+   {
+      threads = max(1u, thread::hardware_concurrency());
+   }
+   vector<int> subtrees(1, 0);
+   while (threads > 1 && int(subtrees.size()) < 8*threads)
+   {
+      vector<int> children;
+      for (int node : subtrees)
+      {
+	 const FlatKDNode<T>& subtree = queries._nodeData[node];
+	 if (subtree.axis == LEAF_AXIS)
+	 {
+	    children.push_back(node);
+	 }
+	 else
+	 {
+	    children.push_back(subtree.left);
+	    children.push_back(subtree.right);
+	 }
+      }
+      if (children.size() == subtrees.size())
+      {
+	 break;
+      }
+      subtrees.swap(children);
+   }
+
+   parallelFor(subtrees.size(), threads,
+	       [&](size_t ss, int)
+	       {
+		  typename PointStorage<T, Dim>::type queryPoint =
+		     PointStorage<T, Dim>::create(dimension());
+		  dualTreeSearch(state, subtrees[ss], 0, queryPoint.data());
+	       }, 1);
+
+   // Sort each query point's candidates, and report indices into the
+   // primal datasets
+   parallelFor(queries.size(), threads,
+	       [&](size_t qq, int)
+	       {
+		  Neighbor* heap = &state.heaps[qq*k];
+		  const int found = state.heapSizes[qq];
+		  sort_heap(heap, heap + found);
+
+		  Neighbor* out = &results[size_t(queries._indexData[qq])*k];
+		  for (int nn=0; nn<found; ++nn)
+		  {
+		     out[nn].index = _indexData[heap[nn].index];
+		     out[nn].sqrDistance = heap[nn].sqrDistance;
+		  }
+		  for (int nn=found; nn<k; ++nn)
+		  {
+		     out[nn].index = -1;
+		     out[nn].sqrDistance = numeric_limits<double>::max();
+		  }
+	       }, 1024);
+}
+
+template <class T, int Dim>
+std::vector<T> FlatKDTree<T, Dim>::nodeBounds() const
+{
+   using namespace std;
+
+   const int dimension = this->dimension();
+   vector<T> bounds(size_t(_nodeCount)*2*dimension);
+
+   // Children follow their parents, so each node's children are done
+   // before it
+   for (int nn=_nodeCount - 1; nn>=0; --nn)
+   {
+      const FlatKDNode<T>& node = _nodeData[nn];
+      T* low = &bounds[size_t(nn)*2*dimension];
+      T* high = low + dimension;
+      if (node.axis == LEAF_AXIS)
+      {
+	 for (int aa=0; aa<dimension; ++aa)
+	 {
+	    low[aa] = high[aa] = coordinate(node.left, aa);
+	 }
+	 for (int pp=node.left + 1; pp<node.right; ++pp)
+	 {
+	    for (int aa=0; aa<dimension; ++aa)
+	    {
+	       low[aa] = min(low[aa], coordinate(pp, aa));
+	       high[aa] = max(high[aa], coordinate(pp, aa));
+	    }
+	 }
+      }
+      else
+      {
+	 const T* left = &bounds[size_t(node.left)*2*dimension];
+	 const T* right = &bounds[size_t(node.right)*2*dimension];
+	 for (int aa=0; aa<dimension; ++aa)
+	 {
+	    low[aa] = min(left[aa], right[aa]);
+	    high[aa] = max(left[dimension + aa], right[dimension + aa]);
+	 }
+      }
+   }
+
+   return bounds;
+}
+
+template <class T, int Dim>
+double FlatKDTree<T, Dim>::nodeDistance(const DualTreeSearch& state,
+					int queryNode,
+					int referenceNode) const
+{
+   const int dimension = this->dimension();
+   const T* queryLow = &state.queryBounds[size_t(queryNode)*2*dimension];
+   const T* queryHigh = queryLow + dimension;
+   const T* referenceLow =
+      &state.referenceBounds[size_t(referenceNode)*2*dimension];
+   const T* referenceHigh = referenceLow + dimension;
+
+   double distance = 0;
+   for (int aa=0; aa<dimension; ++aa)
+   {
+      const double gap = std::max(
+	 std::max(double(queryLow[aa]) - double(referenceHigh[aa]),
+		  double(referenceLow[aa]) - double(queryHigh[aa])),
+	 0.0);
+      distance += gap*gap;
+   }
+   return distance;
+}
+
+template <class T, int Dim>
+void FlatKDTree<T, Dim>::dualTreeSearch(DualTreeSearch& state,
+					int queryNode, int referenceNode,
+					T* queryPoint) const
+{
+   using namespace std;
+
+   if (nodeDistance(state, queryNode, referenceNode)
+       > state.nodeWorst[queryNode])
+   {
+      return;
+   }
+
+   const FlatKDTree& queries = *state.queries;
+   const FlatKDNode<T>& query = queries._nodeData[queryNode];
+   const FlatKDNode<T>& reference = _nodeData[referenceNode];
+
+   if (query.axis == LEAF_AXIS)
+   {
+      // Search the reference subtree for each query point whose
+      // candidates it could improve
+      const int dimension = this->dimension();
+      const T* referenceLow =
+	 &state.referenceBounds[size_t(referenceNode)*2*dimension];
+      const T* referenceHigh = referenceLow + dimension;
+      double worst = 0;
+      double best = numeric_limits<double>::max();
+      for (int qq=query.left; qq<query.right; ++qq)
+      {
+	 double distance = 0;
+	 for (int aa=0; aa<dimension; ++aa)
+	 {
+	    queryPoint[aa] = queries.coordinate(qq, aa);
+	    const double gap = max(
+	       max(double(queryPoint[aa]) - double(referenceHigh[aa]),
+		   double(referenceLow[aa]) - double(queryPoint[aa])),
+	       0.0);
+	    distance += gap*gap;
+	 }
+
+	 HeapResult candidates(&state.heaps[size_t(qq)*state.k],
+			       state.heapSizes[qq], state.k,
+			       state.excludeSelf ? qq : -1);
+	 if (distance <= candidates.worstDistance())
+	 {
+	    if (reference.axis == LEAF_AXIS)
+	    {
+	       scanLeaf(reference, queryPoint, candidates);
+	    }
+	    else
+	    {
+	       search(referenceNode, queryPoint, candidates);
+	    }
+	 }
+	 worst = max(worst, candidates.worstDistance());
+	 best = min(best, candidates.worstDistance());
+      }
+      boundQueryNode(state, queryNode, worst, best);
+      return;
+   }
+
+   // Descend the reference tree while the whole query node lies on one
+   // side of its splitting plane, visiting that side first; otherwise,
+   // split the query node
+   const int dimension = this->dimension();
+   const T* queryLow = &state.queryBounds[size_t(queryNode)*2*dimension];
+   const T* queryHigh = queryLow + dimension;
+   if (reference.axis != LEAF_AXIS
+       && (queryHigh[reference.axis] <= reference.split
+	   || queryLow[reference.axis] >= reference.split))
+   {
+      const bool leftFirst = queryHigh[reference.axis] <= reference.split;
+      dualTreeSearch(state, queryNode,
+		     leftFirst ? reference.left : reference.right, queryPoint);
+      dualTreeSearch(state, queryNode,
+		     leftFirst ? reference.right : reference.left, queryPoint);
+      return;
+   }
+   dualTreeSearch(state, query.left, referenceNode, queryPoint);
+   dualTreeSearch(state, query.right, referenceNode, queryPoint);
+   boundQueryNode(state, queryNode,
+		  max(state.nodeWorst[query.left],
+		      state.nodeWorst[query.right]),
+		  min(state.nodeBest[query.left], state.nodeBest[query.right]));
+}
+
+// Every point of a query node is within its diameter of the point with
+// the best kth candidate, so its kth neighbor is no further than that
+// candidate plus the diameter (the second bound of Curtin et al., "Tree-
+// Independent Dual-Tree Algorithms", 2013)
+template <class T, int Dim>
+void FlatKDTree<T, Dim>::boundQueryNode(DualTreeSearch& state,
+					int queryNode, double worst,
+					double best) const
+{
+   const double reach = sqrt(best) + state.diameters[queryNode];
+   state.nodeWorst[queryNode] = std::min(worst, reach*reach);
+   state.nodeBest[queryNode] = best;
+}
+
+template <class T, int Dim>
+void FlatKDTree<T, Dim>::nearestNeighborBatch(
+   const std::vector<Point>& queryPoints, std::vector<Neighbor>& results,
+   int threads, const KDTreeQueryOptions& options) const
+{
+   using namespace std;
+
+   results.resize(queryPoints.size());
+
+   if (threads < 1)
+   {
+      threads = max(1u, thread::hardware_concurrency());
+   }
+   const auto queryPoint = [&](size_t ii)
+      {
+	 assert(int(queryPoints[ii].size()) == dimension());
+	 return queryPoints[ii].data();
+      };
+   const vector<int> order = batchOrder(queryPoints.size(), threads,
+					options, queryPoint);
+   if (options.interleave > 1 && _nodeCount != 0)
+   {
+      interleavedBatch(order, threads, queryPoint, NearestResult(),
+		       [&](size_t ii, NearestResult& best)
+		       {
+			  results[ii] = Neighbor{
+			     best.point < 0 ? -1 : _indexData[best.point],
+			     best.sqrDistance};
+			  best = NearestResult();
+		       },
+		       options);
+      return;
+   }
+
+   vector<KDTreeQueryContext> contexts(threads);
+   parallelFor(queryPoints.size(), threads,
+	       [&](size_t pp, int thread)
+	       {
+		  const size_t ii = order[pp];
+		  results[ii] = nearestNeighbor(queryPoint(ii),
+						contexts[thread], options);
+	       });
+}
+
+template <class T, int Dim>
+void FlatKDTree<T, Dim>::nearestNeighborBatch(
+   const T* queryPoints, int count, Neighbor* results, int threads,
+   const KDTreeQueryOptions& options) const
+{
+   using namespace std;
+
+   // The tree is only read, so queries need no synchronization; each
+   // thread reuses a single context for all of its queries
+   if (threads < 1)
+   {
+      threads = max(1u, thread::hardware_concurrency());
+   }
+   const auto queryPoint = [&](size_t ii)
+      {
+	 return queryPoints + ii*dimension();
+      };
+   const vector<int> order = batchOrder(count, threads, options,
+					queryPoint);
+   if (options.interleave > 1 && _nodeCount != 0)
+   {
+      interleavedBatch(order, threads, queryPoint, NearestResult(),
+		       [&](size_t ii, NearestResult& best)
+		       {
+			  results[ii] = Neighbor{
+			     best.point < 0 ? -1 : _indexData[best.point],
+			     best.sqrDistance};
+			  best = NearestResult();
+		       },
+		       options);
+      return;
+   }
+
+   vector<KDTreeQueryContext> contexts(threads);
+   parallelFor(count, threads,
+	       [&](size_t pp, int thread)
+	       {
+		  const size_t ii = order[pp];
+		  results[ii] = nearestNeighbor(queryPoint(ii),
+						contexts[thread], options);
+	       });
+}
+
+template <class T, int Dim>
+int FlatKDTree<T, Dim>::landingLeaf(const T* queryPoint) const
+{
+   const FlatKDNode<T>* node = &_nodeData[0];
+   while (node->axis != LEAF_AXIS)
+   {
+      node = &_nodeData[queryPoint[node->axis] <= node->split
+			? node->left
+			: node->right];
+   }
+   return node->left;
+}
+
+// A leaf's points are laid out in the order of the leaves from left to
+// right, so sorting queries by the first point of their leaf orders
+// them along the tree, whatever the order of its nodes. Threads are
+// handed runs of consecutive queries, so each still works on a part of
+// the tree of its own.
+template <class T, int Dim>
+template <class QueryPoints>
+std::vector<int> FlatKDTree<T, Dim>::batchOrder(
+   size_t count, int threads, const KDTreeQueryOptions& options,
+   const QueryPoints& queryPoint) const
+{
+   using namespace std;
+
+   vector<int> order(count);
+   iota(order.begin(), order.end(), 0);
+   if (!options.sortBatch || _nodeCount == 0)
+   {
+      return order;
+   }
+
+   vector<int> leaves(count);
+   parallelFor(count, threads,
+	       [&](size_t ii, int)
+	       {
+		  leaves[ii] = landingLeaf(queryPoint(ii));
+	       });
+   stable_sort(order.begin(), order.end(),
+	       [&](int a, int b) { return leaves[a] < leaves[b]; });
+   return order;
+}
+
+template <class T, int Dim>
+void FlatKDTree<T, Dim>::startSearch(SearchCursor& cursor, size_t query,
+				     const T* queryPoint,
+				     const KDTreeQueryOptions& options) const
+{
+   cursor.pendingCount = 0;
+   cursor.undoCount = 0;
+   std::fill_n(cursor.axisOffsets, dimension(), 0.0);
+   cursor.cellDistance = 0;
+   cursor.nodeIdx = 0;
+   cursor.leafFetched = false;
+   cursor.leavesLeft = options.maxLeaves < 1
+      ? std::numeric_limits<int>::max()
+      : options.maxLeaves;
+   cursor.query = query;
+   cursor.queryPoint = queryPoint;
+#ifdef KDTREE_STATS
+   cursor.queryStats.emplace();
+#endif
+   prefetch(&_nodeData[0]);
+}
+
+// This is search() taken a step at a time: each call visits one node,
+// then prefetches the next node (or the points of a leaf, which are
+// scanned by the following call) and returns, so another query can run
+// while the memory arrives.
+template <class T, int Dim>
+template <class ResultSet>
+bool FlatKDTree<T, Dim>::advanceSearch(SearchCursor& cursor,
+				       ResultSet& results,
+				       double pruneScale) const
+{
+   const T* queryPoint = cursor.queryPoint;
+#ifdef KDTREE_STATS
+   KDTreeQueryStatsScope& queryStats = *cursor.queryStats;
+#endif
+
+   const FlatKDNode<T>& node = _nodeData[cursor.nodeIdx];
+   if (node.axis != LEAF_AXIS)
+   {
+      KDTREE_COUNT(nodesVisited, 1);
+      const double hypersphereDist = double(queryPoint[node.axis])
+	 - double(node.split);
+      const bool goLeft = hypersphereDist <= 0;
+
+      const double oldOffset = cursor.axisOffsets[node.axis];
+      const double farDistance = cursor.cellDistance - oldOffset*oldOffset
+	 + hypersphereDist*hypersphereDist;
+      if (farDistance*pruneScale <= results.worstDistance())
+      {
+	 if (cursor.pendingCount == MAX_SEARCH_DEPTH)
+	 {
+	    throw std::length_error("tree is too deep to search");
+	 }
+	 PendingNode& far = cursor.pending[cursor.pendingCount++];
+	 far.nodeIdx = goLeft ? node.right : node.left;
+	 far.axis = node.axis;
+	 far.offset = hypersphereDist;
+	 far.cellDistance = farDistance;
+	 far.undoCount = cursor.undoCount;
+	 KDTREE_COUNT_DEPTH(cursor.pendingCount);
+      }
+
+      cursor.nodeIdx = goLeft ? node.left : node.right;
+      prefetch(&_nodeData[cursor.nodeIdx]);
+      return true;
+   }
+
+   // Fetch the blocks of the leaf's points before scanning them
+   if (!cursor.leafFetched)
+   {
+      const size_t blockSize = size_t(dimension())*_blockWidth;
+      const char* first = reinterpret_cast<const char*>(
+	 _coordData + node.left/_blockWidth*blockSize);
+      const char* end = reinterpret_cast<const char*>(
+	 _coordData + ((node.right - 1)/_blockWidth + 1)*blockSize);
+      for (const char* line=first; line<end; line+=CACHE_LINE_SIZE)
+      {
+	 prefetch(line);
+      }
+      prefetch(end - 1);
+      cursor.leafFetched = true;
+      return true;
+   }
+   cursor.leafFetched = false;
+
+   KDTREE_COUNT(nodesVisited, 1);
+   KDTREE_COUNT(leavesScanned, 1);
+   KDTREE_COUNT(distanceComputations, node.right - node.left);
+   scanLeaf(node, queryPoint, results);
+   if (--cursor.leavesLeft == 0)
+   {
+      return false;
+   }
+
+   // Resume from the most recently deferred child whose cell is still
+   // within range
+   PendingNode next;
+   do
+   {
+      if (cursor.pendingCount == 0)
+      {
+	 return false;
+      }
+      next = cursor.pending[--cursor.pendingCount];
+   } while (next.cellDistance*pruneScale > results.worstDistance());
+   KDTREE_COUNT(backtracks, 1);
+
+   for (; cursor.undoCount > next.undoCount; --cursor.undoCount)
+   {
+      const AxisOffset& undo = cursor.undo[cursor.undoCount - 1];
+      cursor.axisOffsets[undo.axis] = undo.offset;
+   }
+   if (cursor.undoCount == MAX_SEARCH_DEPTH)
+   {
+      throw std::length_error("tree is too deep to search");
+   }
+   cursor.undo[cursor.undoCount].axis = next.axis;
+   cursor.undo[cursor.undoCount].offset = cursor.axisOffsets[next.axis];
+   ++cursor.undoCount;
+   cursor.axisOffsets[next.axis] = next.offset;
+
+   cursor.nodeIdx = next.nodeIdx;
+   cursor.cellDistance = next.cellDistance;
+   prefetch(&_nodeData[cursor.nodeIdx]);
+   return true;
+}
+
+// Each thread takes groups of consecutive queries, and advances a ring
+// of them in turn, starting the next query of its group in the place
+// of each one that finishes
+template <class T, int Dim>
+template <class ResultSet, class QueryPoints, class Finish>
+void FlatKDTree<T, Dim>::interleavedBatch(
+   const std::vector<int>& order, int threads,
+   const QueryPoints& queryPoint, const ResultSet& empty,
+   const Finish& finish, const KDTreeQueryOptions& options) const
+{
+   using namespace std;
+
+   const double pruneScale = (1 + options.epsilon)*(1 + options.epsilon);
+   const size_t groups = (order.size() + INTERLEAVE_GROUP - 1)
+      / INTERLEAVE_GROUP;
+   parallelFor(
+      groups, threads,
+      [&](size_t group, int)
+      {
+	 const size_t first = group*INTERLEAVE_GROUP;
+	 const size_t last = min(order.size(), first + INTERLEAVE_GROUP);
+	 const int width = min<size_t>(options.interleave, last - first);
+
+	 vector<SearchCursor> cursors(width);
+	 vector<ResultSet> results(width, empty);
+	 vector<double> offsets(size_t(width)*dimension());
+	 size_t next = first;
+	 for (int cc=0; cc<width; ++cc)
+	 {
+	    cursors[cc].axisOffsets = &offsets[size_t(cc)*dimension()];
+	    startSearch(cursors[cc], order[next], queryPoint(order[next]),
+			options);
+	    ++next;
+	 }
+
+	 // The cursors still searching are kept at the front
+	 int active = width;
+	 vector<int> slots(width);
+	 iota(slots.begin(), slots.end(), 0);
+	 while (active > 0)
+	 {
+	    for (int ss=0; ss<active; )
+	    {
+	       SearchCursor& cursor = cursors[slots[ss]];
+	       ResultSet& result = results[slots[ss]];
+	       if (advanceSearch(cursor, result, pruneScale))
+	       {
+		  ++ss;
+		  continue;
+	       }
+
+#ifdef KDTREE_STATS
+	       cursor.queryStats.reset();
+#endif
+	       finish(cursor.query, result);
+	       if (next < last)
+	       {
+		  startSearch(cursor, order[next], queryPoint(order[next]),
+			      options);
+		  ++next;
+		  ++ss;
+	       }
+	       else
+	       {
+		  swap(slots[ss], slots[--active]);
+	       }
+	    }
+	 }
+      },
+      1);
+}
+
+template <class T, int Dim>
+void FlatKDTree<T, Dim>::finishNeighbors(KNearestHeap& heap, int k,
+					 Neighbor* results) const
+{
+   std::vector<Neighbor> neighbors = heap.sorted();
+   for (size_t nn=0; nn<neighbors.size(); ++nn)
+   {
+      results[nn].index = _indexData[neighbors[nn].index];
+      results[nn].sqrDistance = neighbors[nn].sqrDistance;
+   }
+   for (int nn=neighbors.size(); nn<k; ++nn)
+   {
+      results[nn].index = -1;
+      results[nn].sqrDistance = std::numeric_limits<double>::max();
+   }
+   heap = KNearestHeap(std::min(k, size()), std::move(neighbors));
+}
+
+template <class T, int Dim>
+Neighbor FlatKDTree<T, Dim>::nearestNeighbor(
+   const T* queryPoint, KDTreeQueryContext& context,
+   const KDTreeQueryOptions& options) const
+{
+   NearestResult best;
+   if (_nodeCount != 0)
+   {
+      search(0, queryPoint, best, options, &context);
+   }
+
+   return Neighbor{best.point < 0 ? -1 : _indexData[best.point],
+		   best.sqrDistance};
+}
+
+template <class T, int Dim>
+const std::vector<Neighbor>& FlatKDTree<T, Dim>::kNearestNeighbors(
+   const T* queryPoint, int k, KDTreeQueryContext& context,
+   const KDTreeQueryOptions& options) const
+{
+   if (_nodeCount == 0 || k < 1)
+   {
+      context._results.clear();
+      return context._results;
+   }
+
+   // The heap and the results trade buffers from one query to the next
+   KNearestHeap heap(std::min(k, size()), std::move(context._heap));
+   search(0, queryPoint, heap, options, &context);
+   context._heap = std::move(context._results);
+   context._results = heap.sorted();
+   for (auto& neighbor : context._results)
+   {
+      neighbor.index = _indexData[neighbor.index];
+   }
+
+   return context._results;
+}
+
+template <class T, int Dim>
+const std::vector<Neighbor>& FlatKDTree<T, Dim>::radiusSearch(
+   const T* queryPoint, double radius, KDTreeQueryContext& context) const
+{
+   context._results.clear();
+   if (_nodeCount == 0 || radius < 0)
+   {
+      return context._results;
+   }
+
+   RadiusResult found(radius*radius, context._results);
+   search(0, queryPoint, found, KDTreeQueryOptions(), &context);
+   for (auto& neighbor : context._results)
+   {
+      neighbor.index = _indexData[neighbor.index];
+   }
+
+   return context._results;
+}
+
+template <class T, int Dim>
+void FlatKDTree<T, Dim>::kNearestNeighborsBatch(
+   const std::vector<Point>& queryPoints, int k,
+   std::vector<Neighbor>& results, int threads,
+   const KDTreeQueryOptions& options) const
+{
+   using namespace std;
+
+   if (k < 1)
+   {
+      results.clear();
+      return;
+   }
+
+   results.resize(queryPoints.size()*k);
+
+   if (threads < 1)
+   {
+      threads = max(1u, thread::hardware_concurrency());
+   }
+   const auto queryPoint = [&](size_t ii)
+      {
+	 assert(int(queryPoints[ii].size()) == dimension());
+	 return queryPoints[ii].data();
+      };
+   const vector<int> order = batchOrder(queryPoints.size(), threads,
+					options, queryPoint);
+   if (options.interleave > 1 && _nodeCount != 0)
+   {
+      interleavedBatch(order, threads, queryPoint,
+		       KNearestHeap(min(k, size())),
+		       [&](size_t ii, KNearestHeap& heap)
+		       {
+			  finishNeighbors(heap, k, &results[ii*k]);
+		       },
+		       options);
+      return;
+   }
+
+   vector<KDTreeQueryContext> contexts(threads);
+   parallelFor(queryPoints.size(), threads,
+	       [&](size_t pp, int thread)
+	       {
+		  const size_t ii = order[pp];
+		  kNearestNeighbors(queryPoint(ii), k, contexts[thread],
+				    &results[ii*k], options);
+	       });
+}
+
+template <class T, int Dim>
+void FlatKDTree<T, Dim>::kNearestNeighborsBatch(
+   const T* queryPoints, int count, int k, Neighbor* results, int threads,
+   const KDTreeQueryOptions& options) const
+{
+   using namespace std;
+
+   if (k < 1)
+   {
+      return;
+   }
+
+   // Each thread reuses a single context for all of its queries
+   if (threads < 1)
+   {
+      threads = max(1u, thread::hardware_concurrency());
+   }
+   const auto queryPoint = [&](size_t ii)
+      {
+	 return queryPoints + ii*dimension();
+      };
+   const vector<int> order = batchOrder(count, threads, options,
+					queryPoint);
+   if (options.interleave > 1 && _nodeCount != 0)
+   {
+      interleavedBatch(order, threads, queryPoint,
+		       KNearestHeap(min(k, size())),
+		       [&](size_t ii, KNearestHeap& heap)
+		       {
+			  finishNeighbors(heap, k, results + ii*k);
+		       },
+		       options);
+      return;
+   }
+
+   vector<KDTreeQueryContext> contexts(threads);
+   parallelFor(count, threads,
+	       [&](size_t pp, int thread)
+	       {
+		  const size_t ii = order[pp];
+		  kNearestNeighbors(queryPoint(ii), k, contexts[thread],
+				    results + ii*k, options);
+	       });
+}
+
+template <class T, int Dim>
+void FlatKDTree<T, Dim>::kNearestNeighbors(
+   const T* queryPoint, int k, KDTreeQueryContext& context,
+   Neighbor* results, const KDTreeQueryOptions& options) const
+{
+   const std::vector<Neighbor>& neighbors =
+      kNearestNeighbors(queryPoint, k, context, options);
+   std::copy(neighbors.begin(), neighbors.end(), results);
+   for (int nn=neighbors.size(); nn<k; ++nn)
+   {
+      results[nn].index = -1;
+      results[nn].sqrDistance = std::numeric_limits<double>::max();
+   }
+}
+
+// Rather than only testing the distance to each splitting plane, this
+// tracks the distance to each node's whole cell, incrementally (Arya
+// and Mount, "Algorithms for fast vector quantization", 1993): the far
+// child's cell differs from its parent's only along the split axis, so
+// its distance is found by replacing that axis' term. A subtree is
+// skipped once its cell lies outside the worst distance hypersphere,
+// which prunes far more often than the plane test in higher dimensions.
+//
+// The traversal is iterative: it descends to the leaf on the query
+// point's side of each splitting plane, deferring the far children on
+// an explicit stack, and then resumes from the most recently deferred
+// child whose cell is still within range. The per-axis offsets of the
+// current cell are kept in a single array, with the changes made on
+// the way to each deferred child logged so they can be undone.
+template <class T, int Dim>
+template <class ResultSet>
+void FlatKDTree<T, Dim>::search(int nodeIdx, const T* queryPoint,
+				ResultSet& results,
+				const KDTreeQueryOptions& options,
+				KDTreeQueryContext* context) const
+{
+   PendingNode pending[MAX_SEARCH_DEPTH];
+   int pendingCount = 0;
+   AxisOffset undo[MAX_SEARCH_DEPTH];
+   int undoCount = 0;
+
+   // The query point starts out inside the root's (unbounded) cell.
+   // Offsets of a fixed dimension live on the stack; otherwise they
+   // live in the context's buffer, if there is one.
+   typename PointStorage<double, Dim>::type localOffsets;
+   double* axisOffsets;
+   if (Dim != DYNAMIC_DIMENSION || context == nullptr)
+   {
+      localOffsets = PointStorage<double, Dim>::create(dimension());
+      axisOffsets = localOffsets.data();
+   }
+   else
+   {
+      context->_axisOffsets.assign(dimension(), 0);
+      axisOffsets = context->_axisOffsets.data();
+   }
+   double cellDistance = 0;
+
+   // An approximate search skips cells which couldn't hold a point
+   // (1 + epsilon) times closer than the worst result, and stops once
+   // it has scanned its budget of leaves
+   const double pruneScale = (1 + options.epsilon)*(1 + options.epsilon);
+   int leavesLeft = options.maxLeaves < 1
+      ? std::numeric_limits<int>::max()
+      : options.maxLeaves;
+
+   KDTREE_STATS_SCOPE();
+   for (;;)
+   {
+      // Descend to the leaf on the query point's side of each splitting
+      // plane, whose cells are as far away as this one, deferring the
+      // children whose cells are within the radius of the worst
+      // distance hypersphere
+      const FlatKDNode<T>* node = &_nodeData[nodeIdx];
+      while (node->axis != LEAF_AXIS)
+      {
+	 KDTREE_COUNT(nodesVisited, 1);
+	 const double hypersphereDist = double(queryPoint[node->axis])
+	    - double(node->split);
+	 const bool goLeft = hypersphereDist <= 0;
+
+	 const double oldOffset = axisOffsets[node->axis];
+	 const double farDistance = cellDistance - oldOffset*oldOffset
+	    + hypersphereDist*hypersphereDist;
+	 if (farDistance*pruneScale <= results.worstDistance())
+	 {
+	    if (pendingCount == MAX_SEARCH_DEPTH)
+	    {
+	       throw std::length_error("tree is too deep to search");
+	    }
+	    PendingNode& far = pending[pendingCount++];
+	    far.nodeIdx = goLeft ? node->right : node->left;
+	    far.axis = node->axis;
+	    far.offset = hypersphereDist;
+	    far.cellDistance = farDistance;
+	    far.undoCount = undoCount;
+	    KDTREE_COUNT_DEPTH(pendingCount);
+	 }
+
+	 node = &_nodeData[goLeft ? node->left : node->right];
+      }
+      KDTREE_COUNT(nodesVisited, 1);
+      KDTREE_COUNT(leavesScanned, 1);
+      KDTREE_COUNT(distanceComputations, node->right - node->left);
+      scanLeaf(*node, queryPoint, results);
+      if (--leavesLeft == 0)
+      {
+	 return;
+      }
+
+      // Resume from the most recently deferred child whose cell is still
+      // within range, once the worst distance may have shrunk
+      PendingNode next;
+      do
+      {
+	 if (pendingCount == 0)
+	 {
+	    return;
+	 }
+	 next = pending[--pendingCount];
+      } while (next.cellDistance*pruneScale > results.worstDistance());
+      KDTREE_COUNT(backtracks, 1);
+
+      // Restore the offsets of its parent's cell, and then move across
+      // the splitting plane
+      for (; undoCount > next.undoCount; --undoCount)
+      {
+	 axisOffsets[undo[undoCount - 1].axis] = undo[undoCount - 1].offset;
+      }
+      if (undoCount == MAX_SEARCH_DEPTH)
+      {
+	 throw std::length_error("tree is too deep to search");
+      }
+      undo[undoCount].axis = next.axis;
+      undo[undoCount].offset = axisOffsets[next.axis];
+      ++undoCount;
+      axisOffsets[next.axis] = next.offset;
+
+      nodeIdx = next.nodeIdx;
+      cellDistance = next.cellDistance;
+   }
+}
+
+template <class T, int Dim>
+template <class ResultSet>
+void FlatKDTree<T, Dim>::scanLeaf(const FlatKDNode<T>& leaf,
+				  const T* queryPoint,
+				  ResultSet& results) const
+{
+   if (_blockWidth == 1)
+   {
+      for (int pp=leaf.left; pp<leaf.right; ++pp)
+      {
+	 results.insert(pp, squaredDistance<Dim>(&coordinate(pp, 0),
+						 queryPoint, dimension()));
+      }
+      return;
+   }
+
+   // Compute the distances to a whole block at a time. Leaves start on
+   // a block boundary, but the last block of a leaf may be partial.
+   double distances[BLOCK_WIDTH];
+   for (int first=leaf.left; first<leaf.right; first+=BLOCK_WIDTH)
+   {
+      BlockSquaredDistances<T, Dim>::eval(&coordinate(first, 0), queryPoint,
+					  dimension(), distances);
+
+      const int count = std::min(BLOCK_WIDTH, leaf.right - first);
+      for (int ll=0; ll<count; ++ll)
+      {
+	 results.insert(first + ll, distances[ll]);
+      }
+   }
+}
+
+// Serialization
+template <class T, int Dim>
+std::ostream& operator<< (std::ostream &out, const FlatKDTree<T, Dim>& tree)
+{
+   using namespace std;
+
+   const uint64_t coordCount = (uint64_t(tree._size) + tree._blockWidth - 1)
+      / tree._blockWidth*tree._blockWidth*tree.dimension();
+   const FlatKDTreeHeader header = flatKDTreeHeader<T>(
+      tree.dimension(), tree._size, tree._nodeCount, tree._blockWidth);
+
+   // Write each array, preceded by padding up to its offset
+   const char zeros[FLAT_KDTREE_ALIGNMENT] = {};
+   uint64_t written = 0;
+   auto write = [&](const void* data, uint64_t offset, uint64_t bytes)
+   {
+      out.write(zeros, offset - written);
+      out.write(static_cast<const char*>(data), bytes);
+      written = offset + bytes;
+   };
+
+   write(&header, 0, sizeof(header));
+   write(tree._nodeData, header.nodesOffset,
+	 tree._nodeCount*sizeof(FlatKDNode<T>));
+   write(tree._coordData, header.coordsOffset, coordCount*sizeof(T));
+   write(tree._indexData, header.indicesOffset,
+	 tree._size*sizeof(int32_t));
+
+   return out;
+}
+
+// Deserialization
+template <class T, int Dim>
+std::istream& operator>> (std::istream &in, FlatKDTree<T, Dim>& tree)
+{
+   using namespace std;
+
+   tree.clear();
+
+   FlatKDTreeHeader header;
+   if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)))
+   {
+      return in;
+   }
+
+   // Refuse files which weren't written for this type of tree
+   if (flatKDTreeFileSize<T, Dim>(header) == 0)
+   {
+      in.setstate(ios::failbit);
+      return in;
+   }
+
+   const size_t blocks =
+      (size_t(header.size) + header.blockWidth - 1)/header.blockWidth;
+   tree._dimension = header.dimension;
+   tree._size = header.size;
+   tree._blockWidth = header.blockWidth;
+   tree._nodes.resize(header.nodeCount);
+   tree._coords.resize(blocks*header.blockWidth*header.dimension);
+   tree._indices.resize(header.size);
+
+   // Read each array, skipping the padding before it
+   uint64_t position = sizeof(header);
+   auto read = [&](void* data, uint64_t offset, uint64_t bytes)
+   {
+      in.ignore(offset - position);
+      in.read(static_cast<char*>(data), bytes);
+      position = offset + bytes;
+   };
+
+   read(tree._nodes.data(), header.nodesOffset,
+	tree._nodes.size()*sizeof(FlatKDNode<T>));
+   read(tree._coords.data(), header.coordsOffset,
+	tree._coords.size()*sizeof(T));
+   read(tree._indices.data(), header.indicesOffset,
+	tree._indices.size()*sizeof(int32_t));
+
+   // Refuse nodes which would lead queries out of the arrays
+   if (in)
+   {
+      tree.bindStorage();
+      if (!tree.validNodes())
+      {
+	 in.setstate(ios::failbit);
+      }
+   }
+   if (!in)
+   {
+      tree.clear();
+   }
+
+   return in;
+}
+
+template <class T, int Dim>
+bool FlatKDTree<T, Dim>::mapFile(const std::string& filename)
+{
+   using namespace std;
+
+   clear();
+
+#if defined(__unix__) || defined(__APPLE__)
+   const int fd = open(filename.c_str(), O_RDONLY);
+   if (fd < 0)
+   {
+      cerr << "Unable to open " << filename << ": " << strerror(errno)
+	   << endl;
+      return false;
+   }
+
+   struct stat status;
+   if (fstat(fd, &status) != 0
+       || status.st_size < off_t(sizeof(FlatKDTreeHeader)))
+   {
+      cerr << filename << " is not a FlatKDTree file" << endl;
+      close(fd);
+      return false;
+   }
+
+   // The mapping outlives the descriptor
+   const size_t length = status.st_size;
+   void* address = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (address == MAP_FAILED)
+   {
+      cerr << "Unable to map " << filename << ": " << strerror(errno)
+	   << endl;
+      return false;
+   }
+   shared_ptr<const void> mapping(address, [length](const void* data)
+				  {
+				     munmap(const_cast<void*>(data), length);
+				  });
+
+   // Refuse files which weren't written for this type of tree, or were
+   // cut short
+   const char* base = static_cast<const char*>(address);
+   const FlatKDTreeHeader& header =
+      *reinterpret_cast<const FlatKDTreeHeader*>(base);
+   const uint64_t fileSize = flatKDTreeFileSize<T, Dim>(header);
+   if (fileSize == 0 || fileSize > length)
+   {
+      cerr << filename << " is not a compatible FlatKDTree file" << endl;
+      return false;
+   }
+
+   _dimension = header.dimension;
+   _size = header.size;
+   _blockWidth = header.blockWidth;
+   _nodeCount = header.nodeCount;
+   _nodeData =
+      reinterpret_cast<const FlatKDNode<T>*>(base + header.nodesOffset);
+   _coordData = reinterpret_cast<const T*>(base + header.coordsOffset);
+   _indexData = reinterpret_cast<const int*>(base + header.indicesOffset);
+   if (!validNodes())
+   {
+      cerr << filename << " holds a corrupt FlatKDTree" << endl;
+      clear();
+      return false;
+   }
+   _mapping = mapping;
+   return true;
+#else
+   cerr << "Unable to map " << filename
+	<< ": memory mapping isn't supported on this platform" << endl;
+   return false;
+#endif
+}
+
+// The number of points streamed through memory at once while a subtree
+// is split on disk
+#define EXTERNAL_BUILD_BATCH 65536
+
+template <class T, int Dim>
+struct FlatKDTree<T, Dim>::ExternalBuild
+{
+   // A subtree waiting to be built in memory
+   struct Subtree
+   {
+      std::unique_ptr<KDTreeScratchFile<T>> points;
+      int                                   parentAxis;
+      int                                   nodeIdx;
+      int                                   slot;
+   };
+
+   KDTreeBuildOptions         options;
+   KDTreeExternalBuildOptions externalOptions;
+   int                        threads;
+   size_t                     subtreePoints;  // the most built in memory
+					       // by each thread
+   std::string                scratchPrefix;
+   int                        scratchFiles;   // created so far
+   std::map<int, int64_t>     nodeCounts;
+   std::vector<Subtree>       queue;
+   FlatKDTreeHeader           header;
+   std::ofstream              out;
+   std::mutex                 outMutex;
+
+   // Returns a new, empty scratch file
+   std::unique_ptr<KDTreeScratchFile<T>> scratchFile(int dimension)
+   {
+      const int serial = scratchFiles++;
+      return std::unique_ptr<KDTreeScratchFile<T>>(
+	 new KDTreeScratchFile<T>(
+	    scratchPrefix + ".scratch" + std::to_string(serial), dimension,
+	    std::max<size_t>(1, std::min(externalOptions.sampleSize,
+					 externalOptions.memoryPoints/16)),
+	    serial));
+   }
+
+   // Moves the points of 'source' to the end of 'target', which takes
+   // over the file itself if it doesn't have one yet
+   void moveInto(std::unique_ptr<KDTreeScratchFile<T>>& target,
+		 std::unique_ptr<KDTreeScratchFile<T>> source)
+   {
+      if (!target)
+      {
+	 target = std::move(source);
+	 return;
+      }
+
+      const int dimension = header.dimension;
+      std::vector<T> rows;
+      std::vector<int> indices;
+      source->rewind();
+      while (source->read(rows, indices, EXTERNAL_BUILD_BATCH) > 0)
+      {
+	 for (size_t ii=0; ii<indices.size(); ++ii)
+	 {
+	    target->append(&rows[ii*dimension], indices[ii]);
+	 }
+	 rows.clear();
+	 indices.clear();
+      }
+   }
+
+   // Writes 'bytes' bytes at 'offset' into the tree file
+   void write(const void* data, uint64_t offset, uint64_t bytes)
+   {
+      std::lock_guard<std::mutex> lock(outMutex);
+      out.seekp(offset);
+      out.write(static_cast<const char*>(data), bytes);
+      if (!out)
+      {
+	 throw std::runtime_error("unable to write the tree file");
+      }
+   }
+};
+
+template <class T, int Dim>
+template <class Source>
+bool FlatKDTree<T, Dim>::buildFile(
+   Source& source, int dimension, const std::string& filename,
+   const KDTreeBuildOptions& options,
+   const KDTreeExternalBuildOptions& externalOptions)
+{
+   using namespace std;
+
+   bool success = false;
+   bool created = false;
+   try
+   {
+      if (options.leafSize < 1)
+      {
+	 throw invalid_argument("leaves must hold at least one point");
+      }
+      if (dimension < 1
+	  || (Dim != DYNAMIC_DIMENSION && dimension != Dim))
+      {
+	 throw invalid_argument("points are not of the tree's dimension");
+      }
+      if (externalOptions.memoryPoints < 1 || externalOptions.sampleSize < 1)
+      {
+	 throw invalid_argument("the memory and sample sizes must be "
+				"at least one point");
+      }
+      if (options.nodeLayout != LAYOUT_DEPTH_FIRST)
+      {
+	 throw invalid_argument("trees built on disk are laid out "
+				"depth-first");
+      }
+
+      // Only the layout parameters of this tree are used, to split
+      // nodes as build() would
+      FlatKDTree layout;
+      layout._dimension = dimension;
+      layout._blockWidth = options.leafSize < BLOCK_WIDTH ? 1 : BLOCK_WIDTH;
+
+      ExternalBuild state;
+      state.options = options;
+      state.externalOptions = externalOptions;
+      state.scratchPrefix = externalOptions.scratchPrefix.empty()
+	 ? filename
+	 : externalOptions.scratchPrefix;
+      state.scratchFiles = 0;
+
+      // Subtrees which fit in memory are built side by side, each taking
+      // its share of the memory. Building one holds two copies of its
+      // points: those read from its file and the subtree's own.
+      state.threads = options.threads < 1
+	 ? max(1u, thread::hardware_concurrency())
+	 : options.threads;
+      state.subtreePoints =
+	 max<size_t>(1, externalOptions.memoryPoints/(2*state.threads));
+
+      // Copy the points into a scratch file, numbering them as they come
+      unique_ptr<KDTreeScratchFile<T>> points = state.scratchFile(dimension);
+      vector<T> rows(size_t(EXTERNAL_BUILD_BATCH)*dimension);
+      size_t count;
+      while ((count = source(rows.data(), size_t(EXTERNAL_BUILD_BATCH))) > 0)
+      {
+	 if (points->size() + count > size_t(numeric_limits<int>::max()))
+	 {
+	    throw length_error("too many points for a FlatKDTree");
+	 }
+	 for (size_t ii=0; ii<count; ++ii)
+	 {
+	    points->append(&rows[ii*dimension], points->size());
+	 }
+      }
+      vector<T>().swap(rows);
+      if (points->size() == 0)
+      {
+	 throw invalid_argument("no points to build from");
+      }
+
+      // The shape of the tree only depends on its number of points, so
+      // each subtree's place in the file is known before it is built
+      const int64_t nodeCount =
+	 layout.subtreeNodeCount(points->size(), options.leafSize,
+				 state.nodeCounts);
+      if (nodeCount > numeric_limits<int>::max())
+      {
+	 throw length_error("too many nodes for a FlatKDTree");
+      }
+      state.header = flatKDTreeHeader<T>(dimension, points->size(),
+					 nodeCount, layout._blockWidth);
+
+      state.out.open(filename, ofstream::binary | ofstream::trunc);
+      created = true;
+      if (!state.out)
+      {
+	 throw runtime_error("unable to create " + filename);
+      }
+      state.write(&state.header, 0, sizeof(state.header));
+      layout.buildExternalSubtree(state, std::move(points), -1, 0, 0);
+      layout.buildQueuedSubtrees(state);
+
+      state.out.close();
+      if (!state.out)
+      {
+	 throw runtime_error("unable to write " + filename);
+      }
+      success = true;
+   }
+   catch (exception& e)
+   {
+      cerr << "Exception during construction: " << e.what() << endl;
+      if (created)
+      {
+	 remove(filename.c_str());
+      }
+   }
+
+   return success;
+}
+
+template <class T, int Dim>
+int64_t FlatKDTree<T, Dim>::subtreeNodeCount(
+   int count, int leafSize, std::map<int, int64_t>& counts) const
+{
+   if (count <= leafSize)
+   {
+      return 1;
+   }
+   const auto found = counts.find(count);
+   if (found != counts.end())
+   {
+      return found->second;
+   }
+
+   const int left = splitPosition(0, count);
+   const int64_t nodes = 1 + subtreeNodeCount(left, leafSize, counts)
+      + subtreeNodeCount(count - left, leafSize, counts);
+   counts[count] = nodes;
+   return nodes;
+}
+
+template <class T, int Dim>
+void FlatKDTree<T, Dim>::buildExternalSubtree(
+   ExternalBuild& state, std::unique_ptr<KDTreeScratchFile<T>> points,
+   int parentAxis, int nodeIdx, int slot) const
+{
+   using namespace std;
+   typedef unique_ptr<KDTreeScratchFile<T>> ScratchFile;
+
+   const int dimension = this->dimension();
+   const int count = points->size();
+   const KDTreeBuildOptions& options = state.options;
+
+   // Queue subtrees which fit in memory to be built there, a few side
+   // by side
+   if (size_t(count) <= state.subtreePoints || count <= options.leafSize)
+   {
+      points->discardSample();
+      state.queue.push_back(typename ExternalBuild::Subtree{
+	    std::move(points), parentAxis, nodeIdx, slot});
+      if (int(state.queue.size()) >= state.threads)
+      {
+	 buildQueuedSubtrees(state);
+      }
+      return;
+   }
+
+   // Choose the separating axis from the sample
+   const int axis = [&]()
+   {
+      const vector<T>& sample = points->sample();
+      vector<int> sampleOrder(sample.size()/dimension);
+      iota(sampleOrder.begin(), sampleOrder.end(), 0);
+      return splitAxis(sample.data(), sampleOrder, 0, sampleOrder.size(),
+		       parentAxis, options.splitRule, options.threads);
+   }();
+
+   // The split is at the same rank as build()'s, and is selected among
+   // the candidate points, which are at first all of them. Each pass
+   // brackets the split's rank among the candidates with values of
+   // their sample, and streams them into a file each for the points
+   // below, within and above the bracket. The file holding the split
+   // becomes the candidates of the next pass, and the others join the
+   // child they belong to, until the candidates are few enough to
+   // partition in memory. The bracket spans at most about a quarter of
+   // the memory's worth of points, and shrinks to a single value if a
+   // pass leaves every candidate within it, so that points tied with
+   // the split are handed out among the children by count instead.
+   const size_t memoryPoints = max<size_t>(
+      1, state.externalOptions.memoryPoints/2);
+   const int median = splitPosition(0, count);
+   ScratchFile left;
+   ScratchFile right;
+   ScratchFile candidates = std::move(points);
+   int needed = median;      // the split's rank among the candidates
+   bool narrow = false;
+   FlatKDNode<T> node = FlatKDNode<T>();
+   while (true)
+   {
+      const int candidateCount = candidates->size();
+      if (size_t(candidateCount) <= memoryPoints)
+      {
+	 vector<T> rows;
+	 vector<int> indices;
+	 candidates->rewind();
+	 candidates->read(rows, indices, candidateCount);
+	 candidates.reset();
+
+	 vector<int> order(candidateCount);
+	 iota(order.begin(), order.end(), 0);
+	 nth_element(order.begin(), order.begin() + needed, order.end(),
+		     CoordinateCompare<T>(rows.data(), dimension, axis));
+	 ScratchFile below = state.scratchFile(dimension);
+	 ScratchFile above = state.scratchFile(dimension);
+	 for (int ii=0; ii<candidateCount; ++ii)
+	 {
+	    (ii < needed ? below : above)->append(
+	       &rows[size_t(order[ii])*dimension], indices[order[ii]]);
+	 }
+	 node.split = rows[size_t(order[needed])*dimension + axis];
+	 state.moveInto(left, std::move(below));
+	 state.moveInto(right, std::move(above));
+	 break;
+      }
+
+      vector<T> values(candidates->sample().size()/dimension);
+      for (size_t ii=0; ii<values.size(); ++ii)
+      {
+	 values[ii] = candidates->sample()[ii*dimension + axis];
+      }
+      sort(values.begin(), values.end());
+      const double sampleCount = values.size();
+      const double rank = double(needed)/candidateCount*(sampleCount - 1);
+      const double margin = narrow ? 0 : min(
+	 4*sqrt(sampleCount),
+	 memoryPoints/2.0/candidateCount*sampleCount);
+      const T low = values[size_t(max(0.0, floor(rank - margin)))];
+      const T high = values[size_t(min(sampleCount - 1,
+				       ceil(rank + margin)))];
+
+      ScratchFile below = state.scratchFile(dimension);
+      ScratchFile within = state.scratchFile(dimension);
+      ScratchFile above = state.scratchFile(dimension);
+      candidates->rewind();
+      vector<T> rows;
+      vector<int> indices;
+      while (candidates->read(rows, indices, EXTERNAL_BUILD_BATCH) > 0)
+      {
+	 for (size_t ii=0; ii<indices.size(); ++ii)
+	 {
+	    const T* row = &rows[ii*dimension];
+	    KDTreeScratchFile<T>& bucket = row[axis] < low
+	       ? *below
+	       : (row[axis] > high ? *above : *within);
+	    bucket.append(row, indices[ii]);
+	 }
+	 rows.clear();
+	 indices.clear();
+      }
+      candidates.reset();
+
+      const int belowCount = below->size();
+      const int withinCount = within->size();
+      if (needed < belowCount)
+      {
+	 state.moveInto(right, std::move(within));
+	 state.moveInto(right, std::move(above));
+	 candidates = std::move(below);
+      }
+      else if (needed >= belowCount + withinCount)
+      {
+	 state.moveInto(left, std::move(below));
+	 state.moveInto(left, std::move(within));
+	 candidates = std::move(above);
+	 needed -= belowCount + withinCount;
+      }
+      else if (low == high)
+      {
+	 // Every point within the bracket is tied with the split
+	 state.moveInto(left, std::move(below));
+	 state.moveInto(right, std::move(above));
+	 needed -= belowCount;
+	 ScratchFile tiedBelow = state.scratchFile(dimension);
+	 ScratchFile tiedAbove = state.scratchFile(dimension);
+	 within->rewind();
+	 int tied = 0;
+	 while (within->read(rows, indices, EXTERNAL_BUILD_BATCH) > 0)
+	 {
+	    for (size_t ii=0; ii<indices.size(); ++ii, ++tied)
+	    {
+	       (tied < needed ? tiedBelow : tiedAbove)->append(
+		  &rows[ii*dimension], indices[ii]);
+	    }
+	    rows.clear();
+	    indices.clear();
+	 }
+	 within.reset();
+	 node.split = low;
+	 state.moveInto(left, std::move(tiedBelow));
+	 state.moveInto(right, std::move(tiedAbove));
+	 break;
+      }
+      else
+      {
+	 state.moveInto(left, std::move(below));
+	 state.moveInto(right, std::move(above));
+	 candidates = std::move(within);
+	 needed -= belowCount;
+      }
+      narrow = int(candidates->size()) == candidateCount;
+   }
+   assert(int(left->size()) == median);
+
+   node.axis = axis;
+   node.left = nodeIdx + 1;
+   node.right = node.left
+      + subtreeNodeCount(median, options.leafSize, state.nodeCounts);
+   state.write(&node,
+	       state.header.nodesOffset
+	       + uint64_t(nodeIdx)*sizeof(FlatKDNode<T>),
+	       sizeof(node));
+
+   // The right child's sample waits on disk while the left child is
+   // built, so the samples of the pending subtrees don't pile up in
+   // memory
+   right->parkSample();
+   buildExternalSubtree(state, std::move(left), axis, node.left, slot);
+   buildExternalSubtree(state, std::move(right), axis, node.right,
+			slot + median);
+}
+
+// Each queued subtree is read and built by a thread of its own, with an
+// equal share of the rest, and its nodes, points and indices written
+// into place, moving its child indices and points along with it
+template <class T, int Dim>
+void FlatKDTree<T, Dim>::buildQueuedSubtrees(ExternalBuild& state) const
+{
+   using namespace std;
+
+   if (state.queue.empty())
+   {
+      return;
+   }
+
+   const int dimension = this->dimension();
+   const FlatKDTreeHeader& header = state.header;
+   KDTreeBuildOptions options = state.options;
+   options.threads = max<size_t>(1, state.threads/state.queue.size());
+
+   parallelFor(state.queue.size(), state.threads,
+	       [&](size_t ss, int /*thread*/)
+	       {
+		  typename ExternalBuild::Subtree& queued = state.queue[ss];
+		  const int count = queued.points->size();
+		  vector<T> rows;
+		  vector<int> indices;
+		  rows.reserve(size_t(count)*dimension);
+		  indices.reserve(count);
+		  queued.points->read(rows, indices, count);
+		  queued.points.reset();
+
+		  FlatKDTree subtree;
+		  if (!subtree.buildBelow(rows.data(), count, dimension,
+					  queued.parentAxis, options))
+		  {
+		     throw runtime_error("unable to build a subtree");
+		  }
+		  vector<T>().swap(rows);
+
+		  for (FlatKDNode<T>& node : subtree._nodes)
+		  {
+		     const int offset = node.axis == LEAF_AXIS
+			? queued.slot
+			: queued.nodeIdx;
+		     node.left += offset;
+		     node.right += offset;
+		  }
+		  for (int& index : subtree._indices)
+		  {
+		     index = indices[index];
+		  }
+		  state.write(subtree._nodes.data(),
+			      header.nodesOffset
+			      + uint64_t(queued.nodeIdx)
+			      *sizeof(FlatKDNode<T>),
+			      subtree._nodes.size()*sizeof(FlatKDNode<T>));
+		  state.write(subtree._coords.data(),
+			      header.coordsOffset
+			      + uint64_t(queued.slot)*dimension*sizeof(T),
+			      subtree._coords.size()*sizeof(T));
+		  state.write(subtree._indices.data(),
+			      header.indicesOffset
+			      + uint64_t(queued.slot)*sizeof(int32_t),
+			      subtree._indices.size()*sizeof(int32_t));
+	       },
+	       1);
+   state.queue.clear();
+}
+
+//
+// DynamicKDTree member function implementations
+//
+
+template <class T, int Dim>
+DynamicKDTree<T, Dim>::DynamicKDTree(int dimension,
+				     const KDTreeBuildOptions& options)
+   : _dimension(dimension), _options(options), _size(0), _erased(0)
+{
+   if (dimension < 1)
+   {
+      throw std::invalid_argument("points must have at least one axis");
+   }
+   if (Dim != DYNAMIC_DIMENSION && dimension != Dim)
+   {
+      throw std::invalid_argument("points are not of the tree's dimension");
+   }
+   if (options.leafSize < 1)
+   {
+      throw std::invalid_argument("leaves must hold at least one point");
+   }
+}
+
+template <class T, int Dim>
+bool DynamicKDTree<T, Dim>::build(const T* points, int count)
+{
+   _levels.clear();
+   _buffer.clear();
+   _bufferIds.clear();
+   _live.assign(count, 1);
+   _size = count;
+   _erased = 0;
+
+   std::vector<int> ids(count);
+   std::iota(ids.begin(), ids.end(), 0);
+
+   // Start out with a single tree, at the level it would have reached
+   // through insertions
+   int levelIdx = 0;
+   while ((size_t(DYNAMIC_KDTREE_BUFFER) << levelIdx) < size_t(count))
+   {
+      ++levelIdx;
+   }
+   if (!buildLevel(levelIdx, points, ids))
+   {
+      _levels.clear();
+      _live.clear();
+      _size = 0;
+      return false;
+   }
+   return true;
+}
+
+template <class T, int Dim>
+int DynamicKDTree<T, Dim>::insert(const Point& point)
+{
+   assert(int(point.size()) == dimension());
+   return insert(point.data());
+}
+
+template <class T, int Dim>
+int DynamicKDTree<T, Dim>::insert(const T* point)
+{
+   const int id = _live.size();
+   _live.push_back(1);
+   ++_size;
+   _buffer.insert(_buffer.end(), point, point + dimension());
+   _bufferIds.push_back(id);
+   if (_bufferIds.size() < DYNAMIC_KDTREE_BUFFER)
+   {
+      return id;
+   }
+
+   // Merge the buffer and the trees below the first empty level into
+   // that level; they hold at most as many points as it can
+   int levelIdx = 0;
+   while (levelIdx < int(_levels.size())
+	  && !_levels[levelIdx].ids.empty())
+   {
+      ++levelIdx;
+   }
+   std::vector<T> rows;
+   std::vector<int> ids;
+   rows.swap(_buffer);
+   ids.swap(_bufferIds);
+   const size_t pointIdx = ids.size() - 1;
+   for (int ll=0; ll<levelIdx; ++ll)
+   {
+      drain(_levels[ll], rows, ids);
+   }
+   if (!buildLevel(levelIdx, rows.data(), ids))
+   {
+      // Keep the drained points in the buffer, which is searched point
+      // by point, and take the new one back out
+      rows.erase(rows.begin() + pointIdx*dimension(),
+		 rows.begin() + (pointIdx + 1)*dimension());
+      ids.erase(ids.begin() + pointIdx);
+      _buffer.swap(rows);
+      _bufferIds.swap(ids);
+      _live.pop_back();
+      --_size;
+      return -1;
+   }
+   return id;
+}
+
+template <class T, int Dim>
+bool DynamicKDTree<T, Dim>::erase(int id)
+{
+   if (id < 0 || id >= int(_live.size()) || !_live[id])
+   {
+      return false;
+   }
+   _live[id] = 0;
+   --_size;
+
+   // A buffered point is simply dropped...
+   for (size_t bb=0; bb<_bufferIds.size(); ++bb)
+   {
+      if (_bufferIds[bb] == id)
+      {
+	 const size_t last = _bufferIds.size() - 1;
+	 std::copy(&_buffer[last*dimension()],
+		   &_buffer[last*dimension()] + dimension(),
+		   &_buffer[bb*dimension()]);
+	 _bufferIds[bb] = _bufferIds[last];
+	 _buffer.resize(last*dimension());
+	 _bufferIds.pop_back();
+	 return true;
+      }
+   }
+
+   // ...while one in a tree stays there until the tree is rebuilt. The
+   // point is erased even if the rebuild fails, leaving the rest of the
+   // points buffered.
+   ++_erased;
+   if (_erased > _size - int(_bufferIds.size()))
+   {
+      rebuild();
+   }
+   return true;
+}
+
+template <class T, int Dim>
+int DynamicKDTree<T, Dim>::treeCount() const
+{
+   int count = 0;
+   for (const Level& level : _levels)
+   {
+      count += !level.ids.empty();
+   }
+   return count;
+}
+
+template <class T, int Dim>
+void DynamicKDTree<T, Dim>::drain(Level& level, std::vector<T>& rows,
+				  std::vector<int>& ids)
+{
+   const FlatKDTree<T, Dim>& tree = level.tree;
+   for (int pp=0; pp<tree.size(); ++pp)
+   {
+      const int id = level.ids[tree._indexData[pp]];
+      if (!_live[id])
+      {
+	 --_erased;
+	 continue;
+      }
+      for (int aa=0; aa<dimension(); ++aa)
+      {
+	 rows.push_back(tree.coordinate(pp, aa));
+      }
+      ids.push_back(id);
+   }
+
+   level.tree = FlatKDTree<T, Dim>();
+   level.ids.clear();
+}
+
+template <class T, int Dim>
+bool DynamicKDTree<T, Dim>::buildLevel(int levelIdx, const T* rows,
+				       std::vector<int>& ids)
+{
+   if (levelIdx >= int(_levels.size()))
+   {
+      _levels.resize(levelIdx + 1);
+   }
+   Level& level = _levels[levelIdx];
+   if (!ids.empty()
+       && !level.tree.build(rows, ids.size(), dimension(), _options))
+   {
+      return false;
+   }
+   level.ids.swap(ids);
+   return true;
+}
+
+template <class T, int Dim>
+bool DynamicKDTree<T, Dim>::rebuild()
+{
+   std::vector<T> rows;
+   std::vector<int> ids;
+   rows.reserve(size_t(_size)*dimension());
+   ids.reserve(_size);
+   for (Level& level : _levels)
+   {
+      drain(level, rows, ids);
+   }
+   rows.insert(rows.end(), _buffer.begin(), _buffer.end());
+   ids.insert(ids.end(), _bufferIds.begin(), _bufferIds.end());
+   _buffer.clear();
+   _bufferIds.clear();
+
+   int levelIdx = 0;
+   while ((size_t(DYNAMIC_KDTREE_BUFFER) << levelIdx) < ids.size())
+   {
+      ++levelIdx;
+   }
+   _levels.clear();
+   if (!buildLevel(levelIdx, rows.data(), ids))
+   {
+      _levels.clear();
+      _buffer.swap(rows);
+      _bufferIds.swap(ids);
+      return false;
+   }
+   return true;
+}
+
+// The largest trees are searched first, as they most likely hold the
+// nearest points, which then prune the searches of the others
+template <class T, int Dim>
+template <class ResultSet>
+void DynamicKDTree<T, Dim>::search(const T* queryPoint, ResultSet& results,
+				   const KDTreeQueryOptions& options) const
+{
+   for (int ll=int(_levels.size()) - 1; ll>=0; --ll)
+   {
+      const Level& level = _levels[ll];
+      if (level.ids.empty())
+      {
+	 continue;
+      }
+      LiveResult<ResultSet> live(results, level.tree._indexData,
+				 level.ids.data(), _live.data());
+      level.tree.search(0, queryPoint, live, options);
+   }
 
+   for (size_t bb=0; bb<_bufferIds.size(); ++bb)
+   {
+      results.insert(_bufferIds[bb],
+		     squaredDistance<Dim>(queryPoint,
+					  &_buffer[bb*dimension()],
+					  dimension()));
+   }
+}
 
-//////////////////
-// Implementations
+template <class T, int Dim>
+Neighbor DynamicKDTree<T, Dim>::nearestNeighbor(
+   const Point& queryPoint, const KDTreeQueryOptions& options) const
+{
+   assert(int(queryPoint.size()) == dimension());
+   return nearestNeighbor(queryPoint.data(), options);
+}
 
-// Helper functions
+template <class T, int Dim>
+Neighbor DynamicKDTree<T, Dim>::nearestNeighbor(
+   const T* queryPoint, const KDTreeQueryOptions& options) const
+{
+   NearestResult best;
+   search(queryPoint, best, options);
+   return Neighbor{best.point, best.sqrDistance};
+}
 
-// Compares two vectors based on their in_axis'th element; used for sorting
-template <class T>
-class IndexedPointCompare
+template <class T, int Dim>
+std::vector<Neighbor> DynamicKDTree<T, Dim>::kNearestNeighbors(
+   const Point& queryPoint, int k, const KDTreeQueryOptions& options) const
 {
-  public:
-  IndexedPointCompare(int in_axis)
-     : _axis{in_axis}
-   {}
+   assert(int(queryPoint.size()) == dimension());
+   return kNearestNeighbors(queryPoint.data(), k, options);
+}
 
-   bool operator()(const IndexedPoint<T>& i, const IndexedPoint<T>& j) const
+template <class T, int Dim>
+std::vector<Neighbor> DynamicKDTree<T, Dim>::kNearestNeighbors(
+   const T* queryPoint, int k, const KDTreeQueryOptions& options) const
+{
+   if (_size == 0 || k < 1)
    {
-      return i.point[_axis] < j.point[_axis];
+      return std::vector<Neighbor>();
    }
 
-  private:
-   int _axis;
-};
+   KNearestHeap heap(std::min(k, _size));
+   search(queryPoint, heap, options);
+   return heap.sorted();
+}
 
-// Returns the squared Euclidian distance between two equal-sized
-// vectors.
-template<class T>
-double squaredDistance(const std::vector<T>& a, const std::vector<T>& b)
+template <class T, int Dim>
+int DynamicKDTree<T, Dim>::radiusSearch(const Point& queryPoint,
+					double radius,
+					std::vector<Neighbor>& results) const
 {
-   assert(a.size() == b.size());
+   assert(int(queryPoint.size()) == dimension());
+   return radiusSearch(queryPoint.data(), radius, results);
+}
 
-   double dist = 0.0;
-   for (int ii=0; ii<a.size(); ++ii)
+template <class T, int Dim>
+int DynamicKDTree<T, Dim>::radiusSearch(const T* queryPoint, double radius,
+					std::vector<Neighbor>& results) const
+{
+   if (radius < 0)
    {
-      dist += (a[ii]-b[ii])*(a[ii]-b[ii]);
+      return 0;
    }
 
-   return dist;
+   const size_t first = results.size();
+   RadiusResult found(radius*radius, results);
+   search(queryPoint, found, KDTreeQueryOptions());
+   return results.size() - first;
 }
 
-// KDTree member function implementations
 //
-template <class T>
-bool KDTree<T>::build(const std::vector< std::vector<T> >& data)
+// QuantizedKDTree member function implementations
+//
+
+template <class Q, class T, int Dim>
+bool QuantizedKDTree<Q, T, Dim>::build(const T* points, int count,
+				       int dimension,
+				       const KDTreeBuildOptions& options)
 {
    using namespace std;
 
-   bool success = false;
-   try
+   static_assert(numeric_limits<Q>::is_integer,
+		 "quantized coordinates must be integers");
+
+   // Map the widest axis onto the whole range of Q, and the others onto
+   // the same scale, starting at the bottom of the range
+   vector<double> low(dimension, numeric_limits<double>::max());
+   vector<double> high(dimension, -numeric_limits<double>::max());
+   for (int pp=0; pp<count; ++pp)
    {
-      // Copy the input data over to a non-const vector that also has
-      // indices
-      vector< IndexedPoint<T> > dataCopy;
-      for (int ii=0; ii<data.size(); ++ii)
+      for (int aa=0; aa<dimension; ++aa)
       {
-	 dataCopy.push_back(IndexedPoint<T>(ii, data[ii]));
+	 const double value = points[size_t(pp)*dimension + aa];
+	 low[aa] = min(low[aa], value);
+	 high[aa] = max(high[aa], value);
       }
+   }
+   double range = 0;
+   for (int aa=0; aa<dimension; ++aa)
+   {
+      range = max(range, high[aa] - low[aa]);
+   }
+   const double steps = double(numeric_limits<Q>::max())
+      - double(numeric_limits<Q>::min());
+   _scale = range > 0 ? range/steps : 1;
+   _offsets = count > 0 ? low : vector<double>(dimension, 0);
 
-      _rootNode = std::unique_ptr<KDNode<T>>( new KDNode<T> );
-      _rootNode->build(dataCopy, dataCopy.begin(), dataCopy.end());
-      success = true;
+   // Rounding moves each coordinate by up to half a step; allow a
+   // little more for the rounding of the arithmetic itself
+   _pointError = 0.5*_scale*sqrt(double(dimension))*(1 + 1e-9);
+
+   vector<Q> quantized(size_t(count)*dimension);
+   for (size_t ii=0; ii<quantized.size(); ++ii)
+   {
+      const double step = round((double(points[ii])
+				 - _offsets[ii%dimension])/_scale);
+      quantized[ii] = Q(min(step, steps) + numeric_limits<Q>::min());
    }
-   catch (exception& e)
+   if (!_tree.build(quantized.data(), count, dimension, options))
    {
-      cerr << "Exception during construction: " << e.what() << endl;
+      return false;
    }
 
-   return success;
+   _points.resize(size_t(count)*dimension);
+   for (int pp=0; pp<count; ++pp)
+   {
+      const T* point = points + size_t(_tree._indexData[pp])*dimension;
+      copy(point, point + dimension, &_points[size_t(pp)*dimension]);
+   }
+   return true;
 }
 
-template <class T>
-IndexedPoint<T> KDTree<T>::nearestNeighbor(const std::vector<T>& queryPoint)
+template <class Q, class T, int Dim>
+double QuantizedKDTree<Q, T, Dim>::quantize(const T* queryPoint,
+					    Q* quantized,
+					    double& clampDistance) const
 {
    using namespace std;
 
-   if (_rootNode == nullptr)
+   const double steps = double(numeric_limits<Q>::max())
+      - double(numeric_limits<Q>::min());
+   double error = 0;
+   clampDistance = 0;
+   for (int aa=0; aa<dimension(); ++aa)
    {
-      cerr << "No tree has been constructed" << endl;
-      return IndexedPoint<T>();
+      const double value = double(queryPoint[aa]);
+      const double clamped = min(max(value, _offsets[aa]),
+				 _offsets[aa] + steps*_scale);
+      const double step = min(round((clamped - _offsets[aa])/_scale),
+			      steps);
+      quantized[aa] = Q(step + numeric_limits<Q>::min());
+      const double diff = clamped - (_offsets[aa] + step*_scale);
+      error += diff*diff;
+      clampDistance += (value - clamped)*(value - clamped);
    }
+   clampDistance *= 1 - 1e-9;
+   return sqrt(error)*(1 + 1e-9);
+}
 
-   // Initialize the nearest point to the origin, and assign it a
-   // maxiamally bad distance
-   IndexedPoint<T> best;
-   best.point.resize(queryPoint.size(), 0);
-   best.index = -1;
-   double dist = std::numeric_limits<T>::max();
+template <class Q, class T, int Dim>
+std::vector<Neighbor> QuantizedKDTree<Q, T, Dim>::kNearestNeighbors(
+   const T* queryPoint, int k) const
+{
+   using namespace std;
 
-   try
+   if (size() == 0 || k < 1)
    {
-      _rootNode->nearestNeighbor(queryPoint, best, dist);
+      return vector<Neighbor>();
    }
-     catch (exception& e)
+   typename PointStorage<Q, Dim>::type quantized =
+      PointStorage<Q, Dim>::create(dimension());
+   double clampDistance;
+   const double queryError =
+      quantize(queryPoint, quantized.data(), clampDistance);
+
+   // The clamped query point is the closest point of the box to the
+   // query point, so the squared distance from the query point to a
+   // point of the box is at least the sum of the squared distances from
+   // the query point to the clamped one and from that to the point
+   KNearestHeap heap(min(k, size()));
+   RerankedResult<T, Dim> candidates(heap, _points.data(), queryPoint,
+				     dimension(), _scale, clampDistance,
+				     _pointError + queryError);
+   _tree.search(0, quantized.data(), candidates);
+
+   // Report indices into the primal dataset
+   vector<Neighbor> neighbors = heap.sorted();
+   for (Neighbor& neighbor : neighbors)
    {
-      cerr << "Exception during nearest neighbor query: " << e.what() << endl;
+      neighbor.index = _tree._indexData[neighbor.index];
    }
+   return neighbors;
+}
 
-   return best;
+template <class Q, class T, int Dim>
+Neighbor QuantizedKDTree<Q, T, Dim>::nearestNeighbor(
+   const T* queryPoint) const
+{
+   const std::vector<Neighbor> nearest = kNearestNeighbors(queryPoint, 1);
+   return nearest.empty()
+      ? Neighbor{-1, std::numeric_limits<double>::max()}
+      : nearest[0];
 }
 
-// Serialization
-template <class T>
-std::ostream& operator<< (std::ostream &out, const KDTree<T>& tree)
+template <class Q, class T, int Dim>
+void QuantizedKDTree<Q, T, Dim>::nearestNeighborBatch(
+   const T* queryPoints, int count, Neighbor* results, int threads) const
+{
+   parallelFor(count, threads,
+	       [&](size_t ii, int)
+	       {
+		  results[ii] = nearestNeighbor(
+		     queryPoints + ii*dimension());
+	       });
+}
+
+template <class Q, class T, int Dim>
+void QuantizedKDTree<Q, T, Dim>::kNearestNeighborsBatch(
+   const T* queryPoints, int count, int k, Neighbor* results,
+   int threads) const
+{
+   parallelFor(count, threads,
+	       [&](size_t ii, int)
+	       {
+		  const std::vector<Neighbor> neighbors =
+		     kNearestNeighbors(queryPoints + ii*dimension(), k);
+		  Neighbor* out = results + ii*k;
+		  std::copy(neighbors.begin(), neighbors.end(), out);
+		  for (int nn=neighbors.size(); nn<k; ++nn)
+		  {
+		     out[nn] = Neighbor{-1, std::numeric_limits<double>::max()};
+		  }
+	       });
+}
+
+template <class Q, class T, int Dim>
+size_t QuantizedKDTree<Q, T, Dim>::memoryUsage() const
+{
+   return _tree.memoryUsage() + _points.size()*sizeof(T);
+}
+
+//
+// ShardedKDTree member function implementations
+//
+
+template <class T, int Dim>
+struct ShardedKDTree<T, Dim>::ShardBuild
+{
+   const T*                 rows;
+   int                      dimension;
+   int                      shardDepth;
+   int                      threads;
+   KDTreeBuildOptions       options;
+   std::string              filename;
+   std::vector<int>         order;     // of the rows, partitioned as
+				       // build() partitions them
+   FlatKDTree<T, Dim>       layout;    // only its layout parameters are
+				       // used, to split nodes as build()
+				       // would
+   ShardedKDTree            index;     // the routing index built so far
+   std::vector<std::string> written;   // the files created so far
+};
+
+template <class T, int Dim>
+bool ShardedKDTree<T, Dim>::buildFiles(const T* points, int count,
+				       int dimension, int shardDepth,
+				       const std::string& filename,
+				       const KDTreeBuildOptions& options)
 {
    using namespace std;
 
-   // Ensure that we seialize our results at full numeric precision
-   out.precision(numeric_limits<T>::max_digits10);
+   bool success = false;
+   ShardBuild state;
+   try
+   {
+      if (count < 1)
+      {
+	 throw invalid_argument("no points to build from");
+      }
+      if (options.leafSize < 1)
+      {
+	 throw invalid_argument("leaves must hold at least one point");
+      }
+      if (dimension < 1
+	  || (Dim != DYNAMIC_DIMENSION && dimension != Dim))
+      {
+	 throw invalid_argument("points are not of the tree's dimension");
+      }
+      if (shardDepth < 0)
+      {
+	 throw invalid_argument("the shard depth can't be negative");
+      }
 
-   if (tree._rootNode != nullptr)
+      state.rows = points;
+      state.dimension = dimension;
+      state.shardDepth = shardDepth;
+      state.threads = options.threads < 1
+	 ? max(1u, thread::hardware_concurrency())
+	 : options.threads;
+      state.options = options;
+      state.filename = filename;
+      state.order.resize(count);
+      iota(state.order.begin(), state.order.end(), 0);
+      state.layout._dimension = dimension;
+      state.layout._blockWidth =
+	 options.leafSize < BLOCK_WIDTH ? 1 : BLOCK_WIDTH;
+      state.index._dimension = dimension;
+      state.index._size = count;
+
+      buildRouting(state, 0, count, -1, 0);
+
+      // The routing index is written last, once every shard is in place
+      const ShardedKDTree& index = state.index;
+      ShardedKDTreeHeader header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, "KDSHARDS", 8);
+      header.version = SHARDED_KDTREE_VERSION;
+      header.byteOrder = 0x01020304;
+      header.coordinateType = coordinateTypeCode<T>();
+      header.dimension = dimension;
+      header.size = count;
+      header.nodeCount = index._nodes.size();
+      header.shardCount = index._shardSizes.size();
+      header.nodeSize = sizeof(FlatKDNode<T>);
+
+      state.written.push_back(filename);
+      ofstream out(filename, ofstream::binary | ofstream::trunc);
+      out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      out.write(reinterpret_cast<const char*>(index._nodes.data()),
+		index._nodes.size()*sizeof(FlatKDNode<T>));
+      out.write(reinterpret_cast<const char*>(index._bounds.data()),
+		index._bounds.size()*sizeof(T));
+      out.write(reinterpret_cast<const char*>(index._shardSizes.data()),
+		index._shardSizes.size()*sizeof(int32_t));
+      out.close();
+      if (!out)
+      {
+	 throw runtime_error("unable to write " + filename);
+      }
+      success = true;
+   }
+   catch (exception& e)
    {
-      out << *(tree._rootNode);
+      cerr << "Exception during construction: " << e.what() << endl;
+      for (const string& name : state.written)
+      {
+	 remove(name.c_str());
+      }
    }
 
-   return out;
+   return success;
 }
 
-// We use 'axis == -1' as an indictor for a node that doesn't exist.
-#define NULLPTR_MARKER -1
-
-int intFromStream(std::istream& in)
+template <class T, int Dim>
+int ShardedKDTree<T, Dim>::buildRouting(ShardBuild& state, int start,
+					int end, int parentAxis, int depth)
 {
    using namespace std;
 
-   // Read an int
-   string line;
-   getline(in, line);
-   istringstream axis_stream(line);
+   const int dimension = state.dimension;
+   ShardedKDTree& index = state.index;
+   const int nodeIdx = index._nodes.size();
+   index._nodes.push_back(FlatKDNode<T>());
 
-   int val;
-   if (!(axis_stream >> val))
+   if (depth == state.shardDepth || end - start <= state.options.leafSize)
    {
-      // End of file
-      return -1;
+      // Build the subtree as a tree of its own, from a copy of its
+      // points, and point its indices back at the whole data set
+      vector<T> rows(size_t(end - start)*dimension);
+      for (int ii=start; ii<end; ++ii)
+      {
+	 copy_n(&state.rows[size_t(state.order[ii])*dimension], dimension,
+		&rows[size_t(ii - start)*dimension]);
+      }
+      FlatKDTree<T, Dim> tree;
+      if (!tree.buildBelow(rows.data(), end - start, dimension, parentAxis,
+			   state.options))
+      {
+	 throw runtime_error("unable to build a shard");
+      }
+      for (int& pointIdx : tree._indices)
+      {
+	 pointIdx = state.order[start + pointIdx];
+      }
+
+      const int shard = index._shardSizes.size();
+      const size_t low = index._bounds.size();
+      index._bounds.insert(index._bounds.end(), rows.begin(),
+			   rows.begin() + dimension);
+      index._bounds.insert(index._bounds.end(), rows.begin(),
+			   rows.begin() + dimension);
+      for (size_t pp=1; pp<size_t(end - start); ++pp)
+      {
+	 for (int aa=0; aa<dimension; ++aa)
+	 {
+	    const T value = rows[pp*dimension + aa];
+	    index._bounds[low + aa] = min(index._bounds[low + aa], value);
+	    index._bounds[low + dimension + aa] =
+	       max(index._bounds[low + dimension + aa], value);
+	 }
+      }
+      index._shardSizes.push_back(end - start);
+
+      const string name = shardFilename(state.filename, shard);
+      state.written.push_back(name);
+      ofstream out(name, ofstream::binary | ofstream::trunc);
+      out << tree;
+      out.close();
+      if (!out)
+      {
+	 throw runtime_error("unable to write " + name);
+      }
+
+      FlatKDNode<T>& node = index._nodes[nodeIdx];
+      node.split = T();
+      node.axis = LEAF_AXIS;
+      node.left = shard;
+      node.right = shard + 1;
+      return nodeIdx;
    }
 
-   return val;
+   // Split the node as buildRange() does
+   const int axis = state.layout.splitAxis(state.rows, state.order, start,
+					   end, parentAxis,
+					   state.options.splitRule,
+					   state.threads);
+   const int median = state.layout.splitPosition(start, end);
+   nth_element(state.order.begin() + start, state.order.begin() + median,
+	       state.order.begin() + end,
+	       CoordinateCompare<T>(state.rows, dimension, axis));
+   const T split = state.rows[size_t(state.order[median])*dimension + axis];
+
+   const int left = buildRouting(state, start, median, axis, depth + 1);
+   const int right = buildRouting(state, median, end, axis, depth + 1);
+
+   FlatKDNode<T>& node = index._nodes[nodeIdx];
+   node.split = split;
+   node.axis = axis;
+   node.left = left;
+   node.right = right;
+   return nodeIdx;
 }
 
-template <class T>
-std::ostream& operator<< (std::ostream &out, const KDNode<T>& node)
+template <class T, int Dim>
+std::string ShardedKDTree<T, Dim>::shardFilename(const std::string& filename,
+						 int shard)
+{
+   return filename + "." + std::to_string(shard);
+}
+
+template <class T, int Dim>
+bool ShardedKDTree<T, Dim>::loadIndex(const std::string& filename)
 {
    using namespace std;
 
-   out << node._axis << endl;
+   *this = ShardedKDTree();
 
-   out << node._location.index << endl;
-   for (const auto& x : node._location.point)
+   ifstream in(filename, ifstream::in | ifstream::binary);
+   if (!in.is_open())
    {
-      out << x << " ";
+      cerr << "Unable to open " << filename << endl;
+      return false;
    }
-   out << endl;
 
-   if (node._leftNode != nullptr)
+   // Refuse files which weren't written for this type of tree
+   ShardedKDTreeHeader header;
+   if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))
+       || memcmp(header.magic, "KDSHARDS", 8) != 0
+       || header.version != SHARDED_KDTREE_VERSION
+       || header.byteOrder != 0x01020304
+       || header.coordinateType != coordinateTypeCode<T>()
+       || header.nodeSize != int32_t(sizeof(FlatKDNode<T>))
+       || header.dimension < 1
+       || (Dim != DYNAMIC_DIMENSION && header.dimension != Dim)
+       || header.size < 1 || header.nodeCount < 1 || header.shardCount < 1)
    {
-      out << *(node._leftNode);
+      cerr << filename << " is not a compatible ShardedKDTree file" << endl;
+      return false;
    }
-   else
+
+   _nodes.resize(header.nodeCount);
+   _bounds.resize(size_t(2)*header.dimension*header.shardCount);
+   _shardSizes.resize(header.shardCount);
+   in.read(reinterpret_cast<char*>(_nodes.data()),
+	   _nodes.size()*sizeof(FlatKDNode<T>));
+   in.read(reinterpret_cast<char*>(_bounds.data()),
+	   _bounds.size()*sizeof(T));
+   in.read(reinterpret_cast<char*>(_shardSizes.data()),
+	   _shardSizes.size()*sizeof(int32_t));
+   _dimension = header.dimension;
+   if (!in || in.peek() != ifstream::traits_type::eof()
+       || !validIndex(header.size))
    {
-      out << NULLPTR_MARKER << endl;
+      cerr << filename << " is not a compatible ShardedKDTree file" << endl;
+      *this = ShardedKDTree();
+      return false;
    }
 
-   if (node._rightNode != nullptr)
+   _size = header.size;
+   return true;
+}
+
+template <class T, int Dim>
+bool ShardedKDTree<T, Dim>::validIndex(int size) const
+{
+   // Children follow their parents, so a single pass in array order
+   // reaches every node after the nodes referring to it
+   const int nodeCount = _nodes.size();
+   std::vector<int> depth(nodeCount, 0);
+   std::vector<char> routed(shardCount(), 0);
+   for (int nn=0; nn<nodeCount; ++nn)
    {
-      out << *(node._rightNode);
+      const FlatKDNode<T>& node = _nodes[nn];
+      if (node.axis == LEAF_AXIS)
+      {
+	 if (node.left < 0 || node.left >= shardCount()
+	     || node.right != node.left + 1 || routed[node.left]
+	     || depth[nn] > MAX_SEARCH_DEPTH)
+	 {
+	    return false;
+	 }
+	 routed[node.left] = 1;
+      }
+      else if (node.axis < 0 || node.axis >= dimension()
+	       || node.left <= nn || node.left >= nodeCount
+	       || node.right <= nn || node.right >= nodeCount)
+      {
+	 return false;
+      }
+      else
+      {
+	 depth[node.left] = std::max(depth[node.left], depth[nn] + 1);
+	 depth[node.right] = std::max(depth[node.right], depth[nn] + 1);
+      }
    }
-   else
+
+   int64_t points = 0;
+   for (int ss=0; ss<shardCount(); ++ss)
    {
-      out << NULLPTR_MARKER << endl;
+      if (!routed[ss] || _shardSizes[ss] < 1)
+      {
+	 return false;
+      }
+      points += _shardSizes[ss];
    }
-
-   return out;
+   return points == size;
 }
 
-
-// Deserialization
-template<class T>
-std::istream& operator>> (std::istream &in, KDTree<T>& tree)
+template <class T, int Dim>
+bool ShardedKDTree<T, Dim>::load(const std::string& filename)
 {
    using namespace std;
 
-   // Read the axis so we can determine if our tree should even
-   // be constructed
-   int axis = intFromStream(in);
-
-   if (axis == -1)
+   if (!loadIndex(filename))
    {
-      // A root node doesn't exist or we've reached the end of the file
-      return in;
+      return false;
    }
 
-   tree._rootNode = std::unique_ptr<KDNode<T>>( new KDNode<T>(axis) );
-   in >> *(tree._rootNode);
-   return in;
+   _shards.resize(shardCount());
+   for (int ss=0; ss<shardCount(); ++ss)
+   {
+      const string name = shardFilename(filename, ss);
+      if (!_shards[ss].mapFile(name))
+      {
+	 *this = ShardedKDTree();
+	 return false;
+      }
+      if (_shards[ss].size() != _shardSizes[ss]
+	  || _shards[ss].dimension() != dimension())
+      {
+	 cerr << name << " is not a shard of " << filename << endl;
+	 *this = ShardedKDTree();
+	 return false;
+      }
+   }
+   return true;
 }
 
-template<class T>
-std::istream& operator>> (std::istream &in, KDNode<T>& node)
+template <class T, int Dim>
+double ShardedKDTree<T, Dim>::shardDistance(int shard,
+					    const T* queryPoint) const
 {
-   using namespace std;
-
-   node._location.index = intFromStream(in);
-
-   string line;
-   getline(in, line);
-   istringstream point_stream(line);
+   const T* low = &_bounds[size_t(2)*shard*dimension()];
+   const T* high = low + dimension();
 
-   T elem;
-   while (point_stream >> elem)
+   double distance = 0;
+   for (int aa=0; aa<dimension(); ++aa)
    {
-      node._location.point.push_back(elem);
+      const double value = queryPoint[aa];
+      const double offset = value < low[aa]
+	 ? double(low[aa]) - value
+	 : (value > high[aa] ? value - double(high[aa]) : 0);
+      distance += offset*offset;
    }
+   return distance;
+}
 
-   // read axis of left child
-   int axis = intFromStream(in);
-   if (axis == -1)
-   {
-      // The node doesn't exist or we've reached the end of the file
-      node._leftNode = std::unique_ptr<KDNode<T>>(nullptr);
-   }
-   else
+template <class T, int Dim>
+std::vector<Neighbor> ShardedKDTree<T, Dim>::route(const T* queryPoint,
+						   double radius) const
+{
+   std::vector<Neighbor> shards;
+   if (!_nodes.empty() && radius >= 0)
    {
-      node._leftNode = std::unique_ptr<KDNode<T>>( new KDNode<T>(axis) );
-      in >> *(node._leftNode);
+      routeBelow(0, queryPoint, radius*radius, shards);
+      std::sort(shards.begin(), shards.end());
    }
+   return shards;
+}
 
-   // read axis of right child
-   axis = intFromStream(in);
-   if (axis == -1)
+template <class T, int Dim>
+void ShardedKDTree<T, Dim>::routeBelow(int nodeIdx, const T* queryPoint,
+				       double sqrRadius,
+				       std::vector<Neighbor>& shards) const
+{
+   const FlatKDNode<T>& node = _nodes[nodeIdx];
+   if (node.axis == LEAF_AXIS)
    {
-      // The node doesn't exist or we've reached the end of the file
-      node._rightNode = std::unique_ptr<KDNode<T>>(nullptr);
+      const double distance = shardDistance(node.left, queryPoint);
+      if (distance <= sqrRadius)
+      {
+	 shards.push_back(Neighbor{node.left, distance});
+      }
+      return;
    }
-   else
+
+   const double offset = double(queryPoint[node.axis]) - double(node.split);
+   const bool goLeft = offset <= 0;
+   routeBelow(goLeft ? node.left : node.right, queryPoint, sqrRadius,
+	      shards);
+   if (offset*offset <= sqrRadius)
    {
-      node._rightNode = std::unique_ptr<KDNode<T>>( new KDNode<T>(axis) );
-      in >> *(node._rightNode);
+      routeBelow(goLeft ? node.right : node.left, queryPoint, sqrRadius,
+		 shards);
    }
-
-   return in;
 }
 
-
-// KDNode member function defintion
-//
-template <class T>
-void KDNode<T>::build(std::vector< IndexedPoint<T> >& data,
-		      typename std::vector< IndexedPoint<T> >::iterator start,
-		      typename std::vector< IndexedPoint<T> >::iterator end,
-		      int axis)
+// The routing index is only a few levels deep, so it is searched
+// recursively. The shard on the query point's side of each split is
+// searched first, as it most likely holds the nearest points, which
+// then prune the searches of the others.
+template <class T, int Dim>
+template <class ResultSet>
+void ShardedKDTree<T, Dim>::search(int nodeIdx, const T* queryPoint,
+				   ResultSet& results,
+				   const KDTreeQueryOptions& options) const
 {
-   using namespace std;
-
-   _axis = (axis + 1 ) % start->point.size(); // separating axis of this node
+   assert(_shards.size() == _shardSizes.size());
 
-   const int dataSize = end - start;
-   if (dataSize < 2)
+   const double pruneScale = (1 + options.epsilon)*(1 + options.epsilon);
+   const FlatKDNode<T>& node = _nodes[nodeIdx];
+   if (node.axis == LEAF_AXIS)
    {
-      _location = *start; // copy, so we can discard the data vector
-			  // after construction
-      _leftNode = std::unique_ptr<KDNode<T>>( nullptr );
-      _rightNode = std::unique_ptr<KDNode<T>>( nullptr );
+      if (shardDistance(node.left, queryPoint)*pruneScale
+	  <= results.worstDistance())
+      {
+	 const FlatKDTree<T, Dim>& tree = _shards[node.left];
+	 ShardResult<ResultSet> shardResults(results, tree._indexData);
+	 tree.search(0, queryPoint, shardResults, options);
+      }
       return;
    }
 
-   // find median element
-   typename vector<IndexedPoint<T>>::iterator medianItr = start+dataSize/2;
-   nth_element(start, medianItr, end,  IndexedPointCompare<T>(_axis));
-
-   _location = *medianItr; // copy, so we can discard the data vector
-			   // after construction
-
-   typename vector<IndexedPoint<T>>::iterator leftStart = start;
-   typename vector<IndexedPoint<T>>::iterator leftEnd = medianItr;
-   typename vector<IndexedPoint<T>>::iterator rightStart = medianItr;
-   typename vector<IndexedPoint<T>>::iterator rightEnd = end;
-
-   if (leftStart != leftEnd)
+   const double offset = double(queryPoint[node.axis]) - double(node.split);
+   const bool goLeft = offset <= 0;
+   search(goLeft ? node.left : node.right, queryPoint, results, options);
+   if (offset*offset*pruneScale <= results.worstDistance())
    {
-      _leftNode = std::unique_ptr<KDNode<T>>( new KDNode<T> );
-      _leftNode->build(data, leftStart, leftEnd, _axis);
+      search(goLeft ? node.right : node.left, queryPoint, results, options);
    }
+}
+
+template <class T, int Dim>
+Neighbor ShardedKDTree<T, Dim>::nearestNeighbor(
+   const Point& queryPoint, const KDTreeQueryOptions& options) const
+{
+   assert(int(queryPoint.size()) == dimension());
+   return nearestNeighbor(queryPoint.data(), options);
+}
 
-   if (rightStart != rightEnd)
+template <class T, int Dim>
+Neighbor ShardedKDTree<T, Dim>::nearestNeighbor(
+   const T* queryPoint, const KDTreeQueryOptions& options) const
+{
+   NearestResult best;
+   if (shardsLoaded())
    {
-      _rightNode = std::unique_ptr<KDNode<T>>( new KDNode<T> );
-      _rightNode->build(data, rightStart, rightEnd, _axis);
+      search(0, queryPoint, best, options);
    }
+   return Neighbor{best.point, best.sqrDistance};
 }
 
-
-template <class T>
-void KDNode<T>::nearestNeighbor(const std::vector<T>& queryPoint,
-				IndexedPoint<T>& best,
-				double& bestSqrDistance)
+template <class T, int Dim>
+std::vector<Neighbor> ShardedKDTree<T, Dim>::kNearestNeighbors(
+   const Point& queryPoint, int k, const KDTreeQueryOptions& options) const
 {
-   using namespace std;
-
-   assert(_location.point.size() == queryPoint.size() );
+   assert(int(queryPoint.size()) == dimension());
+   return kNearestNeighbors(queryPoint.data(), k, options);
+}
 
-   // If the point at this node is closer than our current best, make
-   // it the best
-   T distance = squaredDistance<T>(_location.point, queryPoint);
-   if (distance < bestSqrDistance)
+template <class T, int Dim>
+std::vector<Neighbor> ShardedKDTree<T, Dim>::kNearestNeighbors(
+   const T* queryPoint, int k, const KDTreeQueryOptions& options) const
+{
+   if (!shardsLoaded() || k < 1)
    {
-      bestSqrDistance = distance;
-      best = _location;
+      return std::vector<Neighbor>();
    }
 
-   // Recursively search the nodes beneath this one
-   if (_leftNode != nullptr && queryPoint[_axis] <= _location.point[_axis])
-   {
-      _leftNode->nearestNeighbor(queryPoint, best, bestSqrDistance);
-   }
-   else if (_rightNode != nullptr)
-   {
-      _rightNode->nearestNeighbor(queryPoint, best, bestSqrDistance);
-   }
+   KNearestHeap heap(std::min(k, _size));
+   search(0, queryPoint, heap, options);
+   return heap.sorted();
+}
+
+template <class T, int Dim>
+int ShardedKDTree<T, Dim>::radiusSearch(const Point& queryPoint,
+					double radius,
+					std::vector<Neighbor>& results) const
+{
+   assert(int(queryPoint.size()) == dimension());
+   return radiusSearch(queryPoint.data(), radius, results);
+}
 
-   // If the this node's splitting plane is within the radius of the
-   // best distance hypersphere, we need to examine the node on the
-   // other side of plane, in case it is actually closer
-   const double hypersphereDist = queryPoint[_axis] - _location.point[_axis];
-   if (hypersphereDist*hypersphereDist <= bestSqrDistance)
+template <class T, int Dim>
+int ShardedKDTree<T, Dim>::radiusSearch(const T* queryPoint, double radius,
+					std::vector<Neighbor>& results) const
+{
+   if (radius < 0 || !shardsLoaded())
    {
-      if (_rightNode != nullptr && queryPoint[_axis] <= _location.point[_axis])
-      {
-	 _rightNode->nearestNeighbor(queryPoint, best, bestSqrDistance);
-      }
-      else if (_leftNode != nullptr)
-      {
-	 _leftNode->nearestNeighbor(queryPoint, best, bestSqrDistance);
-      }
+      return 0;
    }
+
+   const size_t first = results.size();
+   RadiusResult found(radius*radius, results);
+   search(0, queryPoint, found, KDTreeQueryOptions());
+   return results.size() - first;
 }
+
+#endif
@@ -6,177 +6,1368 @@
 //
 
 #include <assert.h>
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <fstream>
-#include <sstream>
+#include <thread>
 #include <vector>
 
+#include "csv_reader.h"
 #include "kdtree.h"
 
 using namespace std;
 
 // Our KD tree code is templated on dimension as well as
-// data-type. For the sake of this example, we are using
-// double-precision floating point numbers
-typedef double DATA_TYPE;
+// data-type. The program handles trees of double-precision or
+// single-precision floating point numbers, whichever the tree file
+// holds, so the functions below are templated on DATA_TYPE.
+
+// The command line options
+struct Settings
+{
+   int                k;
+   double             radius;        // less than 0 for k nearest
+					// neighbor queries
+   KDTreeQueryOptions queryOptions;
+   int                threads;
+   bool               mapTree;
+   bool               dualTree;
+   int                quantizeBits;  // 8 or 16, or 0 not to quantize
+   const char*        metric;        // null for the FlatKDTree's
+					// Euclidean queries
+   bool               dynamicTree;
+   int                publishes;     // trees to swap in while querying,
+					// or 0 to query the tree file
+   const char*        treeFilename;
+   const char*        dataFilename;
+   const char*        queryFilename;
+};
+
+// Answer the queries with a tree of DATA_TYPE coordinates, and check
+// the results. Returns the program's exit status.
+template<class DATA_TYPE>
+int queryTree(const Settings& settings);
+
+// As queryTree(), with a tree written by 'build_kdtree -S'
+template<class DATA_TYPE>
+int queryShardedTree(const Settings& settings);
+
+// Find the nearest neighbor of each query with a KDTree of the original
+// points searched under settings.metric, and check the results
+template<class DATA_TYPE>
+int queryMetricTree(const Settings& settings);
+
+// Answer the queries with a DynamicKDTree that the original points
+// have been inserted into and partly erased from, and check the
+// results against the points that are left
+template<class DATA_TYPE>
+int queryDynamicTree(const Settings& settings);
+
+// Answer the queries over and over from snapshots of a SharedKDTree
+// while another thread publishes settings.publishes trees, alternately
+// of every other original point and of all of them, and check each
+// result against the points of the tree it came from
+template<class DATA_TYPE>
+int querySharedTree(const Settings& settings);
+
+// As queryMetricTree(), with the given metric, whose weights or periods
+// are also given to bruteForceDistance()
+template<class DATA_TYPE, class Metric>
+int queryMetricTree(const Settings& settings, const Metric& metric,
+		    const vector<double>& parameters,
+		    const PointSet<DATA_TYPE>& originalPoints,
+		    const PointSet<DATA_TYPE>& queries);
+
+// Returns the type code of the coordinates of a serialized tree (see
+// coordinateTypeCode()), or 0 if it can't be read
+uint32_t treeCoordinateType(const char* filename);
+
+// Returns whether a file holds the routing index of a ShardedKDTree
+bool isShardedTree(const char* filename);
 
 // Do a brute-force calculation of the closest point, as a ground
 // truth for testing
-int bruteForceClosest(const vector<vector<DATA_TYPE>>& data,
-		      const vector<DATA_TYPE>& query);
+template<class DATA_TYPE>
+int bruteForceClosest(const PointSet<DATA_TYPE>& data,
+		      const DATA_TYPE* query);
+
+// Do a brute-force calculation of the k closest points, sorted by
+// distance, as a ground truth for testing
+template<class DATA_TYPE>
+vector<int> bruteForceKClosest(const PointSet<DATA_TYPE>& data,
+			       const DATA_TYPE* query, int k);
+
+// Do a brute-force calculation of the points within 'radius', in
+// index order, as a ground truth for testing
+template<class DATA_TYPE>
+vector<int> bruteForceWithin(const PointSet<DATA_TYPE>& data,
+			     const DATA_TYPE* query, double radius);
 
-// Read a list of well-formatted points from the input file
-vector< vector<DATA_TYPE> > readPointsFromFile(const char* filename);
+// Compute the distance between two points under the named metric in
+// the units its policy class uses (squared for the Euclidean ones),
+// but without it, as a ground truth for testing. 'parameters' holds
+// the weights or periods of the axes, for the metrics that have them.
+template<class DATA_TYPE>
+double bruteForceDistance(const string& metric,
+			  const vector<double>& parameters,
+			  const DATA_TYPE* a, const DATA_TYPE* b,
+			  int dimension);
+
+// Read a list of well-formatted points from the input file, or exit
+template<class DATA_TYPE>
+PointSet<DATA_TYPE> readPoints(const char* filename, int threads);
+
+// Describe the command line
+void printUsage();
+
+void printUsage()
+{
+   cout << "Usage: query_kdtree [-m] [-d] [-s] [-k neighbors | -r radius] "
+	<< "[-e epsilon] [-b leaves] [-i width] [-q int16|uint8] "
+	<< "[-M metric] [-u] [-p publishes] [-t threads] "
+	<< "<kdtree file> <original data> <query points>" << endl
+	<< "You must specify a serialized kdtree data file as "
+	<< "the first argument, the original data set as the "
+	<< "second argument, and a file containing query points "
+	<< "as the third." << endl
+	<< "  -m  map the kdtree file into memory rather than reading it"
+	<< endl
+	<< "  -d  build a tree of the query points and search both trees "
+	<< "together" << endl
+	<< "  -s  answer the queries in the order of the leaves they land in"
+	<< endl
+	<< "  -u  answer the queries with a DynamicKDTree built from the "
+	<< "first half of the original points, two in three of them "
+	<< "erased, and the rest inserted one in three of them erased"
+	<< endl
+	<< "  -p  answer the queries over and over from snapshots of a "
+	<< "SharedKDTree, while another thread publishes this many trees of "
+	<< "every other original point and of all of them in turn" << endl
+	<< "  -k  find the k nearest neighbors of each query point "
+	<< "(default 1)" << endl
+	<< "  -r  find every point within the radius of each query point"
+	<< endl
+	<< "  -e  accept neighbors up to (1 + epsilon) times as far away as "
+	<< "the true ones, and report the recall" << endl
+	<< "  -b  scan at most this many leaves per query, and report the "
+	<< "recall" << endl
+	<< "  -i  interleave the searches of this many queries per thread, "
+	<< "prefetching the nodes each one needs next" << endl
+	<< "  -q  answer the queries with a tree of the original points "
+	<< "quantized to 16 or 8 bit integers" << endl
+	<< "  -M  find the nearest neighbor of each query point with a "
+	<< "KDTree of the original points under the metric: euclidean, "
+	<< "manhattan, chebyshev, weighted (axis i by i + 1) or periodic "
+	<< "(each axis shifted to start at 0 and wrapping at 1.25 times "
+	<< "the points' extent)" << endl
+	<< "The kdtree file may be the routing index of a sharded tree, "
+	<< "whose shards are always mapped, and which only answers exact "
+	<< "queries (without -d, -e, -b or -q)." << endl
+	<< "  -t  number of query threads (default: all cores)" << endl;
+}
 
 int
 main(int argc, char *argv[])
 {
+   // Parse the options, which precede the file names
+   Settings settings;
+   settings.k = 1;
+   settings.radius = -1;
+   settings.threads = 0;
+   settings.mapTree = false;
+   settings.dualTree = false;
+   settings.quantizeBits = 0;
+   settings.metric = nullptr;
+   settings.dynamicTree = false;
+   settings.publishes = 0;
+   int& k = settings.k;
+   double& radius = settings.radius;
+   KDTreeQueryOptions& queryOptions = settings.queryOptions;
+   int& threads = settings.threads;
+   int arg = 1;
+   for (; arg < argc && argv[arg][0] == '-'; ++arg)
+   {
+      const string option(argv[arg]);
+      if (option == "-m")
+      {
+	 settings.mapTree = true;
+	 continue;
+      }
+      if (option == "-d")
+      {
+	 settings.dualTree = true;
+	 continue;
+      }
+      if (option == "-s")
+      {
+	 queryOptions.sortBatch = true;
+	 continue;
+      }
+      if (option == "-u")
+      {
+	 settings.dynamicTree = true;
+	 continue;
+      }
+      if (arg + 1 >= argc)
+      {
+	 printUsage();
+	 exit(1);
+      }
+
+      if (option == "-k")
+      {
+	 k = atoi(argv[++arg]);
+      }
+      else if (option == "-r")
+      {
+	 radius = atof(argv[++arg]);
+	 if (radius < 0)
+	 {
+	    cout << "The radius must not be negative" << endl;
+	    exit(1);
+	 }
+      }
+      else if (option == "-e")
+      {
+	 queryOptions.epsilon = atof(argv[++arg]);
+      }
+      else if (option == "-b")
+      {
+	 queryOptions.maxLeaves = atoi(argv[++arg]);
+      }
+      else if (option == "-i")
+      {
+	 queryOptions.interleave = atoi(argv[++arg]);
+	 if (queryOptions.interleave < 1)
+	 {
+	    printUsage();
+	    exit(1);
+	 }
+      }
+      else if (option == "-q")
+      {
+	 const string type(argv[++arg]);
+	 if (type == "int16")
+	 {
+	    settings.quantizeBits = 16;
+	 }
+	 else if (type == "uint8")
+	 {
+	    settings.quantizeBits = 8;
+	 }
+	 else
+	 {
+	    printUsage();
+	    exit(1);
+	 }
+      }
+      else if (option == "-M")
+      {
+	 const string metric(argv[++arg]);
+	 if (metric != "euclidean" && metric != "manhattan"
+	     && metric != "chebyshev" && metric != "weighted"
+	     && metric != "periodic")
+	 {
+	    printUsage();
+	    exit(1);
+	 }
+	 settings.metric = argv[arg];
+      }
+      else if (option == "-p")
+      {
+	 settings.publishes = atoi(argv[++arg]);
+	 if (settings.publishes < 1)
+	 {
+	    printUsage();
+	    exit(1);
+	 }
+      }
+      else if (option == "-t")
+      {
+	 threads = atoi(argv[++arg]);
+      }
+      else
+      {
+	 printUsage();
+	 exit(1);
+      }
+   }
+
    // Minimal sanity checking of user input
-   if (argc != 4)
+   if (argc - arg != 3)
+   {
+      printUsage();
+      exit(1);
+   }
+   if (k < 1)
    {
-      cout << "You must specify a serialized kdtree data file as "
-	   << "the first argument, the original data set as the "
-	   << "second argument, and a file containing query points "
-	   << "as the third" << endl;
+      cout << "k must be a positive integer" << endl;
       exit(1);
    }
+   if ((settings.dualTree || settings.quantizeBits != 0)
+       && (radius >= 0 || queryOptions.epsilon > 0
+	   || queryOptions.maxLeaves > 0))
+   {
+      cout << "-d and -q only find exact nearest neighbors" << endl;
+      exit(1);
+   }
+   if (settings.dualTree && settings.quantizeBits != 0)
+   {
+      cout << "-d and -q can't be combined" << endl;
+      exit(1);
+   }
+   if (settings.metric
+       && (k != 1 || radius >= 0 || settings.dualTree
+	   || settings.quantizeBits != 0 || queryOptions.epsilon > 0
+	   || queryOptions.maxLeaves > 0))
+   {
+      cout << "-M only finds exact nearest neighbors, without -k, -r, "
+	   << "-d or -q" << endl;
+      exit(1);
+   }
+   if (settings.dynamicTree
+       && (settings.dualTree || settings.quantizeBits != 0 || settings.metric
+	   || queryOptions.epsilon > 0 || queryOptions.maxLeaves > 0))
+   {
+      cout << "-u only answers exact queries, without -d, -q or -M" << endl;
+      exit(1);
+   }
+   if (settings.publishes > 0
+       && (settings.dualTree || settings.quantizeBits != 0 || settings.metric
+	   || settings.dynamicTree || queryOptions.epsilon > 0
+	   || queryOptions.maxLeaves > 0))
+   {
+      cout << "-p only answers exact queries, without -d, -q, -M or -u"
+	   << endl;
+      exit(1);
+   }
+   settings.treeFilename = argv[arg];
+   settings.dataFilename = argv[arg + 1];
+   settings.queryFilename = argv[arg + 2];
+
+   // Trees of floats are written by 'build_kdtree -p float'
+   const bool singlePrecision = treeCoordinateType(settings.treeFilename)
+      == coordinateTypeCode<float>();
+   if (settings.publishes > 0)
+   {
+      return singlePrecision
+	 ? querySharedTree<float>(settings)
+	 : querySharedTree<double>(settings);
+   }
+   if (settings.dynamicTree)
+   {
+      return singlePrecision
+	 ? queryDynamicTree<float>(settings)
+	 : queryDynamicTree<double>(settings);
+   }
+   if (settings.metric)
+   {
+      return singlePrecision
+	 ? queryMetricTree<float>(settings)
+	 : queryMetricTree<double>(settings);
+   }
+   if (isShardedTree(settings.treeFilename))
+   {
+      if (settings.dualTree || settings.quantizeBits != 0
+	  || queryOptions.epsilon > 0 || queryOptions.maxLeaves > 0)
+      {
+	 cout << "Sharded trees only answer exact queries" << endl;
+	 exit(1);
+      }
+      return singlePrecision
+	 ? queryShardedTree<float>(settings)
+	 : queryShardedTree<double>(settings);
+   }
+   if (singlePrecision)
+   {
+      return queryTree<float>(settings);
+   }
+   return queryTree<double>(settings);
+}
+
+template<class DATA_TYPE>
+int queryTree(const Settings& settings)
+{
+   const int k = settings.k;
+   const double radius = settings.radius;
+   const KDTreeQueryOptions& queryOptions = settings.queryOptions;
+   const int threads = settings.threads;
+   const bool mapTree = settings.mapTree;
+   const bool dualTree = settings.dualTree;
+   const char* treeFilename = settings.treeFilename;
+   const char* dataFilename = settings.dataFilename;
+   const char* queryFilename = settings.queryFilename;
 
-   // Deserialize the tree
-   cout << "Deserizalizing " << argv[1] << endl;
-   KDTree<DATA_TYPE> tree;
-   ifstream infile(argv[1], ifstream::in);
-   if (infile.is_open())
+   // Deserialize the tree, or map it and query it in place
+   cout << (mapTree ? "Mapping " : "Deserizalizing ") << treeFilename << endl;
+   FlatKDTree<DATA_TYPE> tree;
+   const auto loadStart = chrono::steady_clock::now();
+   if (mapTree)
+   {
+      if (!tree.mapFile(treeFilename))
+      {
+	 exit(1);
+      }
+   }
+   else
    {
-      infile >> tree;
-      infile.close();
+      ifstream infile(treeFilename, ifstream::in | ifstream::binary);
+      if (!infile.is_open() || !(infile >> tree))
+      {
+	 cerr << treeFilename << " is not a serialized kdtree" << endl;
+	 exit(1);
+      }
    }
+   const chrono::duration<double> loadElapsed =
+      chrono::steady_clock::now() - loadStart;
+   cout << "Loaded " << tree.size() << " points in " << loadElapsed.count()
+	<< " s" << endl;
 
    // Read the original point data (for use later for correctness checking)
-   cout << "Reading original points from " << argv[2] << endl;
-   vector< vector<DATA_TYPE> > originalPoints = readPointsFromFile(argv[2]);
+   cout << "Reading original points from " << dataFilename << endl;
+   const PointSet<DATA_TYPE> originalPoints =
+      readPoints<DATA_TYPE>(dataFilename, threads);
 
    // Read the query data
-   cout << "Reading query points from " << argv[3] << endl;
-   vector< vector<DATA_TYPE> > queries = readPointsFromFile(argv[3]);
+   cout << "Reading query points from " << queryFilename << endl;
+   const PointSet<DATA_TYPE> queries =
+      readPoints<DATA_TYPE>(queryFilename, threads);
+   if (queries.dimension != tree.dimension()
+       || originalPoints.dimension != tree.dimension())
+   {
+      cerr << "The points are not all of the tree's dimension, "
+	   << tree.dimension() << endl;
+      exit(1);
+   }
 
    // Create a results file
-   string resultsFilename(argv[3]);
+   string resultsFilename(queryFilename);
    resultsFilename += ".results";
    ofstream outfile(resultsFilename);
 
-   for (const auto& query : queries)
+   if (radius >= 0)
+   {
+      vector< vector<Neighbor> > found(queries.size());
+      resetKDTreeQueryStats();
+      const auto start = chrono::steady_clock::now();
+      parallelFor(queries.size(), threads,
+		  [&](size_t qq, int)
+		  {
+		     tree.radiusSearch(queries[qq], radius, found[qq]);
+		  });
+      const chrono::duration<double> elapsed =
+	 chrono::steady_clock::now() - start;
+      cout << "Answered " << queries.size() << " queries in "
+	   << elapsed.count() << " s ("
+	   << queries.size()/elapsed.count() << " queries/s)" << endl;
+#ifdef KDTREE_STATS
+      cout << kdTreeQueryStats();
+#endif
+
+      for (int qq=0; qq<queries.size(); ++qq)
+      {
+	 vector<int> indices;
+	 for (const Neighbor& neighbor : found[qq])
+	 {
+	    indices.push_back(neighbor.index);
+	 }
+	 sort(indices.begin(), indices.end());
+
+	 if (indices != bruteForceWithin(originalPoints, queries[qq], radius)
+	     || tree.radiusCount(queries[qq], radius) != int(indices.size()))
+	 {
+	    cerr << "**ERROR** Points within the radius don't match" << endl;
+	    outfile.close();
+	    exit(1);
+	 }
+
+	 for (int index : indices)
+	 {
+	    outfile << index << " ";
+	 }
+	 outfile << endl;
+      }
+      outfile.close();
+      cout << "Success!" << endl;
+      return 0;
+   }
+
+   // Quantize the original points, if asked to
+   QuantizedKDTree<int16_t, DATA_TYPE> quantized16;
+   QuantizedKDTree<uint8_t, DATA_TYPE> quantized8;
+   if (settings.quantizeBits != 0)
+   {
+      KDTreeBuildOptions buildOptions;
+      buildOptions.threads = threads;
+      const auto buildStart = chrono::steady_clock::now();
+      if (settings.quantizeBits == 16)
+      {
+	 quantized16.build(originalPoints.coords.data(),
+			   originalPoints.size(), originalPoints.dimension,
+			   buildOptions);
+      }
+      else
+      {
+	 quantized8.build(originalPoints.coords.data(),
+			  originalPoints.size(), originalPoints.dimension,
+			  buildOptions);
+      }
+      const chrono::duration<double> buildElapsed =
+	 chrono::steady_clock::now() - buildStart;
+      cout << "Quantized " << originalPoints.size() << " points to "
+	   << settings.quantizeBits << " bits in " << buildElapsed.count()
+	   << " s, using "
+	   << (settings.quantizeBits == 16
+	       ? quantized16.memoryUsage()
+	       : quantized8.memoryUsage())
+	   << " bytes (" << tree.memoryUsage() << " unquantized)" << endl;
+   }
+
+   // Answer all of the queries as a single batch
+   vector<Neighbor> results(queries.size()*k);
+   resetKDTreeQueryStats();
+   const auto start = chrono::steady_clock::now();
+   if (dualTree)
+   {
+      FlatKDTree<DATA_TYPE> queryTree;
+      KDTreeBuildOptions buildOptions;
+      buildOptions.threads = threads;
+      queryTree.build(queries.coords.data(), queries.size(),
+		      queries.dimension, buildOptions);
+      tree.allNearestNeighbors(queryTree, k, results, threads);
+   }
+   else if (settings.quantizeBits == 16)
+   {
+      quantized16.kNearestNeighborsBatch(queries.coords.data(),
+					 queries.size(), k, results.data(),
+					 threads);
+   }
+   else if (settings.quantizeBits == 8)
+   {
+      quantized8.kNearestNeighborsBatch(queries.coords.data(),
+					queries.size(), k, results.data(),
+					threads);
+   }
+   else if (k > 1)
    {
-      IndexedPoint<DATA_TYPE> best = tree.nearestNeighbor(query);
+      tree.kNearestNeighborsBatch(queries.coords.data(), queries.size(), k,
+				  results.data(), threads, queryOptions);
+   }
+   else
+   {
+      tree.nearestNeighborBatch(queries.coords.data(), queries.size(),
+				results.data(), threads, queryOptions);
+   }
+   const chrono::duration<double> elapsed =
+      chrono::steady_clock::now() - start;
+   cout << "Answered " << queries.size() << " queries in "
+	<< elapsed.count() << " s ("
+	<< queries.size()/elapsed.count() << " queries/s)" << endl;
+#ifdef KDTREE_STATS
+   cout << kdTreeQueryStats();
+#endif
+
+   // Approximate results aren't expected to match the ground truth;
+   // instead, report the fraction of the true neighbors that were found
+   const bool approximate = queryOptions.epsilon > 0
+      || queryOptions.maxLeaves > 0;
+   size_t expectedCount = 0;
+   size_t foundCount = 0;
+
+   if (k > 1)
+   {
+      for (int qq=0; qq<queries.size(); ++qq)
+      {
+	 const DATA_TYPE* query = queries[qq];
+	 const Neighbor* neighbors = &results[qq*k];
+	 vector<int> bruteForceIndices = bruteForceKClosest(originalPoints,
+							    query, k);
+
+	 // Check indices, in order of distance. If the tree holds fewer
+	 // than k points, the missing neighbors have an index of -1.
+	 bool match = true;
+	 for (int ii=0; match && ii<k; ++ii)
+	 {
+	    const int expected = ii < bruteForceIndices.size()
+	       ? bruteForceIndices[ii]
+	       : -1;
+	    match = neighbors[ii].index == expected;
+	 }
+	 if (!match && !approximate)
+	 {
+	    cerr << "**ERROR** k nearest neighbor indices don't match" << endl;
+	    outfile.close();
+	    exit(1);
+	 }
+	 expectedCount += bruteForceIndices.size();
+	 for (int ii=0; ii<k; ++ii)
+	 {
+	    foundCount += count(bruteForceIndices.begin(),
+				bruteForceIndices.end(), neighbors[ii].index);
+	 }
+
+	 for (int ii=0; ii<bruteForceIndices.size(); ++ii)
+	 {
+	    outfile << neighbors[ii].index << " ";
+	 }
+	 outfile << endl;
+      }
+      outfile.close();
+      if (approximate)
+      {
+	 cout << "Recall: " << double(foundCount)/expectedCount << endl;
+      }
+      cout << "Success!" << endl;
+      return 0;
+   }
+
+   for (int qq=0; qq<queries.size(); ++qq)
+   {
+      const DATA_TYPE* query = queries[qq];
+      const Neighbor& best = results[qq];
       int bruteForceIndex = bruteForceClosest(originalPoints, query);
 
       // Check indices
+      ++expectedCount;
       if (best.index != bruteForceIndex)
       {
+	 if (approximate)
+	 {
+	    outfile << best.index << endl;
+	    continue;
+	 }
 	 cerr << "**ERROR** Result indices don't match" << endl;
 	 outfile.close();
 	 exit(1);
       }
+      ++foundCount;
 
-      // ..then check the actual points, in case there was an order
-      // change
-      DATA_TYPE diff = 0;
-      for (int ii=0; ii<query.size(); ++ii) // query.size is the
-					    // dimension of all points
+      // ..then check the distances, in case the deserialized points
+      // differ from the original ones. The tree may sum the squares in a
+      // different order, so allow for rounding.
+      double dist = 0;
+      for (int ii=0; ii<queries.dimension; ++ii)
       {
-	 diff += fabs(best.point[ii] - originalPoints[bruteForceIndex][ii]);
+	 double linDiff = double(originalPoints[bruteForceIndex][ii])
+	    - double(query[ii]);
+	 dist += linDiff*linDiff;
       }
-      if (diff > 0)
+      if (fabs(best.sqrDistance - dist) > 1e-12*max<double>(dist, 1))
       {
 	 cout << "**ERROR**  Deserialized tree results don't match brute "
-	      << "force results, with total L1 error " << diff << endl;
+	      << "force results, with squared distance error "
+	      << fabs(best.sqrDistance - dist) << endl;
 	 outfile.close();
 	 exit(1);
       }
       outfile << best.index << endl;
    }
    outfile.close();
+   if (approximate)
+   {
+      cout << "Recall: " << double(foundCount)/expectedCount << endl;
+   }
    cout << "Success!" << endl;
+   return 0;
 }
 
-vector< vector<DATA_TYPE> > readPointsFromFile(const char* filename)
+template<class DATA_TYPE>
+int queryShardedTree(const Settings& settings)
 {
-   ifstream datafile(filename, ifstream::in);
+   const int k = settings.k;
+   const double radius = settings.radius;
+   const char* treeFilename = settings.treeFilename;
+
+   cout << "Loading the routing index " << treeFilename
+	<< " and mapping its shards" << endl;
+   ShardedKDTree<DATA_TYPE> tree;
+   const auto loadStart = chrono::steady_clock::now();
+   if (!tree.load(treeFilename))
+   {
+      exit(1);
+   }
+   const chrono::duration<double> loadElapsed =
+      chrono::steady_clock::now() - loadStart;
+   cout << "Loaded " << tree.size() << " points in " << tree.shardCount()
+	<< " shards in " << loadElapsed.count() << " s" << endl;
 
-   // Read the first line to determine the dimensionality
-   int dimension = 0;
-   if (datafile.is_open())
+   cout << "Reading original points from " << settings.dataFilename << endl;
+   const PointSet<DATA_TYPE> originalPoints =
+      readPoints<DATA_TYPE>(settings.dataFilename, settings.threads);
+   cout << "Reading query points from " << settings.queryFilename << endl;
+   const PointSet<DATA_TYPE> queries =
+      readPoints<DATA_TYPE>(settings.queryFilename, settings.threads);
+   if (queries.dimension != tree.dimension()
+       || originalPoints.dimension != tree.dimension())
    {
-      string line;
-      if (getline(datafile, line))
+      cerr << "The points are not all of the tree's dimension, "
+	   << tree.dimension() << endl;
+      exit(1);
+   }
+
+   // Answer the queries, each one searching as many shards as it needs
+   vector< vector<Neighbor> > found(queries.size());
+   resetKDTreeQueryStats();
+   const auto start = chrono::steady_clock::now();
+   parallelFor(queries.size(), settings.threads,
+	       [&](size_t qq, int)
+	       {
+		  if (radius >= 0)
+		  {
+		     tree.radiusSearch(queries[qq], radius, found[qq]);
+		  }
+		  else
+		  {
+		     found[qq] = tree.kNearestNeighbors(queries[qq], k);
+		  }
+	       });
+   const chrono::duration<double> elapsed =
+      chrono::steady_clock::now() - start;
+   cout << "Answered " << queries.size() << " queries in "
+	<< elapsed.count() << " s ("
+	<< queries.size()/elapsed.count() << " queries/s)" << endl;
+#ifdef KDTREE_STATS
+   cout << kdTreeQueryStats();
+#endif
+
+   string resultsFilename(settings.queryFilename);
+   resultsFilename += ".results";
+   ofstream outfile(resultsFilename);
+   for (int qq=0; qq<queries.size(); ++qq)
+   {
+      vector<int> indices;
+      for (const Neighbor& neighbor : found[qq])
       {
-	 stringstream ss(line);
-	 DATA_TYPE val;
-	 while (ss >> val)
+	 indices.push_back(neighbor.index);
+      }
+
+      // Points within the radius come in no particular order, and
+      // neighbors in order of distance
+      if (radius >= 0)
+      {
+	 sort(indices.begin(), indices.end());
+      }
+      const vector<int> expected = radius >= 0
+	 ? bruteForceWithin(originalPoints, queries[qq], radius)
+	 : bruteForceKClosest(originalPoints, queries[qq], k);
+      if (indices != expected)
+      {
+	 cerr << "**ERROR** Sharded tree results don't match brute force "
+	      << "results" << endl;
+	 outfile.close();
+	 exit(1);
+      }
+
+      for (int index : indices)
+      {
+	 outfile << index << " ";
+      }
+      outfile << endl;
+   }
+   outfile.close();
+   cout << "Success!" << endl;
+   return 0;
+}
+
+template<class DATA_TYPE>
+int queryDynamicTree(const Settings& settings)
+{
+   const int k = settings.k;
+   const double radius = settings.radius;
+
+   cout << "Reading original points from " << settings.dataFilename << endl;
+   const PointSet<DATA_TYPE> originalPoints =
+      readPoints<DATA_TYPE>(settings.dataFilename, settings.threads);
+   cout << "Reading query points from " << settings.queryFilename << endl;
+   const PointSet<DATA_TYPE> queries =
+      readPoints<DATA_TYPE>(settings.queryFilename, settings.threads);
+   const int dimension = originalPoints.dimension;
+   if (queries.dimension != dimension)
+   {
+      cerr << "The query points are not of the original points' "
+	   << "dimension, " << dimension << endl;
+      exit(1);
+   }
+
+   // Build the first half of the points and erase two in three of
+   // them, which rebuilds the forest once half of them are gone and
+   // leaves the rest marked in the new tree. Then insert the second
+   // half one at a time, so that each point's id is its index, into
+   // trees of several sizes and the buffer, and erase one in three of
+   // those.
+   const int count = originalPoints.size();
+   const int half = count/2;
+   auto erased = [half](int pp) { return pp < half ? pp % 3 != 0
+					   : pp % 3 == 1; };
+   DynamicKDTree<DATA_TYPE> tree(dimension);
+   auto erasePoints = [&](int begin, int end)
+   {
+      for (int pp=begin; pp<end; ++pp)
+      {
+	 if (erased(pp) && (!tree.erase(pp) || tree.erase(pp)))
 	 {
-	    dimension++;
-	    if (ss.peek() == ',')
-	       ss.ignore();
+	    cerr << "**ERROR** Erasing point " << pp << " from the "
+		 << "DynamicKDTree didn't succeed exactly once" << endl;
+	    exit(1);
 	 }
       }
+   };
+   const auto buildStart = chrono::steady_clock::now();
+   if (!tree.build(originalPoints[0], half))
+   {
+      cerr << "Failed to build a DynamicKDTree of the original points"
+	   << endl;
+      exit(1);
+   }
+   erasePoints(0, half);
+   for (int pp=half; pp<count; ++pp)
+   {
+      if (tree.insert(originalPoints[pp]) != pp)
+      {
+	 cerr << "**ERROR** Inserting point " << pp << " into the "
+	      << "DynamicKDTree didn't give it the id " << pp << endl;
+	 exit(1);
+      }
    }
+   erasePoints(half, count);
 
-   if (dimension < 1)
+   PointSet<DATA_TYPE> remaining;
+   remaining.dimension = dimension;
+   vector<int> remainingIndices;
+   for (int pp=0; pp<count; ++pp)
    {
-      cout << filename << " is improperly formatted or empty";
+      if (!erased(pp))
+      {
+	 remaining.coords.insert(remaining.coords.end(), originalPoints[pp],
+				 originalPoints[pp] + dimension);
+	 remainingIndices.push_back(pp);
+      }
+   }
+   const chrono::duration<double> buildElapsed =
+      chrono::steady_clock::now() - buildStart;
+   cout << "Inserted " << count << " points into a DynamicKDTree and "
+	<< "erased " << count - tree.size() << " in "
+	<< buildElapsed.count() << " s, leaving " << tree.treeCount()
+	<< " trees holding " << tree.erasedCount() << " erased points"
+	<< endl;
+   if (tree.size() != int(remainingIndices.size()))
+   {
+      cerr << "**ERROR** The DynamicKDTree holds " << tree.size()
+	   << " points rather than " << remainingIndices.size() << endl;
       exit(1);
    }
 
-   // Rewind the file to the beginnning and parse
-   datafile.seekg(0, datafile.beg);
-   vector< vector<DATA_TYPE> > points;
-   if (datafile.is_open())
+   vector< vector<Neighbor> > found(queries.size());
+   resetKDTreeQueryStats();
+   const auto start = chrono::steady_clock::now();
+   parallelFor(queries.size(), settings.threads,
+	       [&](size_t qq, int)
+	       {
+		  if (radius >= 0)
+		  {
+		     tree.radiusSearch(queries[qq], radius, found[qq]);
+		  }
+		  else
+		  {
+		     found[qq] = tree.kNearestNeighbors(queries[qq], k);
+		  }
+	       });
+   const chrono::duration<double> elapsed =
+      chrono::steady_clock::now() - start;
+   cout << "Answered " << queries.size() << " queries in "
+	<< elapsed.count() << " s ("
+	<< queries.size()/elapsed.count() << " queries/s)" << endl;
+#ifdef KDTREE_STATS
+   cout << kdTreeQueryStats();
+#endif
+
+   string resultsFilename(settings.queryFilename);
+   resultsFilename += ".results";
+   ofstream outfile(resultsFilename);
+   for (int qq=0; qq<queries.size(); ++qq)
+   {
+      vector<int> indices;
+      for (const Neighbor& neighbor : found[qq])
+      {
+	 indices.push_back(neighbor.index);
+      }
+
+      // Points within the radius come in no particular order, and
+      // neighbors in order of distance
+      if (radius >= 0)
+      {
+	 sort(indices.begin(), indices.end());
+      }
+      vector<int> expected = radius >= 0
+	 ? bruteForceWithin(remaining, queries[qq], radius)
+	 : bruteForceKClosest(remaining, queries[qq], k);
+      for (int& index : expected)
+      {
+	 index = remainingIndices[index];
+      }
+      if (indices != expected)
+      {
+	 cerr << "**ERROR** DynamicKDTree results don't match brute force "
+	      << "results" << endl;
+	 outfile.close();
+	 exit(1);
+      }
+
+      for (int index : indices)
+      {
+	 outfile << index << " ";
+      }
+      outfile << endl;
+   }
+   outfile.close();
+   cout << "Success!" << endl;
+   return 0;
+}
+
+template<class DATA_TYPE>
+int querySharedTree(const Settings& settings)
+{
+   const int k = settings.k;
+   const double radius = settings.radius;
+
+   cout << "Reading original points from " << settings.dataFilename << endl;
+   const PointSet<DATA_TYPE> originalPoints =
+      readPoints<DATA_TYPE>(settings.dataFilename, settings.threads);
+   cout << "Reading query points from " << settings.queryFilename << endl;
+   const PointSet<DATA_TYPE> queries =
+      readPoints<DATA_TYPE>(settings.queryFilename, settings.threads);
+   const int dimension = originalPoints.dimension;
+   if (queries.dimension != dimension)
+   {
+      cerr << "The query points are not of the original points' "
+	   << "dimension, " << dimension << endl;
+      exit(1);
+   }
+   if (originalPoints.size() < 2)
+   {
+      cerr << "Swapping trees needs at least two original points" << endl;
+      exit(1);
+   }
+
+   // The two versions of the tree, told apart by their sizes: the even
+   // points and all of the points. Each version's results index its
+   // own points.
+   PointSet<DATA_TYPE> evenPoints;
+   evenPoints.dimension = dimension;
+   for (size_t pp=0; pp<originalPoints.size(); pp+=2)
+   {
+      evenPoints.coords.insert(evenPoints.coords.end(), originalPoints[pp],
+			       originalPoints[pp] + dimension);
+   }
+   const PointSet<DATA_TYPE>* versionPoints[2] = {&evenPoints,
+						   &originalPoints};
+   vector< vector<int> > expectedResults[2];
+   for (int vv=0; vv<2; ++vv)
+   {
+      const PointSet<DATA_TYPE>& points = *versionPoints[vv];
+      expectedResults[vv].resize(queries.size());
+      parallelFor(queries.size(), settings.threads,
+		  [&](size_t qq, int)
+		  {
+		     expectedResults[vv][qq] = radius >= 0
+			? bruteForceWithin(points, queries[qq], radius)
+			: bruteForceKClosest(points, queries[qq], k);
+		  });
+   }
+
+   auto buildVersion = [&](int version)
+   {
+      const PointSet<DATA_TYPE>& points = *versionPoints[version];
+      FlatKDTree<DATA_TYPE> tree;
+      if (!tree.build(points.coords.data(), points.size(), dimension))
+      {
+	 cerr << "Failed to build a tree of the original points" << endl;
+	 exit(1);
+      }
+      return tree;
+   };
+   SharedKDTree< FlatKDTree<DATA_TYPE> > shared(
+      make_shared< const FlatKDTree<DATA_TYPE> >(buildVersion(1)));
+
+   // Publish the versions in turn, building each one while the readers
+   // query the last, and keep answering the queries until the last one
+   // is out
+   atomic<bool> publishing(true);
+   thread writer([&]()
+		 {
+		    for (int ii=0; ii<settings.publishes; ++ii)
+		    {
+		       shared.publish(buildVersion(ii % 2 == 0 ? 0 : 1));
+		    }
+		    publishing = false;
+		 });
+
+   atomic<long> answered[2] = {{0}, {0}};
+   atomic<bool> mismatched(false);
+   int rounds = 0;
+   resetKDTreeQueryStats();
+   const auto start = chrono::steady_clock::now();
+   do
+   {
+      parallelFor(queries.size(), settings.threads,
+		  [&](size_t qq, int)
+		  {
+		     const auto tree = shared.snapshot();
+		     const int version =
+			tree->size() == int(originalPoints.size()) ? 1 : 0;
+		     vector<Neighbor> found;
+		     if (radius >= 0)
+		     {
+			tree->radiusSearch(queries[qq], radius, found);
+		     }
+		     else
+		     {
+			found = tree->kNearestNeighbors(queries[qq], k);
+		     }
+
+		     vector<int> indices;
+		     for (const Neighbor& neighbor : found)
+		     {
+			indices.push_back(neighbor.index);
+		     }
+		     if (radius >= 0)
+		     {
+			sort(indices.begin(), indices.end());
+		     }
+		     if (indices != expectedResults[version][qq])
+		     {
+			mismatched = true;
+		     }
+		     ++answered[version];
+		  });
+      ++rounds;
+   } while (publishing);
+   writer.join();
+   const chrono::duration<double> elapsed =
+      chrono::steady_clock::now() - start;
+   cout << "Answered " << queries.size() << " queries " << rounds
+	<< " times in " << elapsed.count() << " s while publishing "
+	<< settings.publishes << " trees (" << answered[0] << " from "
+	<< "trees of the even points, " << answered[1] << " from trees of "
+	<< "all of them)" << endl;
+#ifdef KDTREE_STATS
+   cout << kdTreeQueryStats();
+#endif
+
+   if (mismatched)
+   {
+      cerr << "**ERROR** Shared tree results don't match brute force "
+	   << "results" << endl;
+      exit(1);
+   }
+   cout << "Success!" << endl;
+   return 0;
+}
+
+template<class DATA_TYPE>
+int queryMetricTree(const Settings& settings)
+{
+   cout << "Reading original points from " << settings.dataFilename << endl;
+   PointSet<DATA_TYPE> originalPoints =
+      readPoints<DATA_TYPE>(settings.dataFilename, settings.threads);
+   cout << "Reading query points from " << settings.queryFilename << endl;
+   PointSet<DATA_TYPE> queries =
+      readPoints<DATA_TYPE>(settings.queryFilename, settings.threads);
+   const int dimension = originalPoints.dimension;
+   if (queries.dimension != dimension)
+   {
+      cerr << "The query points are not of the original points' "
+	   << "dimension, " << dimension << endl;
+      exit(1);
+   }
+
+   const string metric(settings.metric);
+   if (metric == "manhattan")
+   {
+      return queryMetricTree(settings, ManhattanMetric(), vector<double>(),
+			     originalPoints, queries);
+   }
+   if (metric == "chebyshev")
+   {
+      return queryMetricTree(settings, ChebyshevMetric(), vector<double>(),
+			     originalPoints, queries);
+   }
+   if (metric == "weighted")
+   {
+      vector<double> weights(dimension);
+      for (int aa=0; aa<dimension; ++aa)
+      {
+	 weights[aa] = aa + 1;
+      }
+      return queryMetricTree(settings, WeightedEuclideanMetric(weights),
+			     weights, originalPoints, queries);
+   }
+   if (metric == "periodic")
    {
-      string line;
-      while (getline(datafile, line))
+      // Shift every axis to start at 0, and make its period a little
+      // longer than the points' extent, so that points near either end
+      // are neighbors across the wrap
+      vector<DATA_TYPE> low(dimension, numeric_limits<DATA_TYPE>::max());
+      vector<DATA_TYPE> high(dimension, numeric_limits<DATA_TYPE>::lowest());
+      for (const PointSet<DATA_TYPE>* points : {&originalPoints, &queries})
       {
-	 stringstream ss(line);
-	 vector<DATA_TYPE> lineData;
-	 DATA_TYPE val;
-	 while (ss >> val)
+	 for (size_t cc=0; cc<points->coords.size(); ++cc)
 	 {
-	    lineData.push_back(val);
-	    if (ss.peek() == ',')
-	       ss.ignore();
+	    low[cc % dimension] = min(low[cc % dimension], points->coords[cc]);
+	    high[cc % dimension] = max(high[cc % dimension],
+				       points->coords[cc]);
 	 }
-	 points.push_back(lineData);
       }
-      datafile.close();
+      vector<double> periods(dimension);
+      for (int aa=0; aa<dimension; ++aa)
+      {
+	 periods[aa] = high[aa] > low[aa] ? 1.25*(high[aa] - low[aa]) : 1;
+      }
+      for (PointSet<DATA_TYPE>* points : {&originalPoints, &queries})
+      {
+	 for (size_t cc=0; cc<points->coords.size(); ++cc)
+	 {
+	    points->coords[cc] -= low[cc % dimension];
+	 }
+      }
+      return queryMetricTree(settings, PeriodicEuclideanMetric(periods),
+			     periods, originalPoints, queries);
+   }
+   return queryMetricTree(settings, EuclideanMetric(), vector<double>(),
+			  originalPoints, queries);
+}
+
+template<class DATA_TYPE, class Metric>
+int queryMetricTree(const Settings& settings, const Metric& metric,
+		    const vector<double>& parameters,
+		    const PointSet<DATA_TYPE>& originalPoints,
+		    const PointSet<DATA_TYPE>& queries)
+{
+   const int dimension = originalPoints.dimension;
+   const string metricName(settings.metric);
+
+   vector< vector<DATA_TYPE> > rows(originalPoints.size());
+   for (size_t pp=0; pp<originalPoints.size(); ++pp)
+   {
+      rows[pp].assign(originalPoints[pp], originalPoints[pp] + dimension);
+   }
+   KDTree<DATA_TYPE, Metric> tree(metric);
+   const auto buildStart = chrono::steady_clock::now();
+   if (!tree.build(rows))
+   {
+      cerr << "Failed to build a KDTree of the original points" << endl;
+      exit(1);
+   }
+   const chrono::duration<double> buildElapsed =
+      chrono::steady_clock::now() - buildStart;
+   cout << "Built a KDTree of " << rows.size() << " points under the "
+	<< metricName << " metric in " << buildElapsed.count() << " s"
+	<< endl;
+
+   vector<Neighbor> found(queries.size());
+   resetKDTreeQueryStats();
+   const auto start = chrono::steady_clock::now();
+   parallelFor(queries.size(), settings.threads,
+	       [&](size_t qq, int)
+	       {
+		  found[qq] = tree.nearestNeighbor(queries[qq]);
+	       });
+   const chrono::duration<double> elapsed =
+      chrono::steady_clock::now() - start;
+   cout << "Answered " << queries.size() << " queries in "
+	<< elapsed.count() << " s ("
+	<< queries.size()/elapsed.count() << " queries/s)" << endl;
+#ifdef KDTREE_STATS
+   cout << kdTreeQueryStats();
+#endif
+
+   // Points are often tied under the Manhattan and Chebyshev metrics,
+   // so check the distance of the neighbor found rather than its index
+   string resultsFilename(settings.queryFilename);
+   resultsFilename += ".results";
+   ofstream outfile(resultsFilename);
+   for (int qq=0; qq<queries.size(); ++qq)
+   {
+      double bestDist = numeric_limits<double>::max();
+      for (int pp=0; pp<originalPoints.size(); ++pp)
+      {
+	 bestDist = min(bestDist,
+			bruteForceDistance(metricName, parameters,
+					   originalPoints[pp], queries[qq],
+					   dimension));
+      }
+
+      const Neighbor& neighbor = found[qq];
+      const double tolerance = 1e-12*max(bestDist, 1.0);
+      if (neighbor.index < 0 || neighbor.index >= int(originalPoints.size())
+	  || fabs(bruteForceDistance(metricName, parameters,
+				     originalPoints[neighbor.index],
+				     queries[qq], dimension)
+		  - bestDist) > tolerance
+	  || fabs(neighbor.sqrDistance - bestDist) > tolerance)
+      {
+	 cerr << "**ERROR** KDTree results under the " << metricName
+	      << " metric don't match brute force results" << endl;
+	 outfile.close();
+	 exit(1);
+      }
+      outfile << neighbor.index << endl;
+   }
+   outfile.close();
+   cout << "Success!" << endl;
+   return 0;
+}
+
+uint32_t treeCoordinateType(const char* filename)
+{
+   FlatKDTreeHeader header;
+   ifstream infile(filename, ifstream::in | ifstream::binary);
+   if (!infile.read(reinterpret_cast<char*>(&header), sizeof(header)))
+   {
+      return 0;
    }
-   cout << "Read " << points.size() << " vectors of size " << dimension
-	<< endl << endl;
+   return header.coordinateType;
+}
+
+bool isShardedTree(const char* filename)
+{
+   char magic[8];
+   ifstream infile(filename, ifstream::in | ifstream::binary);
+   return infile.read(magic, sizeof(magic))
+      && memcmp(magic, "KDSHARDS", sizeof(magic)) == 0;
+}
+
+template<class DATA_TYPE>
+PointSet<DATA_TYPE> readPoints(const char* filename, int threads)
+{
+   PointSet<DATA_TYPE> points;
+   if (!readPointsFromFile(filename, points, threads))
+   {
+      exit(1);
+   }
+   cout << "Read " << points.size() << " vectors of size "
+	<< points.dimension << endl << endl;
    return points;
 }
 
-int bruteForceClosest(const vector<vector<DATA_TYPE>>& data,
-		      const vector<DATA_TYPE>& query)
+template<class DATA_TYPE>
+int bruteForceClosest(const PointSet<DATA_TYPE>& data,
+		      const DATA_TYPE* query)
 {
-   const int dimension = query.size();
+   const int dimension = data.dimension;
 
-   vector<DATA_TYPE> best;
    int bestIndex = -1;
-   DATA_TYPE bestDist = numeric_limits<DATA_TYPE>::max();
+   double bestDist = numeric_limits<double>::max();
    for (int dd=0; dd<data.size(); ++dd)
    {
-      DATA_TYPE dist = 0;
+      double dist = 0;
       for (int ii=0; ii<dimension; ++ii)
       {
-	 DATA_TYPE linDiff = data[dd][ii] - query[ii];
+	 double linDiff = double(data[dd][ii]) - double(query[ii]);
 	 dist += linDiff*linDiff;
       }
 
       if (dist < bestDist)
       {
 	 bestDist = dist;
-	 best = data[dd];
 	 bestIndex = dd;
       }
    }
 
    return bestIndex;
 }
+
+template<class DATA_TYPE>
+vector<int> bruteForceKClosest(const PointSet<DATA_TYPE>& data,
+			       const DATA_TYPE* query, int k)
+{
+   const int dimension = data.dimension;
+
+   vector< pair<double, int> > distances;
+   for (int dd=0; dd<data.size(); ++dd)
+   {
+      double dist = 0;
+      for (int ii=0; ii<dimension; ++ii)
+      {
+	 double linDiff = double(data[dd][ii]) - double(query[ii]);
+	 dist += linDiff*linDiff;
+      }
+      distances.push_back(make_pair(dist, dd));
+   }
+
+   k = min<int>(k, distances.size());
+   partial_sort(distances.begin(), distances.begin() + k, distances.end());
+
+   vector<int> indices;
+   for (int ii=0; ii<k; ++ii)
+   {
+      indices.push_back(distances[ii].second);
+   }
+
+   return indices;
+}
+
+template<class DATA_TYPE>
+vector<int> bruteForceWithin(const PointSet<DATA_TYPE>& data,
+			     const DATA_TYPE* query, double radius)
+{
+   const int dimension = data.dimension;
+
+   vector<int> indices;
+   for (int dd=0; dd<data.size(); ++dd)
+   {
+      double dist = 0;
+      for (int ii=0; ii<dimension; ++ii)
+      {
+	 double linDiff = double(data[dd][ii]) - double(query[ii]);
+	 dist += linDiff*linDiff;
+      }
+
+      if (dist <= radius*radius)
+      {
+	 indices.push_back(dd);
+      }
+   }
+
+   return indices;
+}
+
+template<class DATA_TYPE>
+double bruteForceDistance(const string& metric,
+			  const vector<double>& parameters,
+			  const DATA_TYPE* a, const DATA_TYPE* b,
+			  int dimension)
+{
+   double dist = 0;
+   for (int ii=0; ii<dimension; ++ii)
+   {
+      double linDiff = fabs(double(a[ii]) - double(b[ii]));
+      if (metric == "manhattan")
+      {
+	 dist += linDiff;
+      }
+      else if (metric == "chebyshev")
+      {
+	 dist = max(dist, linDiff);
+      }
+      else if (metric == "weighted")
+      {
+	 dist += parameters[ii]*linDiff*linDiff;
+      }
+      else
+      {
+	 // Along a periodic axis, the shorter way round
+	 if (metric == "periodic" && parameters[ii] - linDiff < linDiff)
+	 {
+	    linDiff = parameters[ii] - linDiff;
+	 }
+	 dist += linDiff*linDiff;
+      }
+   }
+
+   return dist;
+}